@@ -0,0 +1,714 @@
+#include <string>
+#include <iostream>
+#include <chrono>
+#include <algorithm>
+#include <random>
+#include <vector>
+#include <atomic>
+#include <new>
+#include <cstdlib>
+#include <cstdio>
+
+#include "engine.h"
+#include "thread_pool.h"
+#include "calculation_service.h"
+
+// Global allocation accounting: every block carries its size in a header, so live and peak bytes are known.
+static std::atomic<std::size_t> allocation_count{0};
+static std::atomic<std::size_t> allocated_bytes{0};
+static std::atomic<std::size_t> live_bytes{0};
+static std::atomic<std::size_t> peak_bytes{0};
+static const std::size_t allocation_header = alignof(std::max_align_t);
+
+void *operator new(std::size_t size) {
+    char *block = static_cast<char *>(std::malloc(size + allocation_header));
+    if (block == nullptr) {
+        throw std::bad_alloc();
+    }
+    *reinterpret_cast<std::size_t *>(block) = size;
+    allocation_count++;
+    allocated_bytes += size;
+    std::size_t live = live_bytes += size;
+    std::size_t peak = peak_bytes.load();
+    while (live > peak && !peak_bytes.compare_exchange_weak(peak, live)) {
+    }
+    return block + allocation_header;
+}
+
+void operator delete(void *memory) noexcept {
+    if (memory != nullptr) {
+        char *block = static_cast<char *>(memory) - allocation_header;
+        live_bytes -= *reinterpret_cast<std::size_t *>(block);
+        std::free(block);
+    }
+}
+
+void operator delete(void *memory, std::size_t) noexcept {
+    operator delete(memory);
+}
+
+// allocations, allocated bytes and peak heap growth between its construction and the calls
+class allocation_meter {
+    const std::size_t start_count;
+    const std::size_t start_allocated;
+    const std::size_t start_bytes;
+
+public:
+    allocation_meter() : start_count(allocation_count), start_allocated(allocated_bytes), start_bytes(live_bytes) {
+        peak_bytes = start_bytes;
+    }
+
+    std::size_t allocations() const {
+        return allocation_count - start_count;
+    }
+
+    std::size_t bytes() const {
+        return allocated_bytes - start_allocated;
+    }
+
+    std::size_t peak() const {
+        return peak_bytes - start_bytes;
+    }
+};
+
+// ns/token of the largest formula may not exceed the smallest one's by more than this factor
+static const double max_scaling_ratio = 4;
+
+static const int scaling_sizes[] = {10000, 100000, 1000000};
+
+static std::string flat_chain(int tokens) {
+    std::string formula = "1";
+    for (int i = 1; i + 1 < tokens; i += 2) {
+        formula += "+1";
+    }
+    return formula;
+}
+
+static std::string mixed_chain(int tokens) {
+    static const char operators[] = {'*', '+', '/', '-'};
+    std::string formula = "2";
+    for (int i = 1; i + 1 < tokens; i += 2) {
+        formula += operators[(i / 2) % 4];
+        formula += "3";
+    }
+    return formula;
+}
+
+static std::string nested_groups(int tokens) {
+    int depth = (tokens - 1) / 2;
+    return std::string(depth, '(') + "1" + std::string(depth, ')');
+}
+
+// random mix of literals, all operators, unary minus and parentheses, up to `depth` levels deep
+static std::string random_formula(std::mt19937 &random, int depth) {
+    std::uniform_int_distribution<int> choice(0, 9);
+    int kind = depth == 0 ? 0 : choice(random);
+    if (kind < 3) {
+        std::uniform_int_distribution<int> digits(1, 999);
+        return std::to_string(digits(random)) + "." + std::to_string(digits(random));
+    }
+    if (kind == 3) {
+        return "-" + random_formula(random, depth - 1);
+    }
+    if (kind == 4) {
+        return "(" + random_formula(random, depth - 1) + ")";
+    }
+    static const char *operators[] = {" + ", " - ", " * ", " / "};
+    return random_formula(random, depth - 1) + operators[kind % 4] + random_formula(random, depth - 1);
+}
+
+static std::vector<std::string> formula_corpus(int size) {
+    std::mt19937 random(42);
+    std::vector<std::string> corpus;
+    for (int i = 0; i < size; i++) {
+        corpus.push_back(random_formula(random, 8));
+    }
+    return corpus;
+}
+
+static void backend_bench(const std::string &name, evaluation_backend backend, std::uint64_t jit_threshold,
+                          const std::vector<std::string> &corpus) {
+    compile_options options;
+    options.backend = backend;
+    // a folded formula would be a single literal for either backend
+    options.optimize = false;
+    options.jit_threshold = jit_threshold;
+    std::vector<compiled_formula> compiled;
+    for (const std::string &formula : corpus) {
+        compiled.push_back(compile(formula, options));
+    }
+
+    const int rounds = 200;
+    volatile double sink = 0;
+    auto start = std::chrono::steady_clock::now();
+    for (int round = 0; round < rounds; round++) {
+        for (const compiled_formula &formula : compiled) {
+            sink = sink + formula.evaluate();
+        }
+    }
+    auto finish = std::chrono::steady_clock::now();
+    double ns = std::chrono::duration<double, std::nano>(finish - start).count();
+    std::printf("%-12s %8zu formulas  %10.2f ns/evaluation\n", name.c_str(), corpus.size(), ns / rounds / corpus.size());
+}
+
+static std::vector<std::string> repeated(std::string (*generator)(int), int tokens, int count) {
+    return std::vector<std::string>(count, generator(tokens));
+}
+
+// long decimal literals, so most of the time goes into scanning and converting numbers
+static std::vector<std::string> literal_corpus(int size) {
+    std::mt19937 random(7);
+    std::uniform_int_distribution<long long> digits(1, 999999999999LL);
+    std::vector<std::string> corpus;
+    for (int i = 0; i < size; i++) {
+        std::string formula = std::to_string(digits(random)) + "." + std::to_string(digits(random));
+        for (int operand = 1; operand < 100; operand++) {
+            formula += operand % 2 ? " + 0." : " * ";
+            formula += std::to_string(digits(random));
+        }
+        corpus.push_back(formula);
+    }
+    return corpus;
+}
+
+// the mixed corpus laid out like generated code, one operand per indented line
+static std::vector<std::string> indented_corpus(const std::vector<std::string> &corpus) {
+    std::vector<std::string> indented;
+    for (const std::string &formula : corpus) {
+        std::string layout;
+        for (char symbol : formula) {
+            layout += symbol == ' ' ? std::string(24, ' ') : std::string(1, symbol);
+        }
+        indented.push_back(layout);
+    }
+    return indented;
+}
+
+// Runs `operation` on every formula of the corpus, enough rounds to take a while, and prints per formula costs.
+template<typename operation>
+static void phase(const std::string &corpus_name, const char *phase_name, const std::vector<std::string> &corpus,
+                  operation run) {
+    std::size_t characters = 0;
+    for (const std::string &formula : corpus) {
+        characters += formula.size();
+    }
+    const std::size_t rounds = std::max<std::size_t>(1, 20000000 / characters);
+
+    allocation_meter meter;
+    auto start = std::chrono::steady_clock::now();
+    for (std::size_t round = 0; round < rounds; round++) {
+        for (std::size_t i = 0; i < corpus.size(); i++) {
+            run(i);
+        }
+    }
+    auto finish = std::chrono::steady_clock::now();
+    double operations = static_cast<double>(rounds) * corpus.size();
+    std::printf("%-12s %-10s %12.1f ns/op  %8.2f allocations/op  %10.1f bytes/op\n", corpus_name.c_str(), phase_name,
+                std::chrono::duration<double, std::nano>(finish - start).count() / operations,
+                meter.allocations() / operations, meter.bytes() / operations);
+}
+
+// Tokenizing only, parsing to a tree (tokenizing included), the whole compile(), evaluating an already
+// compiled formula and calculate() from text to value.
+static void phase_bench(const std::string &name, const std::vector<std::string> &corpus) {
+    compile_options tree;
+    tree.backend = evaluation_backend::tree;
+    tree.optimize = false;
+    // folded, the formulas would be single literals
+    compile_options unoptimized;
+    unoptimized.optimize = false;
+    std::vector<compiled_formula> compiled;
+    for (const std::string &formula : corpus) {
+        compiled.push_back(compile(formula, unoptimized));
+    }
+
+    volatile double sink = 0;
+    phase(name, "tokenize", corpus, [&corpus, &sink](std::size_t i) {
+        sink = sink + count_tokens(corpus[i]);
+    });
+    phase(name, "parse", corpus, [&corpus, &tree](std::size_t i) {
+        compile(corpus[i], tree);
+    });
+    phase(name, "compile", corpus, [&corpus](std::size_t i) {
+        compile(corpus[i]);
+    });
+    phase(name, "evaluate", corpus, [&compiled, &sink](std::size_t i) {
+        sink = sink + compiled[i].evaluate();
+    });
+    phase(name, "calculate", corpus, [&corpus, &sink](std::size_t i) {
+        sink = sink + calculate(corpus[i]);
+    });
+}
+
+static compiled_formula pricing_formula() {
+    compile_options options;
+    options.variables = {"price", "qty", "discount"};
+    return compile("price * qty - discount * (price / 100 + 1) - -qty", options);
+}
+
+static std::vector<std::vector<double>> pricing_columns(std::size_t rows) {
+    std::vector<std::vector<double>> columns(3, std::vector<double>(rows));
+    for (std::size_t row = 0; row < rows; row++) {
+        columns[0][row] = 1 + row % 1000 / 10.0;
+        columns[1][row] = 1 + row % 17;
+        columns[2][row] = row % 5 / 2.0;
+    }
+    return columns;
+}
+
+static void batch_bench() {
+    const std::size_t rows = 1000000;
+    const compiled_formula compiled = pricing_formula();
+    std::vector<std::vector<double>> columns = pricing_columns(rows);
+    const double *column_pointers[] = {columns[0].data(), columns[1].data(), columns[2].data()};
+    std::vector<double> results(rows);
+
+    auto start = std::chrono::steady_clock::now();
+    double values[3];
+    for (std::size_t row = 0; row < rows; row++) {
+        for (int slot = 0; slot < 3; slot++) {
+            values[slot] = columns[slot][row];
+        }
+        results[row] = compiled.evaluate(values);
+    }
+    auto middle = std::chrono::steady_clock::now();
+    compiled.evaluate_batch(column_pointers, results.data(), rows);
+    auto finish = std::chrono::steady_clock::now();
+
+    std::printf("%-12s %8zu rows      %10.2f ns/row\n", "per row", rows,
+                std::chrono::duration<double, std::nano>(middle - start).count() / rows);
+    std::printf("%-12s %8zu rows      %10.2f ns/row\n", "batch", rows,
+                std::chrono::duration<double, std::nano>(finish - middle).count() / rows);
+}
+
+// the pricing formula row by row on doubles and on decimals of 4 places
+static void decimal_bench() {
+    const std::size_t rows = 1000000;
+    compile_options options;
+    options.variables = {"price", "qty", "discount"};
+    options.optimize = false;
+    const std::string formula = "price * qty - discount * (price / 100 + 1) - -qty";
+    const compiled_formula doubles = compile(formula, options);
+    options.backend = evaluation_backend::decimal;
+    options.decimal_places = 4;
+    const compiled_formula decimals = compile(formula, options);
+    std::vector<std::vector<double>> columns = pricing_columns(rows);
+
+    for (const compiled_formula *compiled : {&doubles, &decimals}) {
+        volatile double sink = 0;
+        auto start = std::chrono::steady_clock::now();
+        double values[3];
+        for (std::size_t row = 0; row < rows; row++) {
+            for (int slot = 0; slot < 3; slot++) {
+                values[slot] = columns[slot][row];
+            }
+            sink = sink + compiled->evaluate(values);
+        }
+        auto finish = std::chrono::steady_clock::now();
+        std::printf("%-12s %8zu rows      %10.2f ns/row\n", compiled == &doubles ? "double" : "decimal", rows,
+                    std::chrono::duration<double, std::nano>(finish - start).count() / rows);
+    }
+}
+
+// Scanning rows of the pricing formula for results above a threshold by blocks of 4096 rows, skipping the ones
+// whose interval, from the minimum and maximum of each column, lies below it
+static void interval_bench() {
+    const std::size_t rows = 1000000;
+    const std::size_t block = 4096;
+    const double threshold = 1600;
+    const compiled_formula compiled = pricing_formula();
+    std::vector<std::vector<double>> columns = pricing_columns(rows);
+    // sorted by price, as a table clustered on it would be
+    std::sort(columns[0].begin(), columns[0].end());
+    std::vector<double> results(rows);
+    // the zone map, stored with the table
+    std::vector<interval> zones;
+    for (std::size_t first_row = 0; first_row < rows; first_row += block) {
+        for (int slot = 0; slot < 3; slot++) {
+            auto range = std::minmax_element(columns[slot].begin() + first_row,
+                                             columns[slot].begin() + std::min(first_row + block, rows));
+            zones.push_back({*range.first, *range.second});
+        }
+    }
+
+    auto start = std::chrono::steady_clock::now();
+    std::size_t matches = 0;
+    std::size_t scanned_blocks = 0;
+    for (std::size_t first_row = 0; first_row < rows; first_row += block) {
+        std::size_t count = std::min(block, rows - first_row);
+        if (compiled.evaluate_interval(zones.data() + first_row / block * 3).upper <= threshold) {
+            continue;
+        }
+        scanned_blocks++;
+        const double *column_pointers[] = {columns[0].data() + first_row, columns[1].data() + first_row,
+                                           columns[2].data() + first_row};
+        compiled.evaluate_batch(column_pointers, results.data(), count);
+        matches += std::count_if(results.begin(), results.begin() + count, [threshold](double result) {
+            return result > threshold;
+        });
+    }
+    auto middle = std::chrono::steady_clock::now();
+    const double *column_pointers[] = {columns[0].data(), columns[1].data(), columns[2].data()};
+    compiled.evaluate_batch(column_pointers, results.data(), rows);
+    std::size_t all_matches = std::count_if(results.begin(), results.end(), [threshold](double result) {
+        return result > threshold;
+    });
+    auto finish = std::chrono::steady_clock::now();
+
+    std::printf("%-12s %8zu rows      %10.2f ns/row  %zu of %zu blocks scanned\n", "pruned scan", rows,
+                std::chrono::duration<double, std::nano>(middle - start).count() / rows, scanned_blocks,
+                (rows + block - 1) / block);
+    std::printf("%-12s %8zu rows      %10.2f ns/row  %s\n", "full scan", rows,
+                std::chrono::duration<double, std::nano>(finish - middle).count() / rows,
+                matches == all_matches ? "same rows" : "DIFFERENT ROWS");
+}
+
+static void thread_scaling_bench() {
+    const std::size_t rows = 8000000;
+    const compiled_formula compiled = pricing_formula();
+    std::vector<std::vector<double>> columns = pricing_columns(rows);
+    const double *column_pointers[] = {columns[0].data(), columns[1].data(), columns[2].data()};
+    std::vector<double> results(rows);
+
+    int max_threads = std::max(1u, std::thread::hardware_concurrency());
+    double single_thread_ns = 0;
+    for (int threads = 1; ; threads = std::min(threads * 2, max_threads)) {
+        thread_pool pool(threads);
+        auto start = std::chrono::steady_clock::now();
+        compiled.evaluate_batch(column_pointers, results.data(), rows, pool);
+        auto finish = std::chrono::steady_clock::now();
+        double ns = std::chrono::duration<double, std::nano>(finish - start).count();
+        if (threads == 1) {
+            single_thread_ns = ns;
+        }
+        std::printf("%-12s %8d threads   %10.2f ns/row  x%.2f\n", "parallel", threads, ns / rows,
+                    single_thread_ns / ns);
+        if (threads == max_threads) {
+            break;
+        }
+    }
+}
+
+// one formula of the corpus formulas added up, tokenized and compiled on the calling thread, then across pools
+static void large_formula_bench(const std::vector<std::string> &corpus) {
+    std::string formula = corpus[0];
+    for (std::size_t i = 1; formula.size() < (32 << 20); i++) {
+        formula += " + " + corpus[i % corpus.size()];
+    }
+
+    int max_threads = std::max(1u, std::thread::hardware_concurrency());
+    double single_thread_ns = 0;
+    for (int threads = 1; ; threads = std::min(threads * 2, max_threads)) {
+        thread_pool pool(threads);
+        compile_options options;
+        options.parse_pool = &pool;
+        auto start = std::chrono::steady_clock::now();
+        std::size_t tokens = count_tokens(formula, options);
+        auto middle = std::chrono::steady_clock::now();
+        compile(formula, options);
+        auto finish = std::chrono::steady_clock::now();
+        double tokenize_ns = std::chrono::duration<double, std::nano>(middle - start).count();
+        double compile_ns = std::chrono::duration<double, std::nano>(finish - middle).count();
+        if (threads == 1) {
+            single_thread_ns = compile_ns;
+        }
+        std::printf("%-12s %8d threads   %10.2f ns/token tokenize  %10.2f ns/token compile  x%.2f\n", "large",
+                    threads, tokenize_ns / tokens, compile_ns / tokens, single_thread_ns / compile_ns);
+        if (threads == max_threads) {
+            break;
+        }
+    }
+}
+
+// One large formula parsed into pointer nodes and into a flat tree: memory kept per token, parse and evaluation
+// time
+static void flat_bench(const std::vector<std::string> &corpus) {
+    std::string formula = corpus[0];
+    for (std::size_t i = 1; formula.size() < (4 << 20); i++) {
+        formula += " + (" + corpus[i % corpus.size()] + ")";
+    }
+    const std::size_t tokens = count_tokens(formula);
+    for (evaluation_backend backend : {evaluation_backend::tree, evaluation_backend::flat}) {
+        compile_options options;
+        options.backend = backend;
+        // folded, the formula would be a single literal
+        options.optimize = false;
+        // what the compiled formula keeps, the tokens being gone
+        const std::size_t live_before = live_bytes;
+        auto start = std::chrono::steady_clock::now();
+        const compiled_formula compiled = compile(formula, options);
+        auto middle = std::chrono::steady_clock::now();
+        std::size_t bytes = live_bytes - live_before;
+        const int rounds = 10;
+        volatile double sink = 0;
+        for (int round = 0; round < rounds; round++) {
+            sink = sink + compiled.evaluate();
+        }
+        auto finish = std::chrono::steady_clock::now();
+        std::printf("%-12s %8zu tokens    %10.2f bytes/token  %10.2f ns/token parse  %10.2f ns/token evaluate\n",
+                    backend == evaluation_backend::flat ? "flat" : "pointer", tokens,
+                    static_cast<double>(bytes) / tokens,
+                    std::chrono::duration<double, std::nano>(middle - start).count() / tokens,
+                    std::chrono::duration<double, std::nano>(finish - middle).count() / rounds / tokens);
+    }
+}
+
+// weighted sum of variables [first, first + count), grouped into a balanced tree
+static std::string weighted_sum(int first, int count) {
+    if (count == 1) {
+        return "v" + std::to_string(first) + " * " + std::to_string(first + 1) + ".5";
+    }
+    return "(" + weighted_sum(first, count / 2) + ") + (" + weighted_sum(first + count / 2, count - count / 2) + ")";
+}
+
+// one variable out of many changes per tick
+static void incremental_bench() {
+    const int variable_count = 64;
+    compile_options options;
+    for (int slot = 0; slot < variable_count; slot++) {
+        options.variables.push_back("v" + std::to_string(slot));
+    }
+    std::string formula = weighted_sum(0, variable_count);
+    const compiled_formula compiled = compile(formula, options);
+    std::vector<double> values(variable_count, 1);
+    incremental_formula incremental(compiled, values.data());
+
+    const int ticks = 1000000;
+    volatile double sink = 0;
+    auto start = std::chrono::steady_clock::now();
+    for (int tick = 0; tick < ticks; tick++) {
+        values[tick % variable_count] = tick;
+        sink = sink + compiled.evaluate(values.data());
+    }
+    auto middle = std::chrono::steady_clock::now();
+    for (int tick = 0; tick < ticks; tick++) {
+        sink = sink + incremental.update(tick % variable_count, tick);
+    }
+    auto finish = std::chrono::steady_clock::now();
+
+    std::printf("%-12s %8d variables %10.2f ns/tick\n", "full", variable_count,
+                std::chrono::duration<double, std::nano>(middle - start).count() / ticks);
+    std::printf("%-12s %8d variables %10.2f ns/tick\n", "incremental", variable_count,
+                std::chrono::duration<double, std::nano>(finish - middle).count() / ticks);
+}
+
+// startup with 200k formulas: compiling them all, or loading them from a saved image
+static void image_bench(const std::vector<std::string> &corpus) {
+    const std::size_t formula_count = 200000;
+    auto start = std::chrono::steady_clock::now();
+    std::vector<compiled_formula> compiled;
+    compiled.reserve(formula_count);
+    for (std::size_t i = 0; i < formula_count; i++) {
+        compiled.push_back(compile(corpus[i % corpus.size()]));
+    }
+    auto middle = std::chrono::steady_clock::now();
+    std::string image = save_formulas(compiled);
+    auto saved = std::chrono::steady_clock::now();
+    std::vector<compiled_formula> loaded = load_formulas(image);
+    auto finish = std::chrono::steady_clock::now();
+
+    std::printf("%-12s %-14s %10.1f ns/formula\n", "startup", "compile",
+                std::chrono::duration<double, std::nano>(middle - start).count() / formula_count);
+    std::printf("%-12s %-14s %10.1f ns/formula  %zu bytes\n", "startup", "save",
+                std::chrono::duration<double, std::nano>(saved - middle).count() / formula_count, image.size());
+    std::printf("%-12s %-14s %10.1f ns/formula\n", "startup", "load",
+                std::chrono::duration<double, std::nano>(finish - saved).count() / loaded.size());
+}
+
+// a dashboard of formulas built from the same pieces, evaluated one by one and as a shared batch
+static void shared_bench() {
+    const int formula_count = 200;
+    const std::string net = "(price * qty - discount * (price / 100 + 1))";
+    const std::string gross = "(" + net + " * (1 + tax))";
+    std::vector<std::string> formulas;
+    for (int i = 0; i < formula_count; i++) {
+        std::string factor = std::to_string(i + 1);
+        formulas.push_back(gross + " * " + factor + " - " + net + " / (" + gross + " + " + factor + ")");
+    }
+    std::vector<std::string_view> views(formulas.begin(), formulas.end());
+    compile_options options;
+    options.variables = {"price", "qty", "discount", "tax"};
+    std::vector<compiled_formula> separate;
+    for (const std::string &formula : formulas) {
+        separate.push_back(compile(formula, options));
+    }
+    options.share_subexpressions = true;
+    const formula_batch batch = compile_batch(views, options);
+
+    const int rounds = 20000;
+    double values[] = {25, 3, 2, 0.2};
+    std::vector<double> results(formula_count);
+    volatile double sink = 0;
+    auto start = std::chrono::steady_clock::now();
+    for (int round = 0; round < rounds; round++) {
+        values[1] = round % 7 + 1;
+        for (int i = 0; i < formula_count; i++) {
+            results[i] = separate[i].evaluate(values);
+        }
+        sink = sink + results[round % formula_count];
+    }
+    auto middle = std::chrono::steady_clock::now();
+    for (int round = 0; round < rounds; round++) {
+        values[1] = round % 7 + 1;
+        batch.evaluate(values, results.data());
+        sink = sink + results[round % formula_count];
+    }
+    auto finish = std::chrono::steady_clock::now();
+
+    std::printf("%-12s %8d formulas  %10.2f ns/formula\n", "separate", formula_count,
+                std::chrono::duration<double, std::nano>(middle - start).count() / rounds / formula_count);
+    std::printf("%-12s %8d formulas  %10.2f ns/formula\n", "shared", formula_count,
+                std::chrono::duration<double, std::nano>(finish - middle).count() / rounds / formula_count);
+}
+
+// Producers submitting bursts of pricing requests and waiting for each burst; micro-batches of one
+// request each against batches of up to 64.
+static void service_bench(std::size_t max_batch) {
+    const int producers = 2;
+    const int bursts = 2000;
+    const int burst_size = 64;
+    compile_options options;
+    options.variables = {"price", "qty", "discount"};
+    const std::string formula = "price * qty - discount * (price / 100 + 1) - -qty";
+    calculation_service service(options, 2, 256, max_batch);
+
+    std::vector<std::vector<double>> burst_ns(producers);
+    std::vector<std::thread> threads;
+    auto start = std::chrono::steady_clock::now();
+    for (int p = 0; p < producers; p++) {
+        threads.emplace_back([&service, &formula, &burst_ns, p] {
+            std::vector<std::future<double>> futures;
+            volatile double sink = 0;
+            for (int burst = 0; burst < bursts; burst++) {
+                auto burst_start = std::chrono::steady_clock::now();
+                for (int i = 0; i < burst_size; i++) {
+                    futures.push_back(service.submit(formula, {1 + i / 10.0, 1.0 + burst % 17, p / 2.0}));
+                }
+                for (std::future<double> &future : futures) {
+                    sink = sink + future.get();
+                }
+                futures.clear();
+                burst_ns[p].push_back(std::chrono::duration<double, std::nano>(
+                        std::chrono::steady_clock::now() - burst_start).count());
+            }
+        });
+    }
+    for (std::thread &thread : threads) {
+        thread.join();
+    }
+    double total_ns = std::chrono::duration<double, std::nano>(std::chrono::steady_clock::now() - start).count();
+
+    std::vector<double> all_bursts;
+    for (const std::vector<double> &producer_bursts : burst_ns) {
+        all_bursts.insert(all_bursts.end(), producer_bursts.begin(), producer_bursts.end());
+    }
+    std::sort(all_bursts.begin(), all_bursts.end());
+    std::printf("%-12s batch %4zu  %10.2f ns/request  p50 %8.1f us/burst  p99 %8.1f us/burst\n", "service", max_batch,
+                total_ns / (producers * bursts * burst_size), all_bursts[all_bursts.size() / 2] / 1000,
+                all_bursts[all_bursts.size() * 99 / 100] / 1000);
+}
+
+// malformed formulas, failing at the end or right away, through calculate() and try_calculate()
+static void error_bench(const std::vector<std::string> &corpus) {
+    std::vector<std::string> malformed;
+    for (std::size_t i = 0; i < corpus.size(); i++) {
+        malformed.push_back(i % 2 == 0 ? corpus[i] + " +" : ")" + corpus[i]);
+    }
+
+    const int rounds = 20;
+    std::size_t failures = 0;
+    auto start = std::chrono::steady_clock::now();
+    for (int round = 0; round < rounds; round++) {
+        for (const std::string &formula : malformed) {
+            try {
+                calculate(formula);
+            } catch (const parse_exception &) {
+                failures++;
+            }
+        }
+    }
+    auto middle = std::chrono::steady_clock::now();
+    for (int round = 0; round < rounds; round++) {
+        for (const std::string &formula : malformed) {
+            failures += !try_calculate(formula);
+        }
+    }
+    auto finish = std::chrono::steady_clock::now();
+
+    double operations = static_cast<double>(rounds) * malformed.size();
+    std::printf("%-12s %-14s %10.1f ns/op\n", "malformed", "calculate",
+                std::chrono::duration<double, std::nano>(middle - start).count() / operations);
+    std::printf("%-12s %-14s %10.1f ns/op  %zu failures\n", "malformed", "try_calculate",
+                std::chrono::duration<double, std::nano>(finish - middle).count() / operations, failures);
+}
+
+static double compile_ns(const std::string &formula, int repetitions) {
+    double best = 0;
+    for (int i = 0; i < repetitions; i++) {
+        auto start = std::chrono::steady_clock::now();
+        compiled_formula compiled = compile(formula);
+        auto finish = std::chrono::steady_clock::now();
+        double ns = std::chrono::duration<double, std::nano>(finish - start).count();
+        if (i == 0 || ns < best) {
+            best = ns;
+        }
+    }
+    return best;
+}
+
+static bool scaling_bench(const std::string &name, std::string (*generator)(int)) {
+    double smallest_per_token = 0;
+    double largest_per_token = 0;
+    for (int tokens : scaling_sizes) {
+        std::string formula = generator(tokens);
+        int repetitions = std::max(1, 1000000 / tokens) * 3;
+        double per_token = compile_ns(formula, repetitions) / tokens;
+        if (smallest_per_token == 0) {
+            smallest_per_token = per_token;
+        }
+        largest_per_token = per_token;
+
+        allocation_meter meter;
+        compile(formula);
+        std::printf("%-12s %8d tokens  %10.2f ns/token  %6zu allocations  %6.2f peak bytes/token\n", name.c_str(),
+                    tokens, per_token, meter.allocations(), static_cast<double>(meter.peak()) / tokens);
+    }
+
+    double ratio = largest_per_token / smallest_per_token;
+    bool passed = ratio <= max_scaling_ratio;
+    std::printf("%-12s scaling ratio %.2f: %s\n", name.c_str(), ratio, passed ? "linear" : "NOT LINEAR");
+    return passed;
+}
+
+int main() {
+    bool passed = true;
+    passed &= scaling_bench("flat chain", flat_chain);
+    passed &= scaling_bench("mixed chain", mixed_chain);
+    passed &= scaling_bench("nested", nested_groups);
+
+    std::vector<std::string> corpus = formula_corpus(2000);
+    phase_bench("flat chain", repeated(flat_chain, 1001, 100));
+    phase_bench("nested", repeated(nested_groups, 1001, 100));
+    phase_bench("literals", literal_corpus(100));
+    phase_bench("mixed", corpus);
+    phase_bench("indented", indented_corpus(corpus));
+    error_bench(corpus);
+
+    backend_bench("tree", evaluation_backend::tree, 0, corpus);
+    backend_bench("bytecode", evaluation_backend::bytecode, 0, corpus);
+    backend_bench("jit", evaluation_backend::bytecode, 1, corpus);
+    backend_bench("flat", evaluation_backend::flat, 0, corpus);
+
+    batch_bench();
+    decimal_bench();
+    interval_bench();
+    thread_scaling_bench();
+    large_formula_bench(corpus);
+    flat_bench(corpus);
+    incremental_bench();
+    shared_bench();
+    image_bench(corpus);
+    service_bench(1);
+    service_bench(64);
+    return passed ? EXIT_SUCCESS : EXIT_FAILURE;
+}
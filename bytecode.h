@@ -0,0 +1,214 @@
+#ifndef CALCULATOR_BYTECODE_H
+#define CALCULATOR_BYTECODE_H
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <vector>
+
+#include "simd.h"
+
+enum class opcode : std::uint8_t {
+    push,
+    load,
+    add,
+    subtract,
+    multiply,
+    divide,
+    negate,
+    // copies the top of the stack to a temporary, leaving it on the stack
+    save,
+    // pushes a temporary
+    recall
+};
+
+struct instruction {
+    opcode code;
+    // index in the constant pool for push, variable slot for load, temporary for save and recall, unused otherwise
+    std::uint32_t operand;
+};
+
+// Postfix form of an expression tree: operands are pushed to a value stack and operators replace
+// the topmost values with their result, so evaluation is a single loop without indirect calls.
+// Values used more than once can be kept in temporaries, stored after the stack.
+class bytecode {
+    // block stack entries in run() over many rows
+    static const std::size_t max_block_stack = 256 * 1024;
+
+    int depth = 0;
+
+public:
+    std::vector <instruction> instructions;
+    std::vector <double> constants;
+    int max_stack = 0;
+    int temporaries = 0;
+
+    void push(double value) {
+        instructions.push_back({opcode::push, static_cast<std::uint32_t>(constants.size())});
+        constants.push_back(value);
+        depth++;
+        max_stack = std::max(max_stack, depth);
+    }
+
+    void load(int slot) {
+        instructions.push_back({opcode::load, static_cast<std::uint32_t>(slot)});
+        depth++;
+        max_stack = std::max(max_stack, depth);
+    }
+
+    // returns the temporary the top of the stack is saved to
+    std::uint32_t save() {
+        instructions.push_back({opcode::save, static_cast<std::uint32_t>(temporaries)});
+        return temporaries++;
+    }
+
+    void recall(std::uint32_t temporary) {
+        instructions.push_back({opcode::recall, temporary});
+        depth++;
+        max_stack = std::max(max_stack, depth);
+    }
+
+    // values left on the stack at the end, one per root lowered into the program
+    int result_count() const {
+        return depth;
+    }
+
+    void emit(opcode code) {
+        instructions.push_back({code, 0});
+        if (code != opcode::negate) {
+            depth--;
+        }
+    }
+
+    double run(const double *variables) const {
+        // the native stack is enough for all but really deep formulas
+        double local_stack[64];
+        std::unique_ptr<double[]> heap_stack;
+        double *stack = local_stack;
+        if (max_stack + temporaries > 64) {
+            heap_stack.reset(new double[max_stack + temporaries]);
+            stack = heap_stack.get();
+        }
+        execute(variables, stack);
+        return stack[0];
+    }
+
+    // results[i] is the value of the i-th root lowered into the program
+    void run(const double *variables, double *results) const {
+        std::vector <double> stack(max_stack + temporaries);
+        execute(variables, stack.data());
+        std::copy(stack.begin(), stack.begin() + result_count(), results);
+    }
+
+    // Runs every instruction over a block of rows at a time, each stack entry being a whole block.
+    // Deep stacks get smaller blocks, so the block stack stays within a few megabytes.
+    void run(const double *const *columns, double *results, std::size_t begin, std::size_t end) const {
+        const std::size_t block = std::clamp<std::size_t>(max_block_stack / std::max(max_stack + temporaries, 1),
+                                                          1, 256);
+        std::vector <double> stack((max_stack + temporaries) * block);
+        double *const saved = stack.data() + max_stack * block;
+        for (std::size_t first_row = begin; first_row < end; first_row += block) {
+            const std::size_t count = std::min(block, end - first_row);
+            double *top = stack.data();
+            for (const instruction &instruction : instructions) {
+                switch (instruction.code) {
+                    case opcode::push:
+                        std::fill(top, top + count, constants[instruction.operand]);
+                        top += block;
+                        break;
+                    case opcode::load: {
+                        const double *column = columns[instruction.operand] + first_row;
+                        std::copy(column, column + count, top);
+                        top += block;
+                        break;
+                    }
+                    case opcode::add:
+                        top -= block;
+                        combine_lanes(top - block, top, count, [](auto left, auto right) {
+                            return left + right;
+                        });
+                        break;
+                    case opcode::subtract:
+                        top -= block;
+                        combine_lanes(top - block, top, count, [](auto left, auto right) {
+                            return left - right;
+                        });
+                        break;
+                    case opcode::multiply:
+                        top -= block;
+                        combine_lanes(top - block, top, count, [](auto left, auto right) {
+                            return left * right;
+                        });
+                        break;
+                    case opcode::divide:
+                        top -= block;
+                        combine_lanes(top - block, top, count, [](auto left, auto right) {
+                            return left / right;
+                        });
+                        break;
+                    case opcode::negate:
+                        combine_lanes(top - block, -1, count, [](auto value, auto factor) {
+                            return factor * value;
+                        });
+                        break;
+                    case opcode::save:
+                        std::copy(top - block, top - block + count, saved + instruction.operand * block);
+                        break;
+                    case opcode::recall: {
+                        const double *temporary = saved + instruction.operand * block;
+                        std::copy(temporary, temporary + count, top);
+                        top += block;
+                        break;
+                    }
+                }
+            }
+            std::copy(stack.data(), stack.data() + count, results + first_row);
+        }
+    }
+
+private:
+    // `stack` has room for max_stack values followed by the temporaries
+    void execute(const double *variables, double *stack) const {
+        double *const saved = stack + max_stack;
+        double *top = stack;
+        for (const instruction &instruction : instructions) {
+            switch (instruction.code) {
+                case opcode::push:
+                    *top++ = constants[instruction.operand];
+                    break;
+                case opcode::load:
+                    *top++ = variables[instruction.operand];
+                    break;
+                case opcode::add:
+                    top--;
+                    top[-1] = top[-1] + top[0];
+                    break;
+                case opcode::subtract:
+                    top--;
+                    top[-1] = top[-1] - top[0];
+                    break;
+                case opcode::multiply:
+                    top--;
+                    top[-1] = top[-1] * top[0];
+                    break;
+                case opcode::divide:
+                    top--;
+                    top[-1] = top[-1] / top[0];
+                    break;
+                case opcode::negate:
+                    // same as negative::calc(), so both backends agree even on NaN signs
+                    top[-1] = -1 * top[-1];
+                    break;
+                case opcode::save:
+                    saved[instruction.operand] = top[-1];
+                    break;
+                case opcode::recall:
+                    *top++ = saved[instruction.operand];
+                    break;
+            }
+        }
+    }
+};
+
+#endif //CALCULATOR_BYTECODE_H
@@ -1,9 +1,72 @@
 #include <iostream>
+#include <algorithm>
+#include <iterator>
+#include <fstream>
+#include <string>
+#include <string_view>
 #include <cstdlib>
+#include <cstring>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
 
 #include "engine.h"
 
-int main() {
+// Read-only mapping of a whole file, so huge inputs are tokenized straight from the page cache.
+class mapped_file {
+    void *data = MAP_FAILED;
+    std::size_t size = 0;
+    bool mapped = false;
+
+public:
+    explicit mapped_file(const char *path) {
+        // opening a named pipe here would let its writer finish before anything reads it
+        struct stat path_status;
+        if (stat(path, &path_status) != 0 || !S_ISREG(path_status.st_mode)) {
+            return;
+        }
+        int descriptor = open(path, O_RDONLY);
+        if (descriptor == -1) {
+            return;
+        }
+        struct stat status;
+        if (fstat(descriptor, &status) == 0 && S_ISREG(status.st_mode)) {
+            size = status.st_size;
+            if (size == 0) {
+                mapped = true;
+            } else {
+                data = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, descriptor, 0);
+                mapped = data != MAP_FAILED;
+                if (mapped) {
+                    madvise(data, size, MADV_SEQUENTIAL);
+                }
+            }
+        }
+        close(descriptor);
+    }
+
+    ~mapped_file() {
+        if (data != MAP_FAILED) {
+            munmap(data, size);
+        }
+    }
+
+    mapped_file(const mapped_file &) = delete;
+
+    mapped_file &operator=(const mapped_file &) = delete;
+
+    // false for anything that cannot be mapped, like pipes
+    bool valid() const {
+        return mapped;
+    }
+
+    std::string_view contents() const {
+        return size == 0 ? std::string_view() : std::string_view(static_cast<const char *>(data), size);
+    }
+};
+
+static int calculate_line() {
     std::string formula;
     std::getline(std::cin, formula);
 
@@ -20,3 +83,103 @@ int main() {
 
     return EXIT_SUCCESS;
 }
+
+// One result per input line, so invalid formulas are reported in place instead of stopping the stream.
+static bool calculate_stream_line(std::string_view formula) {
+    if (!formula.empty() && formula.back() == '\r') {
+        formula.remove_suffix(1);
+    }
+
+    // many lines may be invalid, so their errors are not thrown
+    parse_result<double> result = try_calculate(formula);
+    if (!result) {
+        std::cout << "error at " << result.position << ": " << parse_error_message(result.error) << '\n';
+        return false;
+    }
+    std::cout << result.value() << '\n';
+    return true;
+}
+
+static int calculate_stream(std::istream &input) {
+    bool failed = false;
+    std::string formula;
+    while (std::getline(input, formula)) {
+        failed |= !calculate_stream_line(formula);
+    }
+
+    std::cout.flush();
+    return failed ? EXIT_FAILURE : EXIT_SUCCESS;
+}
+
+static int calculate_stream(std::string_view input) {
+    bool failed = false;
+    while (!input.empty()) {
+        std::size_t end = input.find('\n');
+        if (end == std::string_view::npos) {
+            end = input.size();
+        }
+        failed |= !calculate_stream_line(input.substr(0, end));
+        input.remove_prefix(std::min(end + 1, input.size()));
+    }
+
+    std::cout.flush();
+    return failed ? EXIT_FAILURE : EXIT_SUCCESS;
+}
+
+// The whole file is one formula; it may be far too long to echo, so only the offset is reported.
+static int calculate_file(std::string_view formula) {
+    while (!formula.empty() && (formula.back() == '\n' || formula.back() == '\r')) {
+        formula.remove_suffix(1);
+    }
+
+    try {
+        std::cout << calculate(formula) << std::endl;
+    } catch (const parse_exception &e) {
+        std::cerr << "Invalid input at offset " << e.start_position << ":" << std::endl;
+        std::cerr << e.message << std::endl;
+        return EXIT_FAILURE;
+    }
+
+    return EXIT_SUCCESS;
+}
+
+static int usage(const char *program) {
+    std::cerr << "Usage: " << program << " [--stream [file] | --file file]" << std::endl;
+    std::cerr << "Reads one formula from stdin, with --stream one formula per line until EOF," << std::endl;
+    std::cerr << "or with --file a single formula that takes the whole file." << std::endl;
+    return EXIT_FAILURE;
+}
+
+int main(int argc, char **argv) {
+    if (argc == 1) {
+        return calculate_line();
+    }
+
+    std::ios::sync_with_stdio(false);
+    std::cin.tie(nullptr);
+
+    bool stream = std::strcmp(argv[1], "--stream") == 0;
+    bool file = std::strcmp(argv[1], "--file") == 0;
+    if (!(stream && argc <= 3) && !(file && argc == 3)) {
+        return usage(argv[0]);
+    }
+    if (argc == 2) {
+        return calculate_stream(std::cin);
+    }
+
+    mapped_file input(argv[2]);
+    if (input.valid()) {
+        return stream ? calculate_stream(input.contents()) : calculate_file(input.contents());
+    }
+
+    std::ifstream fallback(argv[2], std::ios::binary);
+    if (!fallback) {
+        std::cerr << "Cannot open " << argv[2] << std::endl;
+        return EXIT_FAILURE;
+    }
+    if (stream) {
+        return calculate_stream(fallback);
+    }
+    std::string formula((std::istreambuf_iterator<char>(fallback)), std::istreambuf_iterator<char>());
+    return calculate_file(formula);
+}
@@ -0,0 +1,147 @@
+#include <algorithm>
+#include <exception>
+#include <stdexcept>
+#include <utility>
+
+#include "calculation_service.h"
+
+calculation_service::calculation_service(const compile_options &_options, int _workers,
+                                         std::size_t _queue_capacity, std::size_t _max_batch,
+                                         std::size_t _cache_capacity)
+        : options(_options), max_batch(std::max<std::size_t>(_max_batch, 1)), cache(_cache_capacity, _options),
+          queue(std::max<std::size_t>(_queue_capacity, 1)) {
+    for (int worker = 0; worker < std::max(_workers, 1); worker++) {
+        workers.emplace_back(&calculation_service::worker_loop, this);
+    }
+}
+
+calculation_service::~calculation_service() {
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        stopping = true;
+    }
+    requests_ready.notify_all();
+    for (std::thread &worker : workers) {
+        worker.join();
+    }
+}
+
+std::future<double> calculation_service::submit(std::string formula, std::vector<double> values) {
+    std::unique_ptr<request> next = make_request(std::move(formula), std::move(values));
+    std::future<double> result = next->result.get_future();
+    if (!queue.try_push(next)) {
+        std::unique_lock<std::mutex> lock(mutex);
+        waiting_producers.fetch_add(1);
+        // pairs with the fence of a worker that has just made room, see wake_worker()
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        space_ready.wait(lock, [this, &next] { return queue.try_push(next); });
+        waiting_producers.fetch_sub(1);
+    }
+    wake_worker();
+    return result;
+}
+
+std::optional<std::future<double>> calculation_service::try_submit(std::string formula, std::vector<double> values) {
+    std::unique_ptr<request> next = make_request(std::move(formula), std::move(values));
+    std::future<double> result = next->result.get_future();
+    if (!queue.try_push(next)) {
+        return std::nullopt;
+    }
+    wake_worker();
+    return result;
+}
+
+std::unique_ptr<calculation_service::request> calculation_service::make_request(std::string formula,
+                                                                                std::vector<double> values) const {
+    if (values.size() != options.variables.size()) {
+        throw std::invalid_argument("Expected one value per variable");
+    }
+    return std::unique_ptr<request>(new request{std::move(formula), std::move(values), std::promise<double>()});
+}
+
+// Sleeping and queueing meet like in Dekker's algorithm: one side publishes (a request, or that it is
+// idle), fences, then looks at the other. Either the worker sees the request, or the producer sees the
+// idle worker and wakes it, under the mutex so the wakeup cannot come before the worker waits.
+void calculation_service::wake_worker() {
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    if (idle_workers.load(std::memory_order_relaxed) > 0) {
+        std::lock_guard<std::mutex> lock(mutex);
+        requests_ready.notify_one();
+    }
+}
+
+std::unique_ptr<calculation_service::request> calculation_service::wait_for_request() {
+    std::unique_ptr<request> next;
+    std::unique_lock<std::mutex> lock(mutex);
+    idle_workers.fetch_add(1);
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    requests_ready.wait(lock, [this, &next] { return queue.try_pop(next) || stopping; });
+    idle_workers.fetch_sub(1);
+    return next;
+}
+
+void calculation_service::worker_loop() {
+    std::vector<std::unique_ptr<request>> batch;
+    for (;;) {
+        std::unique_ptr<request> next;
+        while (batch.size() < max_batch && queue.try_pop(next)) {
+            batch.push_back(std::move(next));
+        }
+        if (batch.empty()) {
+            next = wait_for_request();
+            if (!next) {
+                return;
+            }
+            batch.push_back(std::move(next));
+            continue;
+        }
+
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        if (waiting_producers.load(std::memory_order_relaxed) > 0) {
+            std::lock_guard<std::mutex> lock(mutex);
+            space_ready.notify_all();
+        }
+        evaluate(batch);
+        batch.clear();
+    }
+}
+
+// requests for the same formula become the rows of one batch evaluation
+void calculation_service::evaluate(std::vector<std::unique_ptr<request>> &batch) {
+    std::stable_sort(batch.begin(), batch.end(), [](const std::unique_ptr<request> &left,
+                                                    const std::unique_ptr<request> &right) {
+        return left->formula < right->formula;
+    });
+
+    std::vector<std::vector<double>> columns(options.variables.size());
+    std::vector<const double *> column_pointers(options.variables.size());
+    std::vector<double> results;
+    for (std::size_t begin = 0, end; begin < batch.size(); begin = end) {
+        end = begin + 1;
+        while (end < batch.size() && batch[end]->formula == batch[begin]->formula) {
+            end++;
+        }
+        std::size_t rows = end - begin;
+
+        try {
+            compiled_formula compiled = cache.get(batch[begin]->formula);
+            for (std::size_t slot = 0; slot < columns.size(); slot++) {
+                columns[slot].resize(rows);
+                for (std::size_t row = 0; row < rows; row++) {
+                    columns[slot][row] = batch[begin + row]->values[slot];
+                }
+                column_pointers[slot] = columns[slot].data();
+            }
+            results.resize(rows);
+            compiled.evaluate_batch(column_pointers.data(), results.data(), rows);
+        } catch (...) {
+            for (std::size_t i = begin; i < end; i++) {
+                batch[i]->result.set_exception(std::current_exception());
+            }
+            continue;
+        }
+        for (std::size_t row = 0; row < rows; row++) {
+            batch[begin + row]->result.set_value(results[row]);
+        }
+    }
+}
@@ -0,0 +1,80 @@
+#ifndef CALCULATOR_CALCULATION_SERVICE_H
+#define CALCULATOR_CALCULATION_SERVICE_H
+
+#include <atomic>
+#include <condition_variable>
+#include <cstddef>
+#include <future>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "engine.h"
+#include "formula_cache.h"
+#include "mpmc_queue.h"
+
+// Evaluates formulas submitted from any thread on workers of its own, answering through futures.
+// Requests wait in a bounded queue: once it is full, submit() blocks and try_submit() refuses, so a burst
+// slows down its producers instead of piling up behind the workers. A worker takes whatever is queued, up
+// to max_batch requests, and evaluates the ones for the same formula together with evaluate_batch().
+// Formulas are compiled through a shared formula_cache.
+class calculation_service {
+    struct request {
+        std::string formula;
+        std::vector<double> values;
+        std::promise<double> result;
+    };
+
+    const compile_options options;
+    const std::size_t max_batch;
+    formula_cache cache;
+    mpmc_queue<std::unique_ptr<request>> queue;
+
+    // the queue never blocks, so threads that found it empty or full sleep here
+    std::mutex mutex;
+    std::condition_variable requests_ready;
+    std::condition_variable space_ready;
+    std::atomic<int> idle_workers{0};
+    std::atomic<int> waiting_producers{0};
+    bool stopping = false;
+
+    std::vector<std::thread> workers;
+
+public:
+    // All formulas are compiled with `options` and may use its variables.
+    explicit calculation_service(const compile_options &_options = compile_options(),
+                                 int _workers = std::thread::hardware_concurrency(),
+                                 std::size_t _queue_capacity = 1024, std::size_t _max_batch = 64,
+                                 std::size_t _cache_capacity = 1024);
+
+    // lets the workers finish every request queued so far
+    ~calculation_service();
+
+    calculation_service(const calculation_service &) = delete;
+
+    calculation_service &operator=(const calculation_service &) = delete;
+
+    // `values` holds one value per variable of the options. Waits while the queue is full. The future throws
+    // the formula's parse_exception if it is invalid.
+    std::future<double> submit(std::string formula, std::vector<double> values = {});
+
+    // same, but nothing is queued and null is returned if the queue is full
+    std::optional<std::future<double>> try_submit(std::string formula, std::vector<double> values = {});
+
+private:
+    std::unique_ptr<request> make_request(std::string formula, std::vector<double> values) const;
+
+    void wake_worker();
+
+    // the next request, null once the service stops with an empty queue
+    std::unique_ptr<request> wait_for_request();
+
+    void worker_loop();
+
+    void evaluate(std::vector<std::unique_ptr<request>> &batch);
+};
+
+#endif //CALCULATOR_CALCULATION_SERVICE_H
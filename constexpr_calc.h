@@ -0,0 +1,482 @@
+#ifndef CALCULATOR_CONSTEXPR_CALC_H
+#define CALCULATOR_CONSTEXPR_CALC_H
+
+#include <cstddef>
+#include <cstdint>
+#include <string_view>
+
+#include "engine.h"
+
+// Formulas without variables evaluated while compiling, with the grammar, error positions and
+// arithmetic of calculate(), down to the rounding of every literal:
+//
+//     constexpr double area = "2 * (3 + 4)"_calc;
+//
+// An invalid formula throws the parse_exception calculate() would throw, which in a constant expression
+// is a compile error pointing at the message. Dividing by zero is not a constant expression either.
+// Called at run time these are ordinary functions; only a constexpr context guarantees zero cost.
+class constexpr_formula {
+public:
+    // parentheses and unary minuses open at the same time
+    static const int max_depth = 256;
+
+    static constexpr double calculate(std::string_view formula) {
+        validate(formula, nullptr, 0);
+        return evaluate(formula, true);
+    }
+
+    // Throws what compile() would throw for the formula with these variables, without evaluating it.
+    static constexpr void check(std::string_view formula, const std::string_view *variables,
+                                std::size_t variable_count) {
+        validate(formula, variables, variable_count);
+        evaluate(formula, false);
+    }
+
+    // The grammar below is shared with static_formula.h.
+
+    enum class token_type {
+        end,
+        number,
+        variable,
+        opening_parenthesis,
+        closing_parenthesis,
+        multiply,
+        divide,
+        plus,
+        minus
+    };
+
+    struct token {
+        token_type type;
+        std::size_t start;
+        // one past the last character
+        std::size_t end;
+    };
+
+    // slot of the variable, or variable_count for an unknown one
+    static constexpr std::size_t find_variable(std::string_view name, const std::string_view *variables,
+                                               std::size_t variable_count) {
+        std::size_t slot = 0;
+        while (slot < variable_count && variables[slot] != name) {
+            slot++;
+        }
+        return slot;
+    }
+
+    // the first token at or after `position`, which must be a valid one
+    static constexpr token scan(std::string_view formula, std::size_t position) {
+        while (position < formula.size() && formula[position] == ' ') {
+            position++;
+        }
+        if (position == formula.size()) {
+            return {token_type::end, position, position};
+        }
+        switch (formula[position]) {
+            case '(':
+                return {token_type::opening_parenthesis, position, position + 1};
+            case ')':
+                return {token_type::closing_parenthesis, position, position + 1};
+            case '*':
+                return {token_type::multiply, position, position + 1};
+            case '/':
+                return {token_type::divide, position, position + 1};
+            case '+':
+                return {token_type::plus, position, position + 1};
+            case '-':
+                return {token_type::minus, position, position + 1};
+            default: {
+                bool number = is_number_symbol(formula[position]);
+                std::size_t end = position + 1;
+                while (end < formula.size() && (number ? is_number_symbol(formula[end])
+                                                       : is_identifier_symbol(formula[end]))) {
+                    end++;
+                }
+                return {number ? token_type::number : token_type::variable, position, end};
+            }
+        }
+    }
+
+    // The correctly rounded value of formula[start, end), like std::from_chars, rejecting what is not normal.
+    static constexpr double parse_number(std::string_view formula, std::size_t start, std::size_t end) {
+        int points = 0;
+        for (std::size_t i = start; i < end; i++) {
+            points += formula[i] == '.';
+        }
+        if (points > 1 || end - start == static_cast<std::size_t>(points)) {
+            throw parse_exception(start, "Invalid number");
+        }
+
+        // the value is 0.<digits> * 10^exponent with a non-zero first digit
+        big_number digits;
+        long long exponent = 0;
+        int kept_digits = 0;
+        bool started = false;
+        bool after_point = false;
+        bool dropped = false;
+        for (std::size_t i = start; i < end; i++) {
+            if (formula[i] == '.') {
+                after_point = true;
+                continue;
+            }
+            std::uint32_t digit = formula[i] - '0';
+            if (!started && digit == 0) {
+                exponent -= after_point;
+                continue;
+            }
+            started = true;
+            exponent += !after_point;
+            if (kept_digits < max_significant_digits) {
+                digits.multiply_add(10, digit);
+                kept_digits++;
+            } else {
+                dropped |= digit != 0;
+            }
+        }
+        // outside of [1e-308, 1e309) nothing is normal
+        if (!started || exponent > 309 || exponent < -307) {
+            throw parse_exception(start, "Number too long");
+        }
+        if (dropped) {
+            digits.multiply_add(10, 1);
+            kept_digits++;
+        }
+
+        // value = numerator / denominator
+        big_number &numerator = digits;
+        big_number denominator;
+        denominator.multiply_add(0, 1);
+        for (long long scale = exponent - kept_digits; scale > 0; scale--) {
+            numerator.multiply_add(10, 0);
+        }
+        for (long long scale = exponent - kept_digits; scale < 0; scale++) {
+            denominator.multiply_add(10, 0);
+        }
+
+        // value = quotient * 2^-shift, the quotient having 55 or 56 bits
+        int shift = 55 - (numerator.bit_length() - denominator.bit_length());
+        if (shift >= 0) {
+            numerator.shift_left(shift);
+        } else {
+            denominator.shift_left(-shift);
+        }
+        denominator.shift_left(56);
+        std::uint64_t quotient = 0;
+        for (int bit = 56; bit >= 0; bit--) {
+            if (!numerator.less(denominator)) {
+                numerator.subtract(denominator);
+                quotient |= std::uint64_t(1) << bit;
+            }
+            denominator.halve();
+        }
+        bool inexact = numerator.bit_length() != 0;
+
+        int quotient_bits = 0;
+        while (quotient >> quotient_bits != 0) {
+            quotient_bits++;
+        }
+        int top_exponent = quotient_bits - 1 - shift;
+        if (top_exponent > 1023 || top_exponent < -1023) {
+            throw parse_exception(start, "Number too long");
+        }
+
+        // round half to even at the last bit of the double, which is a subnormal one just below DBL_MIN
+        int lowest_exponent = top_exponent - 52 > -1074 ? top_exponent - 52 : -1074;
+        int dropped_bits = lowest_exponent + shift;
+        std::uint64_t mantissa = quotient >> dropped_bits;
+        bool half = quotient >> (dropped_bits - 1) & 1;
+        bool rest = (quotient & ((std::uint64_t(1) << (dropped_bits - 1)) - 1)) != 0 || inexact;
+        if (half && (rest || mantissa & 1)) {
+            mantissa++;
+        }
+
+        int mantissa_bits = 0;
+        while (mantissa >> mantissa_bits != 0) {
+            mantissa_bits++;
+        }
+        int final_exponent = mantissa_bits - 1 + lowest_exponent;
+        if (final_exponent > 1023 || final_exponent < -1022) {
+            throw parse_exception(start, "Number too long");
+        }
+
+        // exact: the mantissa fits into a double and every step stays a normal number
+        double value = static_cast<double>(mantissa);
+        for (int i = 0; i < lowest_exponent; i++) {
+            value *= 2;
+        }
+        for (int i = 0; i > lowest_exponent; i--) {
+            value *= 0.5;
+        }
+        return value;
+    }
+
+private:
+    struct pending {
+        enum {
+            binary,
+            negation,
+            group
+        } kind;
+        token_type binary_operator;
+    };
+
+    // Unsigned integer wide enough for a literal's significant digits scaled to 56 bits of quotient.
+    class big_number {
+        static const int size = 120;
+
+        // least significant first
+        std::uint32_t limbs[size] = {};
+
+    public:
+        constexpr void multiply_add(std::uint32_t factor, std::uint32_t addend) {
+            std::uint64_t carry = addend;
+            for (int i = 0; i < size; i++) {
+                std::uint64_t value = std::uint64_t(limbs[i]) * factor + carry;
+                limbs[i] = static_cast<std::uint32_t>(value);
+                carry = value >> 32;
+            }
+        }
+
+        constexpr void shift_left(int bits) {
+            int words = bits / 32;
+            int rest = bits % 32;
+            for (int i = size - 1; i >= 0; i--) {
+                std::uint64_t value = 0;
+                int from = i - words;
+                if (from >= 0) {
+                    value = std::uint64_t(limbs[from]) << rest;
+                    if (rest != 0 && from > 0) {
+                        value |= limbs[from - 1] >> (32 - rest);
+                    }
+                }
+                limbs[i] = static_cast<std::uint32_t>(value);
+            }
+        }
+
+        constexpr void halve() {
+            for (int i = 0; i < size; i++) {
+                limbs[i] = limbs[i] >> 1 | (i + 1 < size ? limbs[i + 1] << 31 : 0);
+            }
+        }
+
+        constexpr void subtract(const big_number &other) {
+            std::uint64_t borrow = 0;
+            for (int i = 0; i < size; i++) {
+                std::uint64_t value = std::uint64_t(limbs[i]) - other.limbs[i] - borrow;
+                limbs[i] = static_cast<std::uint32_t>(value);
+                borrow = value >> 63;
+            }
+        }
+
+        constexpr bool less(const big_number &other) const {
+            for (int i = size - 1; i >= 0; i--) {
+                if (limbs[i] != other.limbs[i]) {
+                    return limbs[i] < other.limbs[i];
+                }
+            }
+            return false;
+        }
+
+        constexpr int bit_length() const {
+            for (int i = size - 1; i >= 0; i--) {
+                for (int bit = 31; bit >= 0; bit--) {
+                    if (limbs[i] >> bit & 1) {
+                        return i * 32 + bit + 1;
+                    }
+                }
+            }
+            return 0;
+        }
+    };
+
+    // Significant digits beyond these only matter through a trailing 1, as no double or halfway point
+    // between two doubles needs more than 767 of them.
+    static const int max_significant_digits = 800;
+
+    static constexpr bool is_number_symbol(char symbol) {
+        return symbol >= '0' && symbol <= '9' || symbol == '.';
+    }
+
+    static constexpr bool is_identifier_start(char symbol) {
+        return symbol >= 'a' && symbol <= 'z' || symbol >= 'A' && symbol <= 'Z' || symbol == '_';
+    }
+
+    static constexpr bool is_identifier_symbol(char symbol) {
+        return is_identifier_start(symbol) || symbol >= '0' && symbol <= '9';
+    }
+
+    // Reports what the tokenizer of calculate() reports, in the same order, before parsing starts.
+    static constexpr void validate(std::string_view formula, const std::string_view *variables,
+                                   std::size_t variable_count) {
+        bool empty = true;
+        int open_parentheses = 0;
+        // the outermost parenthesis still open
+        std::size_t outermost = 0;
+        for (std::size_t i = 0; i < formula.size(); i++) {
+            char symbol = formula[i];
+            if (symbol != ' ') {
+                empty = false;
+            }
+
+            if (is_number_symbol(symbol)) {
+                std::size_t end = i + 1;
+                while (end < formula.size() && is_number_symbol(formula[end])) {
+                    end++;
+                }
+                parse_number(formula, i, end);
+                i = end - 1;
+                continue;
+            }
+            if (is_identifier_start(symbol)) {
+                std::size_t end = i + 1;
+                while (end < formula.size() && is_identifier_symbol(formula[end])) {
+                    end++;
+                }
+                if (find_variable(formula.substr(i, end - i), variables, variable_count) == variable_count) {
+                    throw parse_exception(i, "Unknown variable");
+                }
+                i = end - 1;
+                continue;
+            }
+
+            switch (symbol) {
+                case ' ':
+                case '+':
+                case '-':
+                case '*':
+                case '/':
+                    break;
+                case '(':
+                    if (open_parentheses++ == 0) {
+                        outermost = i;
+                    }
+                    break;
+                case ')':
+                    if (open_parentheses-- == 0) {
+                        throw parse_exception(i, "Unmatched closing parenthesis");
+                    }
+                    break;
+                default:
+                    throw parse_exception(i, "Unexpected symbol");
+            }
+        }
+
+        if (open_parentheses != 0) {
+            throw parse_exception(outermost, "Unclosed parenthesis");
+        }
+        if (empty) {
+            throw parse_exception(0, "Empty input");
+        }
+    }
+
+    static constexpr bool binds_tighter(token_type left, token_type right) {
+        bool left_second = left == token_type::multiply || left == token_type::divide;
+        bool right_second = right == token_type::multiply || right == token_type::divide;
+        return left_second || !right_second;
+    }
+
+    static constexpr double apply(token_type binary_operator, double left, double right) {
+        switch (binary_operator) {
+            case token_type::multiply:
+                return left * right;
+            case token_type::divide:
+                return left / right;
+            case token_type::plus:
+                return left + right;
+            default:
+                return left - right;
+        }
+    }
+
+    // Same operator precedence loop as the parser of calculate(), computing values instead of nodes,
+    // or only checking the syntax when not `computing`, as variables have no values yet.
+    static constexpr double evaluate(std::string_view formula, bool computing) {
+        // binary operators wait at most two to a group, one of each priority
+        pending operators[3 * max_depth + 3] = {};
+        double operands[2 * max_depth + 3] = {};
+        int pending_operators = 0;
+        int pending_operands = 0;
+        int depth = 0;
+        std::size_t position = 0;
+
+        for (;;) {
+            for (;;) {
+                token next = scan(formula, position);
+                position = next.end;
+                if (next.type == token_type::end) {
+                    throw parse_exception(formula.size(), "Unexpected end of input");
+                }
+                if (next.type == token_type::number || next.type == token_type::variable) {
+                    operands[pending_operands++] = computing && next.type == token_type::number
+                                                   ? parse_number(formula, next.start, next.end) : 0;
+                    break;
+                }
+                if (next.type == token_type::opening_parenthesis) {
+                    if (scan(formula, position).type == token_type::closing_parenthesis) {
+                        throw parse_exception(next.start, "Empty parentheses");
+                    }
+                    operators[pending_operators++] = {pending::group, token_type::end};
+                } else if (next.type == token_type::minus) {
+                    token_type after = scan(formula, position).type;
+                    if (after == token_type::closing_parenthesis || after == token_type::end) {
+                        throw parse_exception(next.start, "Orphan minus");
+                    }
+                    operators[pending_operators++] = {pending::negation, token_type::end};
+                } else {
+                    throw parse_exception(next.start, "Unexpected token");
+                }
+                if (++depth > max_depth) {
+                    throw parse_exception(next.start, "Too deeply nested");
+                }
+            }
+
+            // the operand may complete negations and groups, which are operands themselves
+            for (;;) {
+                while (pending_operators > 0 && operators[pending_operators - 1].kind == pending::negation) {
+                    operands[pending_operands - 1] = -1 * operands[pending_operands - 1];
+                    pending_operators--;
+                    depth--;
+                }
+                token next = scan(formula, position);
+                if (next.type != token_type::closing_parenthesis && next.type != token_type::end) {
+                    break;
+                }
+                while (pending_operators > 0 && operators[pending_operators - 1].kind == pending::binary) {
+                    reduce(operators, pending_operators, operands, pending_operands, computing);
+                }
+                if (pending_operators == 0) {
+                    return operands[0];
+                }
+                pending_operators--;
+                depth--;
+                position = next.end;
+            }
+
+            token next = scan(formula, position);
+            if (next.type == token_type::number || next.type == token_type::variable
+                || next.type == token_type::opening_parenthesis) {
+                throw parse_exception(next.start, "Unexpected token: operator needed");
+            }
+            while (pending_operators > 0 && operators[pending_operators - 1].kind == pending::binary
+                   && binds_tighter(operators[pending_operators - 1].binary_operator, next.type)) {
+                reduce(operators, pending_operators, operands, pending_operands, computing);
+            }
+            operators[pending_operators++] = {pending::binary, next.type};
+            position = next.end;
+        }
+    }
+
+    static constexpr void reduce(pending *operators, int &pending_operators, double *operands, int &pending_operands,
+                                 bool computing) {
+        double right = operands[--pending_operands];
+        token_type binary_operator = operators[--pending_operators].binary_operator;
+        if (computing) {
+            operands[pending_operands - 1] = apply(binary_operator, operands[pending_operands - 1], right);
+        }
+    }
+};
+
+constexpr double operator ""_calc(const char *formula, std::size_t length) {
+    return constexpr_formula::calculate(std::string_view(formula, length));
+}
+
+#endif //CALCULATOR_CONSTEXPR_CALC_H
@@ -0,0 +1,223 @@
+#include <charconv>
+#include <cmath>
+#include <cstdlib>
+#include <limits>
+#include <memory>
+#include <stdexcept>
+#include <string>
+#include <system_error>
+
+#include "decimal.h"
+
+static const int max_places = decimal_program::max_places;
+
+static const std::int64_t powers_of_ten[max_places + 1] = {
+        1, 10, 100, 1000, 10000, 100000, 1000000, 10000000, 100000000, 1000000000, 10000000000,
+        100000000000, 1000000000000, 10000000000000, 100000000000000, 1000000000000000,
+        10000000000000000, 100000000000000000, 1000000000000000000
+};
+
+[[noreturn]] static void overflow() {
+    throw std::overflow_error("Decimal overflow");
+}
+
+static bool fits(__int128 value) {
+    return value <= std::numeric_limits<std::int64_t>::max() && value >= std::numeric_limits<std::int64_t>::min();
+}
+
+static std::int64_t narrow(__int128 value) {
+    if (!fits(value)) {
+        overflow();
+    }
+    return static_cast<std::int64_t>(value);
+}
+
+// numerator / denominator to the nearest integer, halves away from zero. 64-bit division when the numerator
+// fits, which is most of the time and much cheaper than a 128-bit one.
+static __int128 divide_rounded(__int128 numerator, std::int64_t denominator) {
+    __int128 quotient;
+    __int128 remainder;
+    if (numerator >= std::numeric_limits<std::int64_t>::min() && numerator <= std::numeric_limits<std::int64_t>::max()
+        && !(numerator == std::numeric_limits<std::int64_t>::min() && denominator == -1)) {
+        std::int64_t narrow_numerator = static_cast<std::int64_t>(numerator);
+        quotient = narrow_numerator / denominator;
+        remainder = narrow_numerator % denominator;
+    } else {
+        quotient = numerator / denominator;
+        remainder = numerator - quotient * denominator;
+    }
+    __int128 twice_remainder = remainder < 0 ? -2 * remainder : 2 * remainder;
+    if (twice_remainder >= (denominator < 0 ? -static_cast<__int128>(denominator) : denominator)) {
+        quotient += (numerator < 0) != (denominator < 0) ? -1 : 1;
+    }
+    return quotient;
+}
+
+double decimal::to_double() const {
+    // both exact as doubles, so the quotient is rounded once
+    if (units <= (std::int64_t(1) << 53) && units >= -(std::int64_t(1) << 53)) {
+        return static_cast<double>(units) / static_cast<double>(powers_of_ten[places]);
+    }
+    std::string text = to_string();
+    double value;
+    std::from_chars(text.data(), text.data() + text.size(), value);
+    return value;
+}
+
+std::string decimal::to_string() const {
+    // the magnitude as unsigned, so that the lowest units survive
+    std::uint64_t magnitude = units < 0 ? 0 - static_cast<std::uint64_t>(units) : units;
+    std::string digits = std::to_string(magnitude);
+    if (digits.size() <= static_cast<std::size_t>(places)) {
+        digits.insert(0, places + 1 - digits.size(), '0');
+    }
+    if (places > 0) {
+        digits.insert(digits.size() - places, ".");
+    }
+    return units < 0 ? "-" + digits : digits;
+}
+
+decimal_program::decimal_program(const bytecode &program, int _places)
+        : instructions(program.instructions), max_stack(program.max_stack), temporaries(program.temporaries),
+          places(_places) {
+    if (places < 0 || places > max_places) {
+        throw std::invalid_argument("Decimal places must be from 0 to 18");
+    }
+    scale = powers_of_ten[places];
+    double_scale = static_cast<double>(scale);
+    for (double constant : program.constants) {
+        constants.push_back(units(constant));
+    }
+}
+
+std::int64_t decimal_program::units(double value) const {
+    double scaled = value * double_scale;
+    double magnitude = std::fabs(scaled);
+    if (magnitude < 0x1p52) {
+        // The shortest decimal for `value` is within an ulp or two of `scaled` once scaled, so unless `scaled` is
+        // about halfway between two units, rounding it rounds the decimal the same way.
+        double fraction = magnitude - std::floor(magnitude);
+        if (std::fabs(fraction - 0.5) > magnitude * 0x1p-50) {
+            return static_cast<std::int64_t>(std::round(scaled));
+        }
+    }
+    if (!std::isfinite(value)) {
+        throw std::domain_error("Not a finite number");
+    }
+    std::int64_t result;
+    if (!units_of_shortest(value, places, result)) {
+        overflow();
+    }
+    return result;
+}
+
+bool decimal_program::representable(double value, int places) {
+    std::int64_t units;
+    return std::isfinite(value) && units_of_shortest(value, places, units);
+}
+
+bool decimal_program::units_of_shortest(double value, int places, std::int64_t &units) {
+    if (value == 0) {
+        units = 0;
+        return true;
+    }
+    // [-]d.ddde±x with at most 17 digits, all of which fit into the mantissa
+    char text[32];
+    char *end = std::to_chars(text, text + sizeof(text), value, std::chars_format::scientific).ptr;
+    const char *digit = text + (value < 0);
+    std::int64_t mantissa = 0;
+    int digit_count = 0;
+    for (; *digit != 'e'; digit++) {
+        if (*digit != '.') {
+            mantissa = mantissa * 10 + (*digit - '0');
+            digit_count++;
+        }
+    }
+    int exponent = 0;
+    std::from_chars(digit + 1 + (digit[1] == '+'), end, exponent);
+
+    // units = mantissa * 10^shift
+    int shift = exponent - (digit_count - 1) + places;
+    __int128 magnitude;
+    if (shift >= 0) {
+        if (shift > max_places) {
+            return false;
+        }
+        magnitude = static_cast<__int128>(mantissa) * powers_of_ten[shift];
+    } else if (-shift > digit_count) {
+        // below a tenth of a unit
+        magnitude = 0;
+    } else {
+        magnitude = mantissa / powers_of_ten[-shift];
+        if (mantissa / powers_of_ten[-shift - 1] % 10 >= 5) {
+            magnitude++;
+        }
+    }
+    if (value < 0) {
+        magnitude = -magnitude;
+    }
+    if (!fits(magnitude)) {
+        return false;
+    }
+    units = static_cast<std::int64_t>(magnitude);
+    return true;
+}
+
+decimal decimal_program::run(const double *variables) const {
+    // the native stack is enough for all but really deep formulas
+    std::int64_t local_stack[64];
+    std::unique_ptr<std::int64_t[]> heap_stack;
+    std::int64_t *stack = local_stack;
+    if (max_stack + temporaries > 64) {
+        heap_stack.reset(new std::int64_t[max_stack + temporaries]);
+        stack = heap_stack.get();
+    }
+    std::int64_t *const saved = stack + max_stack;
+    std::int64_t *top = stack;
+    for (const instruction &instruction : instructions) {
+        switch (instruction.code) {
+            case opcode::push:
+                *top++ = constants[instruction.operand];
+                break;
+            case opcode::load:
+                *top++ = units(variables[instruction.operand]);
+                break;
+            case opcode::add:
+                top--;
+                if (__builtin_add_overflow(top[-1], top[0], &top[-1])) {
+                    overflow();
+                }
+                break;
+            case opcode::subtract:
+                top--;
+                if (__builtin_sub_overflow(top[-1], top[0], &top[-1])) {
+                    overflow();
+                }
+                break;
+            case opcode::multiply:
+                top--;
+                top[-1] = narrow(divide_rounded(static_cast<__int128>(top[-1]) * top[0], scale));
+                break;
+            case opcode::divide:
+                top--;
+                if (top[0] == 0) {
+                    throw std::domain_error("Division by zero");
+                }
+                top[-1] = narrow(divide_rounded(static_cast<__int128>(top[-1]) * scale, top[0]));
+                break;
+            case opcode::negate:
+                if (top[-1] == std::numeric_limits<std::int64_t>::min()) {
+                    overflow();
+                }
+                top[-1] = -top[-1];
+                break;
+            case opcode::save:
+                saved[instruction.operand] = top[-1];
+                break;
+            case opcode::recall:
+                *top++ = saved[instruction.operand];
+                break;
+        }
+    }
+    return {stack[0], places};
+}
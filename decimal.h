@@ -0,0 +1,46 @@
+#ifndef CALCULATOR_DECIMAL_H
+#define CALCULATOR_DECIMAL_H
+
+#include <cstdint>
+#include <vector>
+
+#include "bytecode.h"
+#include "engine.h"
+
+// A bytecode program run on fixed-point decimals: every value is a 64-bit count of units of 10^-places.
+// Sums are exact, products and quotients are computed exactly in 128 bits and rounded to the nearest unit,
+// halves away from zero. Constants and variables are taken as the shortest decimal that reads back as the
+// same double, so 0.1 is exactly a tenth. Nothing is allocated per operation, and no value goes wrong
+// silently: leaving the 64-bit range throws std::overflow_error, dividing by zero or passing a value that
+// is not finite std::domain_error.
+class decimal_program {
+    std::vector<instruction> instructions;
+    // in units
+    std::vector<std::int64_t> constants;
+    int max_stack;
+    int temporaries;
+    int places;
+    std::int64_t scale;
+    double double_scale;
+
+public:
+    static const int max_places = 18;
+
+    // `_places` from 0 to max_places, else std::invalid_argument; constants out of range throw
+    // std::overflow_error, see representable()
+    decimal_program(const bytecode &program, int _places);
+
+    // whether `value` is finite and converts to units of 10^-places without overflowing,
+    // for 0 <= places <= max_places
+    static bool representable(double value, int places);
+
+    decimal run(const double *variables) const;
+
+private:
+    std::int64_t units(double value) const;
+
+    // false if `value` is out of range
+    static bool units_of_shortest(double value, int places, std::int64_t &units);
+};
+
+#endif //CALCULATOR_DECIMAL_H
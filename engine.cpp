@@ -1,12 +1,41 @@
 #include <string>
+#include <string_view>
+#include <charconv>
 #include <vector>
+#include <memory>
+#include <new>
 #include <cmath>
+#include <cstdint>
+#include <cstddef>
+#include <limits>
+#include <algorithm>
+#include <atomic>
+#include <unordered_map>
+#include <map>
+#include <unordered_set>
+#include <typeindex>
+#include <cstring>
 #include <stdexcept>
 
+#ifdef CALCULATOR_STATS
+#include <chrono>
+#include <mutex>
+// wraps the statements that only exist in builds with stats
+#define CALCULATOR_STATS_ONLY(...) __VA_ARGS__
+#else
+#define CALCULATOR_STATS_ONLY(...)
+#endif
+
 #include "engine.h"
+#include "bytecode.h"
+#include "jit.h"
+#include "decimal.h"
+#include "flat_tree.h"
+#include "thread_pool.h"
 
 enum class token_type {
     number,
+    variable,
     opening_parenthesis,
     closing_parenthesis,
     multiply,
@@ -27,40 +56,253 @@ public:
     broken_parser_exception(const std::string &message): std::runtime_error("Broken parser: " + message) {}
 };
 
+// One word per token: the type in the top byte and the offset in the formula below it.
+// Literal values, variable slots and parenthesis matches live in side tables of the parser.
 class token {
-    double _value;
+    static const int type_shift = 56;
+
+    std::uint64_t packed;
+
 public:
-    const token_type type;
-    const int start_position;
+    // for tables filled in afterwards
+    token() = default;
 
-    token(token_type _type, int _start_position, double value = 0)
-            : type(_type), start_position(_start_position), _value(value) {}
+    token(token_type type, std::size_t start_position)
+            : packed(static_cast<std::uint64_t>(type) << type_shift | start_position) {}
 
-    // TODO: need something more elegant than the field and the method that are working only for one token type...
-    double value() const {
-        if (type != token_type::number) {
-            throw broken_parser_exception("Unsupported operation");
-        }
+    token_type type() const {
+        return static_cast<token_type>(packed >> type_shift);
+    }
 
-        return _value;
+    std::size_t start_position() const {
+        return packed & ((std::uint64_t(1) << type_shift) - 1);
     }
 };
 
+static_assert(sizeof(token) == 8, "Tokens are meant to be a single word");
+
 enum class priority {
     lowest, // expression root
     first, // "+", "-"
     second // "*", "/"
 };
 
+// Bump allocator for expression nodes. A formula's nodes are carved out of one block (more only if
+// the reserved size turns out to be too small) and released all at once: node destructors are never run,
+// so nodes must not own anything but other nodes from the same arena.
+class arena {
+    std::vector <std::unique_ptr<char[]>> blocks;
+    char *next = nullptr;
+    std::size_t available = 0;
+    std::size_t next_block_size = 4096;
+    std::size_t block_bytes = 0;
+
+public:
+    arena() = default;
+
+    arena(const arena &) = delete;
+
+    arena &operator=(const arena &) = delete;
+
+    void reserve(std::size_t bytes) {
+        if (bytes > available) {
+            add_block(bytes);
+        }
+    }
+
+    std::size_t block_count() const {
+        return blocks.size();
+    }
+
+    std::size_t allocated_bytes() const {
+        return block_bytes;
+    }
+
+    // takes over the blocks of `other`, whose nodes then live as long as this arena
+    void adopt(arena &other) {
+        for (std::unique_ptr<char[]> &block : other.blocks) {
+            blocks.push_back(std::move(block));
+        }
+        block_bytes += other.block_bytes;
+        other.blocks.clear();
+        other.block_bytes = 0;
+        other.next = nullptr;
+        other.available = 0;
+    }
+
+    template<typename node, typename... arguments>
+    node *create(arguments &&... args) {
+        static_assert(alignof(node) <= alignof(std::max_align_t), "Over-aligned nodes are not supported");
+        void *memory = allocate(sizeof(node), alignof(node));
+        return new(memory) node(std::forward<arguments>(args)...);
+    }
+
+private:
+    void *allocate(std::size_t size, std::size_t alignment) {
+        std::size_t padding = -reinterpret_cast<std::uintptr_t>(next) & (alignment - 1);
+        if (padding + size > available) {
+            add_block(std::max(size, next_block_size));
+            next_block_size *= 2;
+            padding = 0;
+        }
+        void *result = next + padding;
+        next += padding + size;
+        available -= padding + size;
+        return result;
+    }
+
+    void add_block(std::size_t size) {
+        blocks.emplace_back(new char[size]);
+        block_bytes += size;
+        next = blocks.back().get();
+        available = size;
+    }
+};
+
+const char *parse_error_message(parse_error error) {
+    switch (error) {
+        case parse_error::none:
+            return "No error";
+        case parse_error::empty_input:
+            return "Empty input";
+        case parse_error::formula_too_long:
+            return "Formula too long";
+        case parse_error::unexpected_end:
+            return "Unexpected end of input";
+        case parse_error::empty_parentheses:
+            return "Empty parentheses";
+        case parse_error::orphan_minus:
+            return "Orphan minus";
+        case parse_error::unexpected_token:
+            return "Unexpected token";
+        case parse_error::too_deeply_nested:
+            return "Too deeply nested";
+        case parse_error::operator_needed:
+            return "Unexpected token: operator needed";
+        case parse_error::invalid_number:
+            return "Invalid number";
+        case parse_error::number_too_long:
+            return "Number too long";
+        case parse_error::unknown_variable:
+            return "Unknown variable";
+        case parse_error::unmatched_closing_parenthesis:
+            return "Unmatched closing parenthesis";
+        case parse_error::unexpected_symbol:
+            return "Unexpected symbol";
+        case parse_error::unclosed_parenthesis:
+            return "Unclosed parenthesis";
+        case parse_error::invalid_decimal_places:
+            return "Decimal places must be from 0 to 18";
+    }
+    throw broken_parser_exception("Unknown error");
+}
+
 class expression {
 public:
-    virtual ~expression() = default;
+    // `variables` holds the values of all variable slots
+    virtual double calc(const double *variables) const = 0;
+
+    // same as calc(), with the values of the operands already computed, for walking the tree without recursion
+    virtual double combine(const double *operands, const double *variables) const = 0;
+
+    // appends the instruction for this node only, its operands are emitted before it
+    virtual void emit(bytecode &program) const = 0;
+
+    // Returns a node equivalent to this one with `operands` (already simplified) in place of its own.
+    // Only rewrites that keep results bit-identical are allowed.
+    virtual const expression *simplify(arena &nodes, const expression *const *operands) const = 0;
+
+    virtual int operand_count() const {
+        return 0;
+    }
+
+    virtual const expression *operand(int index) const {
+        throw broken_parser_exception("No operands");
+    }
+
+    // true if calc() does not depend on variables
+    virtual bool constant() const {
+        return false;
+    }
+
+    // the operand of a unary minus, null for any other node
+    virtual const expression *negated() const {
+        return nullptr;
+    }
+
+    // the slot a variable reads, -1 for any other node
+    virtual int variable_slot() const {
+        return -1;
+    }
+
+protected:
+    // nodes live in an arena and are never deleted one by one
+    ~expression() = default;
+};
+
+class number : public expression {
+    double value;
+
+public:
+    number(double _value) : value(_value) {}
+
+    double calc(const double *variables) const override {
+        return value;
+    }
+
+    double combine(const double *operands, const double *variables) const override {
+        return value;
+    }
+
+    void emit(bytecode &program) const override {
+        program.push(value);
+    }
+
+    const expression *simplify(arena &nodes, const expression *const *operands) const override {
+        return this;
+    }
+
+    bool constant() const override {
+        return true;
+    }
+};
+
+class variable : public expression {
+    int slot;
+
+public:
+    variable(int _slot) : slot(_slot) {}
+
+    double calc(const double *variables) const override {
+        return variables[slot];
+    }
+
+    double combine(const double *operands, const double *variables) const override {
+        return variables[slot];
+    }
+
+    void emit(bytecode &program) const override {
+        program.load(slot);
+    }
 
-    virtual double calc() const = 0;
+    const expression *simplify(arena &nodes, const expression *const *operands) const override {
+        return this;
+    }
 
-    virtual int consumed_tokens() const = 0;
+    int variable_slot() const override {
+        return slot;
+    }
 };
 
+static bool is_literal(const expression *node, double value) {
+    return node->constant() && node->calc(nullptr) == value;
+}
+
+// +0 only: -0 compares equal to it, but x - -0 is +0 for x = -0
+static bool is_positive_zero(const expression *node) {
+    return is_literal(node, 0) && !std::signbit(node->calc(nullptr));
+}
+
 class two_operand_expression : public expression {
 protected:
     const expression *left;
@@ -69,49 +311,114 @@ protected:
 public:
     two_operand_expression(const expression *_left, const expression *_right) : left(_left), right(_right) {}
 
-    virtual ~two_operand_expression() {
-        delete left;
-        delete right;
+    int operand_count() const override {
+        return 2;
+    }
+
+    const expression *operand(int index) const override {
+        return index == 0 ? left : right;
+    }
+};
+
+// `derived` provides the arithmetic itself as a static apply()
+template<typename derived>
+class binary_operator : public two_operand_expression {
+public:
+    binary_operator(const expression *_left, const expression *_right) : two_operand_expression(_left, _right) {}
+
+    double calc(const double *variables) const override {
+        return derived::apply(left->calc(variables), right->calc(variables));
     }
 
-    int consumed_tokens() const override {
-        return left->consumed_tokens() + right->consumed_tokens() + 1;
+    double combine(const double *operands, const double *variables) const override {
+        return derived::apply(operands[0], operands[1]);
+    }
+
+    const expression *simplify(arena &nodes, const expression *const *operands) const override {
+        if (operands[0]->constant() && operands[1]->constant()) {
+            return nodes.create<number>(derived::apply(operands[0]->calc(nullptr), operands[1]->calc(nullptr)));
+        }
+        if (operands[0] == left && operands[1] == right) {
+            return this;
+        }
+        return nodes.create<derived>(operands[0], operands[1]);
     }
 };
 
-class add : public two_operand_expression {
+class add : public binary_operator<add> {
 public:
-    add(const expression *_left, const expression *_right) : two_operand_expression(_left, _right) {}
+    add(const expression *_left, const expression *_right) : binary_operator(_left, _right) {}
 
-    double calc() const override {
-        return left->calc() + right->calc();
+    static double apply(double left, double right) {
+        return left + right;
+    }
+
+    void emit(bytecode &program) const override {
+        program.emit(opcode::add);
     }
 };
 
-class subtract : public two_operand_expression {
+class subtract : public binary_operator<subtract> {
 public:
-    subtract(const expression *_left, const expression *_right) : two_operand_expression(_left, _right) {}
+    subtract(const expression *_left, const expression *_right) : binary_operator(_left, _right) {}
+
+    static double apply(double left, double right) {
+        return left - right;
+    }
 
-    double calc() const override {
-        return left->calc() - right->calc();
+    void emit(bytecode &program) const override {
+        program.emit(opcode::subtract);
+    }
+
+    const expression *simplify(arena &nodes, const expression *const *operands) const override {
+        // unlike x + 0, x - 0 is x even for x = -0
+        if (is_positive_zero(operands[1])) {
+            return operands[0];
+        }
+        return binary_operator::simplify(nodes, operands);
     }
 };
 
-class multiply : public two_operand_expression {
+class multiply : public binary_operator<multiply> {
 public:
-    multiply(const expression *_left, const expression *_right) : two_operand_expression(_left, _right) {}
+    multiply(const expression *_left, const expression *_right) : binary_operator(_left, _right) {}
+
+    static double apply(double left, double right) {
+        return left * right;
+    }
+
+    void emit(bytecode &program) const override {
+        program.emit(opcode::multiply);
+    }
 
-    double calc() const override {
-        return left->calc() * right->calc();
+    const expression *simplify(arena &nodes, const expression *const *operands) const override {
+        if (is_literal(operands[1], 1)) {
+            return operands[0];
+        }
+        if (is_literal(operands[0], 1)) {
+            return operands[1];
+        }
+        return binary_operator::simplify(nodes, operands);
     }
 };
 
-class divide : public two_operand_expression {
+class divide : public binary_operator<divide> {
 public:
-    divide(const expression *_left, const expression *_right) : two_operand_expression(_left, _right) {}
+    divide(const expression *_left, const expression *_right) : binary_operator(_left, _right) {}
+
+    static double apply(double left, double right) {
+        return left / right;
+    }
+
+    void emit(bytecode &program) const override {
+        program.emit(opcode::divide);
+    }
 
-    double calc() const override {
-        return left->calc() / right->calc();
+    const expression *simplify(arena &nodes, const expression *const *operands) const override {
+        if (is_literal(operands[1], 1)) {
+            return operands[0];
+        }
+        return binary_operator::simplify(nodes, operands);
     }
 };
 
@@ -121,32 +428,28 @@ class parentheses : public expression {
 public:
     parentheses(const expression *e) : content(e) {}
 
-    ~parentheses() {
-        delete content;
+    double calc(const double *variables) const override {
+        return content->calc(variables);
     }
 
-    double calc() const override {
-        return content->calc();
+    double combine(const double *operands, const double *variables) const override {
+        return operands[0];
     }
 
-    int consumed_tokens() const override {
-        return content->consumed_tokens() + 2;
+    void emit(bytecode &program) const override {
     }
-};
-
-class number : public expression {
-    double value;
-
-public:
-    number(double _value) : value(_value) {}
 
-    double calc() const override {
-        return value;
+    const expression *simplify(arena &nodes, const expression *const *operands) const override {
+        return operands[0];
     }
 
-    int consumed_tokens() const override {
+    int operand_count() const override {
         return 1;
     }
+
+    const expression *operand(int index) const override {
+        return content;
+    }
 };
 
 class negative : public expression {
@@ -155,67 +458,140 @@ class negative : public expression {
 public:
     negative(const expression *_content): content(_content) {}
 
-    ~negative() {
-        delete content;
+    double calc(const double *variables) const override {
+        return -1 * content->calc(variables);
     }
 
-    double calc() const override {
-        return -1 * content->calc();
+    double combine(const double *operands, const double *variables) const override {
+        return -1 * operands[0];
     }
 
-    int consumed_tokens() const override {
-        return content->consumed_tokens() + 1;
+    void emit(bytecode &program) const override {
+        program.emit(opcode::negate);
     }
-};
 
-class parser {
-    const std::string formula;
-    std::vector <token> tokens;
+    const expression *simplify(arena &nodes, const expression *const *operands) const override {
+        if (operands[0]->constant()) {
+            return nodes.create<number>(-1 * operands[0]->calc(nullptr));
+        }
+        // multiplying by -1 twice only flips the sign back
+        if (operands[0]->negated()) {
+            return operands[0]->negated();
+        }
+        if (operands[0] == content) {
+            return this;
+        }
+        return nodes.create<negative>(operands[0]);
+    }
 
-public:
-    parser(const std::string &_formula) : formula(_formula) {}
+    int operand_count() const override {
+        return 1;
+    }
 
-    expression *parse() {
-        tokens = tokenize();
-        if (tokens.empty()) {
-            throw parse_exception(0, "Empty input");
-        }
-        return parse_range(0, tokens.size() - 1, priority::lowest);
+    const expression *operand(int index) const override {
+        return content;
     }
 
-private:
-    expression *parse_range(int start, int end, priority parent_priority) {
-        const int available_tokens = end - start + 1;
+    const expression *negated() const override {
+        return content;
+    }
+};
 
-        expression *result = parse_operand(start, end);
-        int consumed_tokens = result->consumed_tokens();
+// Visits every node after its operands, left to right, with an explicit stack instead of recursion.
+// Nodes for which enter() returns false are skipped along with their operands. A node shared by several
+// parents is reached once per parent.
+template<typename visitor, typename filter>
+void post_order(const expression *root, visitor visit, filter enter) {
+    std::vector <std::pair<const expression *, bool>> pending = {{root, false}};
+    while (!pending.empty()) {
+        const expression *node = pending.back().first;
+        bool expanded = pending.back().second;
+        pending.pop_back();
+        if (expanded) {
+            visit(node);
+            continue;
+        }
+        if (!enter(node)) {
+            continue;
+        }
+        pending.push_back({node, true});
+        for (int i = node->operand_count() - 1; i >= 0; i--) {
+            pending.push_back({node->operand(i), false});
+        }
+    }
+}
 
-        while (available_tokens > consumed_tokens) {
-            int next_operator_index = start + result->consumed_tokens();
-            _operator next_operator = parse_operator(tokens[next_operator_index]);
-            consumed_tokens++;
-            priority operator_priority = get_priority(next_operator);
+template<typename visitor>
+void post_order(const expression *root, visitor visit) {
+    post_order(root, visit, [](const expression *node) {
+        return true;
+    });
+}
 
-            if (operator_priority <= parent_priority) {
-                return result;
-            }
+// Trees deeper than this are evaluated with post_order() instead of recursive calc() calls,
+// which keeps the native stack bounded for any input.
+static const int max_recursion_depth = 1000;
 
-            expression *next_operand = parse_range(start + consumed_tokens, end, operator_priority);
-            result = create_two_operand_expression(result, next_operator, next_operand);
-            consumed_tokens = result->consumed_tokens();
+static int tree_depth(const expression *root) {
+    std::vector <int> depths;
+    post_order(root, [&depths](const expression *node) {
+        int depth = 0;
+        for (int i = 0; i < node->operand_count(); i++) {
+            depth = std::max(depth, depths.back());
+            depths.pop_back();
         }
+        depths.push_back(depth + 1);
+    });
+    return depths.back();
+}
 
-        return result;
+static double calc_iteratively(const expression *root, const double *variables) {
+    std::vector <double> values;
+    post_order(root, [&values, variables](const expression *node) {
+        int count = node->operand_count();
+        double result = node->combine(values.data() + values.size() - count, variables);
+        values.resize(values.size() - count);
+        values.push_back(result);
+    });
+    return values.back();
+}
+
+// How the parser makes nodes. A handle is what it keeps of an operand, `none` standing for an error.
+class tree_builder {
+    arena &nodes;
+
+public:
+    using handle = expression *;
+    static constexpr handle none = nullptr;
+
+    explicit tree_builder(arena &_nodes) : nodes(_nodes) {}
+
+    handle make_number(double value) {
+        return nodes.create<number>(value);
     }
 
-    priority get_priority(_operator _operator) {
+    handle make_variable(int slot) {
+        return nodes.create<variable>(slot);
+    }
+
+    handle make_negative(handle content) {
+        return nodes.create<negative>(content);
+    }
+
+    handle make_group(handle content) {
+        return nodes.create<parentheses>(content);
+    }
+
+    handle make_binary(handle left, _operator _operator, handle right) {
         switch (_operator) {
-            case _operator::minus:
-            case _operator::plus:
-                return priority::first;
             case _operator::multiply:
+                return nodes.create<multiply>(left, right);
             case _operator::divide:
-                return priority::second;
+                return nodes.create<divide>(left, right);
+            case _operator::plus:
+                return nodes.create<add>(left, right);
+            case _operator::minus:
+                return nodes.create<subtract>(left, right);
 #pragma clang diagnostic push
 #pragma ide diagnostic ignored "UnreachableCode"
             default:
@@ -223,83 +599,44 @@ private:
 #pragma clang diagnostic pop
         }
     }
+};
 
-    _operator parse_operator(const token &token) {
-        switch (token.type) {
-            case token_type::plus:
-                return _operator::plus;
-            case token_type::minus:
-                return _operator::minus;
-            case token_type::multiply:
-                return _operator::multiply;
-            case token_type::divide:
-                return _operator::divide;
-            default:
-                throw parse_exception(token.start_position, "Unexpected token: operator needed");
-        }
-    }
+// builds a flat_tree, whose nodes are handled by index
+class flat_builder {
+    flat_tree &tree;
 
-    // either number, or parenthesis, or minus number/parenthesis
-    expression *parse_operand(int start, int end) {
-        const token &first_token = tokens[start];
-        switch (first_token.type) {
-            case token_type::opening_parenthesis:
-                return parse_parentheses(start, end);
+public:
+    using handle = std::uint32_t;
+    static constexpr handle none = UINT32_MAX;
 
-            case token_type::minus:
-                if (start == end) {
-                    throw parse_exception(first_token.start_position, "Orphan minus");
-                }
-                return new negative(parse_operand(start + 1, end));
+    explicit flat_builder(flat_tree &_tree) : tree(_tree) {}
 
-            case token_type::number:
-                return new number(first_token.value());
+    handle make_number(double value) {
+        return tree.push(value);
+    }
 
-            default:
-                throw parse_exception(first_token.start_position, "Unexpected token");
-        }
+    handle make_variable(int slot) {
+        return tree.load(slot);
     }
 
-    expression *parse_parentheses(int start, int end) {
-        int closing_parenthesis_index = find_closing_parenthesis(start + 1, end);
-        if (closing_parenthesis_index == -1) {
-            throw parse_exception(tokens[start].start_position, "Unclosed parenthesis");
-        }
-        if (closing_parenthesis_index == start + 1) {
-            throw parse_exception(tokens[start].start_position, "Empty parentheses");
-        }
-        expression *content = parse_range(start + 1, closing_parenthesis_index - 1, priority::lowest);
-        return new parentheses(content);
+    handle make_negative(handle content) {
+        return tree.negate(content);
     }
 
-    int find_closing_parenthesis(int start, int end) {
-        int depth = 0;
-        for (int i = start; i <= end; i++) {
-            if (tokens[i].type == token_type::closing_parenthesis) {
-                if (depth == 0) {
-                    return i;
-                } else if (depth > 0) {
-                    depth--;
-                } else {
-                    throw broken_parser_exception("Missed closing parenthesis");
-                }
-            } else if (tokens[i].type == token_type::opening_parenthesis) {
-                depth++;
-            }
-        }
-        return -1;
+    handle make_group(handle content) {
+        return content;
     }
 
-    expression *create_two_operand_expression(expression *left, _operator _operator, expression *right) {
+    handle make_binary(handle left, _operator _operator, handle right) {
         switch (_operator) {
             case _operator::multiply:
-                return new multiply(left, right);
+                return tree.combine(opcode::multiply, left, right);
             case _operator::divide:
-                return new divide(left, right);
+                return tree.combine(opcode::divide, left, right);
             case _operator::plus:
-                return new add(left, right);
+                return tree.combine(opcode::add, left, right);
             case _operator::minus:
-                return new subtract(left, right);
+                return tree.combine(opcode::subtract, left, right);
 #pragma clang diagnostic push
 #pragma ide diagnostic ignored "UnreachableCode"
             default:
@@ -307,88 +644,1768 @@ private:
 #pragma clang diagnostic pop
         }
     }
+};
 
-    double parse_number(const std::string &number, int number_start) {
-        char *end;
-        try {
-            double value = std::strtod(number.c_str(), &end);
-            if (end - number.c_str() != number.size() || !std::isnormal(value)) {
-                throw parse_exception(number_start, "Number too long");
-            }
+// other backends ignore the number of places
+static bool valid_decimal_places(const compile_options &options) {
+    return options.backend != evaluation_backend::decimal
+           || (options.decimal_places >= 0 && options.decimal_places <= decimal_program::max_places);
+}
+
+class parser {
+    // an operator or an opening parenthesis still waiting for its operands
+    struct pending {
+        enum {
+            binary,
+            negation,
+            group
+        } kind;
+        _operator binary_operator;
+        priority operator_priority;
+        // for a group: index of its closing parenthesis and the end of the range around it
+        int closing;
+        int enclosing_end;
+    };
+
+    const std::string_view formula;
+    const compile_options &options;
+    // variable names in slot order
+    const std::vector <std::string> &variables;
+    arena &nodes;
+    std::vector <token> tokens;
+    // Payloads of the tokens that have one, in token order. The parser consumes tokens strictly
+    // left to right, so each table is read through its own cursor.
+    std::vector <double> literals;
+    std::vector <int> slots;
+    // index of the matching closing parenthesis for every opening one
+    std::vector <int> closing_parentheses;
+    std::size_t next_literal = 0;
+    std::size_t next_slot = 0;
+    std::size_t next_parenthesis = 0;
+    // index of the first token not consumed yet
+    int position = 0;
+    CALCULATOR_STATS_ONLY(int deepest = 0;)
+    // the first error, which stops tokenizing or parsing
+    parse_error error = parse_error::none;
+    std::size_t error_position = 0;
+    // While tokenizing, the number of the innermost unmatched opening parenthesis. Until it is matched, an
+    // opening parenthesis keeps the number of the previous unmatched one as its closing index, so the stack of
+    // open parentheses is threaded through the table. A chunk of a larger formula leaves its unmatched
+    // parentheses to the merge: the closing ones by token index, the opening ones on that stack.
+    int open_parenthesis = -1;
+    std::vector <int> unmatched_closings;
+
+    // formulas this long are tokenized and parsed in parallel, see compile_options::parse_pool
+    static const std::size_t min_parallel_length = 256 * 1024;
+    static const std::size_t min_chunk_length = 64 * 1024;
 
-            return value;
-        } catch (const std::logic_error &e) {
-            throw parse_exception(number_start, std::string("Invalid number: ") + e.what());
+public:
+    parser(std::string_view _formula, const compile_options &_options, arena &_nodes)
+            : formula(_formula), options(_options), variables(_options.variables), nodes(_nodes) {}
+
+    // The formula must be tokenized first. Null for an invalid formula, see failed().
+    expression *parse() {
+        if (tokens.empty()) {
+            fail(parse_error::empty_input, 0);
+            return nullptr;
         }
+        return parallel() ? parse_in_parallel(*options.parse_pool) : parse_sequentially();
     }
 
-    std::vector <token> tokenize() {
-        std::vector <token> tokens;
-        std::string number_token = "";
-        int number_start = 0;
-        for (int i = 0; i < formula.size(); i++) {
-            char symbol = formula[i];
-
-            if (symbol >= '0' && symbol <= '9' || symbol == '.') {
-                if (number_token.empty()) {
-                    number_start = i;
-                }
+    // Same, into `tree`, always on the calling thread. The formula must be tokenized first. False for an
+    // invalid formula, see failed().
+    bool parse_flat(flat_tree &tree) {
+        if (tokens.empty()) {
+            return fail(parse_error::empty_input, 0);
+        }
+        // every token yields at most one node
+        tree.nodes.reserve(tokens.size());
+        flat_builder builder(tree);
+        position = 0;
+        return parse_range(builder, tokens.size() - 1) != flat_builder::none;
+    }
 
-                number_token += symbol;
+    // false for an invalid formula, see failed()
+    bool tokenize() {
+        if (!valid_decimal_places(options)) {
+            return fail(parse_error::invalid_decimal_places, 0);
+        }
+        if (options.max_length != 0 && formula.size() > options.max_length) {
+            return fail(parse_error::formula_too_long, options.max_length);
+        }
+        return parallel() ? tokenize_in_parallel(*options.parse_pool) : scan_tokens(0, formula.size(), false);
+    }
 
-                if (i == formula.size() - 1) {
-                    double value = parse_number(number_token, number_start);
-                    tokens.push_back(token(token_type::number, number_start, value));
-                }
+    std::size_t token_count() const {
+        return tokens.size();
+    }
 
-                continue;
-            } else if (!number_token.empty()) {
-                double value = parse_number(number_token, number_start);
-                tokens.push_back(token(token_type::number, number_start, value));
-                number_token = "";
-            }
+    // the first error, after tokenize() or parse() failed
+    template<typename value_type>
+    parse_result<value_type> failed() const {
+        return parse_result<value_type>(error, error_position);
+    }
 
-            switch (symbol) {
-                case ' ':
-                    // everything is already done above
-                    break;
+    CALCULATOR_STATS_ONLY(int max_depth() const {
+        return deepest;
+    })
 
-                case '(':
-                    tokens.push_back(token(token_type::opening_parenthesis, i));
-                    break;
+private:
+    // records the first error; false, for returning it right away
+    bool fail(parse_error _error, std::size_t _position) {
+        error = _error;
+        error_position = _position;
+        return false;
+    }
 
-                case ')':
-                    tokens.push_back(token(token_type::closing_parenthesis, i));
-                    break;
+    // Formulas that may have more tokens than allowed are tokenized sequentially, which stops at the first
+    // token too many; the chunks would each count their own.
+    bool parallel() const {
+        return options.parse_pool && options.parse_pool->size() > 1 && formula.size() >= min_parallel_length
+               && formula.size() <= token_limit();
+    }
 
-                case '+':
-                    tokens.push_back(token(token_type::plus, i));
-                    break;
+    // token indices are ints, and flat_tree node indices 32 bits
+    std::size_t token_limit() const {
+        const std::size_t most = std::numeric_limits<int>::max();
+        return options.max_tokens != 0 && options.max_tokens < most ? options.max_tokens : most;
+    }
 
-                case '-':
-                    tokens.push_back(token(token_type::minus, i));
-                    break;
+    expression *parse_sequentially() {
+        // every token yields at most one node, and binary operators are the largest ones
+        nodes.reserve(tokens.size() * sizeof(two_operand_expression));
+        position = 0;
+        tree_builder builder(nodes);
+        return parse_range(builder, tokens.size() - 1);
+    }
 
-                case '*':
-                    tokens.push_back(token(token_type::multiply, i));
-                    break;
+    // The formula is cut at the plus and minus operators outside parentheses, which are applied last and left
+    // to right. The terms between them are parsed at once, in slices of about the same number of tokens that
+    // each get a copy of their part of the tables and an arena of their own, then chained in order, so that
+    // the tree is the one parse_sequentially() builds. Finding the cuts needs the parenthesis depth at the
+    // start of every chunk of tokens: a prefix sum of the depth changes within the chunks.
+    expression *parse_in_parallel(thread_pool &pool) {
+        const std::size_t chunk_count = 4 * pool.size();
+        auto chunk_begin = [this, chunk_count](std::size_t chunk) {
+            return tokens.size() * chunk / chunk_count;
+        };
+        std::vector <int> depths(chunk_count + 1, 0);
+        pool.parallel_for(chunk_count, [&](std::size_t chunk) {
+            int change = 0;
+            for (std::size_t i = chunk_begin(chunk); i < chunk_begin(chunk + 1); i++) {
+                change += depth_change(tokens[i].type());
+            }
+            depths[chunk + 1] = change;
+        });
+        for (std::size_t chunk = 0; chunk < chunk_count; chunk++) {
+            depths[chunk + 1] += depths[chunk];
+        }
 
-                case '/':
-                    tokens.push_back(token(token_type::divide, i));
-                    break;
+        std::vector <std::vector<std::size_t>> chunk_cuts(chunk_count);
+        pool.parallel_for(chunk_count, [&](std::size_t chunk) {
+            int depth = depths[chunk];
+            for (std::size_t i = chunk_begin(chunk); i < chunk_begin(chunk + 1); i++) {
+                token_type type = tokens[i].type();
+                depth += depth_change(type);
+                // a minus right after an operator is a negation
+                if (depth == 0 && (type == token_type::plus || type == token_type::minus) && i > 0
+                    && ends_operand(tokens[i - 1].type())) {
+                    chunk_cuts[chunk].push_back(i);
+                }
+            }
+        });
+        std::vector <std::size_t> cuts;
+        for (const std::vector <std::size_t> &chunk : chunk_cuts) {
+            cuts.insert(cuts.end(), chunk.begin(), chunk.end());
+        }
+        if (cuts.empty()) {
+            return parse_sequentially();
+        }
 
-                default:
-                    throw parse_exception(i, "Unexpected symbol");
+        // term t lies between cuts t - 1 and t, slice s holds terms [slice_terms[s], slice_terms[s + 1])
+        auto term_begin = [&cuts](std::size_t term) {
+            return term == 0 ? 0 : cuts[term - 1] + 1;
+        };
+        auto term_end = [this, &cuts](std::size_t term) {
+            return term == cuts.size() ? tokens.size() : cuts[term];
+        };
+        std::vector <std::size_t> slice_terms = {0};
+        for (std::size_t chunk = 1; chunk < chunk_count; chunk++) {
+            std::size_t term = std::lower_bound(cuts.begin(), cuts.end(), chunk_begin(chunk)) - cuts.begin() + 1;
+            if (term <= cuts.size() && term > slice_terms.back()) {
+                slice_terms.push_back(term);
             }
         }
-        return tokens;
-    }
-};
+        slice_terms.push_back(cuts.size() + 1);
+        const std::size_t slice_count = slice_terms.size() - 1;
+
+        // where the payloads of each slice start in the tables
+        std::vector <std::size_t> literal_starts(slice_count + 1, 0);
+        std::vector <std::size_t> slot_starts(slice_count + 1, 0);
+        std::vector <std::size_t> parenthesis_starts(slice_count + 1, 0);
+        auto slice_begin = [&](std::size_t slice) {
+            return term_begin(slice_terms[slice]);
+        };
+        auto slice_end = [&](std::size_t slice) {
+            return term_end(slice_terms[slice + 1] - 1);
+        };
+        pool.parallel_for(slice_count, [&](std::size_t slice) {
+            for (std::size_t i = slice_begin(slice); i < slice_end(slice); i++) {
+                switch (tokens[i].type()) {
+                    case token_type::number:
+                        literal_starts[slice + 1]++;
+                        break;
+                    case token_type::variable:
+                        slot_starts[slice + 1]++;
+                        break;
+                    case token_type::opening_parenthesis:
+                        parenthesis_starts[slice + 1]++;
+                        break;
+                    default:
+                        break;
+                }
+            }
+        });
+        for (std::size_t slice = 0; slice < slice_count; slice++) {
+            literal_starts[slice + 1] += literal_starts[slice];
+            slot_starts[slice + 1] += slot_starts[slice];
+            parenthesis_starts[slice + 1] += parenthesis_starts[slice];
+        }
+
+        std::unique_ptr<arena[]> arenas(new arena[slice_count]);
+        std::vector <parser> slices;
+        slices.reserve(slice_count);
+        for (std::size_t slice = 0; slice < slice_count; slice++) {
+            slices.emplace_back(formula, options, arenas[slice]);
+        }
+        std::vector <std::vector<expression *>> terms(slice_count);
+        pool.parallel_for(slice_count, [&](std::size_t slice) {
+            parser &part = slices[slice];
+            const std::size_t begin = slice_begin(slice);
+            const std::size_t end = slice_end(slice);
+            part.tokens.assign(tokens.begin() + begin, tokens.begin() + end);
+            part.literals.assign(literals.begin() + literal_starts[slice], literals.begin() + literal_starts[slice + 1]);
+            part.slots.assign(slots.begin() + slot_starts[slice], slots.begin() + slot_starts[slice + 1]);
+            part.closing_parentheses.reserve(parenthesis_starts[slice + 1] - parenthesis_starts[slice]);
+            for (std::size_t i = parenthesis_starts[slice]; i < parenthesis_starts[slice + 1]; i++) {
+                part.closing_parentheses.push_back(closing_parentheses[i] - begin);
+            }
+            part.nodes.reserve(part.tokens.size() * sizeof(two_operand_expression));
+            tree_builder builder(part.nodes);
+            for (std::size_t term = slice_terms[slice]; term < slice_terms[slice + 1]; term++) {
+                part.position = term_begin(term) - begin;
+                expression *root = part.parse_range(builder, static_cast<int>(term_end(term) - begin) - 1);
+                if (!root) {
+                    return;
+                }
+                terms[slice].push_back(root);
+            }
+        });
+
+        for (parser &part : slices) {
+            if (part.error != parse_error::none) {
+                fail(part.error, part.error_position);
+                return nullptr;
+            }
+        }
+        nodes.reserve(cuts.size() * sizeof(two_operand_expression));
+        tree_builder builder(nodes);
+        expression *root = terms[0][0];
+        std::size_t term = 1;
+        for (std::size_t slice = 0; slice < slice_count; slice++) {
+            nodes.adopt(arenas[slice]);
+            CALCULATOR_STATS_ONLY(deepest = std::max(deepest, slices[slice].deepest);)
+            for (std::size_t i = slice == 0 ? 1 : 0; i < terms[slice].size(); i++, term++) {
+                // cuts are made at plus and minus tokens only
+                _operator cut_operator = _operator::plus;
+                if (!parse_operator(tokens[cuts[term - 1]], cut_operator)) {
+                    throw broken_parser_exception("Cut at a non-operator");
+                }
+                root = builder.make_binary(root, cut_operator, terms[slice][i]);
+            }
+        }
+        return root;
+    }
+
+    // Operator precedence parsing over explicit stacks: however deep the nesting, only heap memory grows.
+    // Every token is looked at a constant number of times. Parses from `position` up to token `last`.
+    template<typename builder_type>
+    typename builder_type::handle parse_range(builder_type &builder, int last) {
+        std::vector <typename builder_type::handle> operands;
+        std::vector <pending> operators;
+        // last token of the innermost open group
+        int end = last;
+        int depth = 0;
+
+        for (;;) {
+            typename builder_type::handle operand = parse_operand(builder, end, operators, depth);
+            if (operand == builder_type::none) {
+                return builder_type::none;
+            }
+            operands.push_back(operand);
+
+            // the operand may complete negations and groups, which are operands themselves
+            for (;;) {
+                while (!operators.empty() && operators.back().kind == pending::negation) {
+                    operands.back() = builder.make_negative(operands.back());
+                    operators.pop_back();
+                    depth--;
+                }
+                if (position <= end) {
+                    break;
+                }
+
+                reduce(builder, operators, operands, priority::lowest);
+                if (operators.empty()) {
+                    return operands.back();
+                }
+                const pending group = operators.back();
+                operators.pop_back();
+                depth--;
+                operands.back() = builder.make_group(operands.back());
+                position = group.closing + 1;
+                end = group.enclosing_end;
+            }
+
+            _operator next_operator;
+            if (!parse_operator(tokens[position], next_operator)) {
+                return builder_type::none;
+            }
+            priority operator_priority = get_priority(next_operator);
+            reduce(builder, operators, operands, operator_priority);
+            operators.push_back({pending::binary, next_operator, operator_priority, -1, -1});
+            position++;
+        }
+    }
+
+    // Consumes unary minuses and opening parentheses, leaving them pending, up to a number or a variable.
+    // `none` on an error.
+    template<typename builder_type>
+    typename builder_type::handle parse_operand(builder_type &builder, int &end, std::vector <pending> &operators,
+                                                int &depth) {
+        for (;;) {
+            if (position >= tokens.size()) {
+                fail(parse_error::unexpected_end, formula.size());
+                return builder_type::none;
+            }
+
+            const token &first_token = tokens[position];
+            switch (first_token.type()) {
+                case token_type::opening_parenthesis: {
+                    int closing_parenthesis_index = closing_parentheses[next_parenthesis++];
+                    if (closing_parenthesis_index == position + 1) {
+                        fail(parse_error::empty_parentheses, first_token.start_position());
+                        return builder_type::none;
+                    }
+                    if (!enter(first_token, depth)) {
+                        return builder_type::none;
+                    }
+                    operators.push_back({pending::group, _operator::plus, priority::lowest,
+                                         closing_parenthesis_index, end});
+                    end = closing_parenthesis_index - 1;
+                    position++;
+                    break;
+                }
+
+                case token_type::minus:
+                    if (position == end) {
+                        fail(parse_error::orphan_minus, first_token.start_position());
+                        return builder_type::none;
+                    }
+                    if (!enter(first_token, depth)) {
+                        return builder_type::none;
+                    }
+                    operators.push_back({pending::negation, _operator::minus, priority::lowest, -1, -1});
+                    position++;
+                    break;
+
+                case token_type::number:
+                    position++;
+                    return builder.make_number(literals[next_literal++]);
+
+                case token_type::variable:
+                    position++;
+                    return builder.make_variable(slots[next_slot++]);
+
+                default:
+                    fail(parse_error::unexpected_token, first_token.start_position());
+                    return builder_type::none;
+            }
+        }
+    }
+
+    bool enter(const token &token, int &depth) {
+        depth++;
+        CALCULATOR_STATS_ONLY(deepest = std::max(deepest, depth);)
+        if (options.max_depth != 0 && depth > options.max_depth) {
+            return fail(parse_error::too_deeply_nested, token.start_position());
+        }
+        return true;
+    }
+
+    // builds the pending binary operators that bind at least as tight as `operator_priority`
+    template<typename builder_type>
+    void reduce(builder_type &builder, std::vector <pending> &operators,
+                std::vector <typename builder_type::handle> &operands, priority operator_priority) {
+        while (!operators.empty() && operators.back().kind == pending::binary
+               && operators.back().operator_priority >= operator_priority) {
+            typename builder_type::handle right = operands.back();
+            operands.pop_back();
+            operands.back() = builder.make_binary(operands.back(), operators.back().binary_operator, right);
+            operators.pop_back();
+        }
+    }
+
+    priority get_priority(_operator _operator) {
+        switch (_operator) {
+            case _operator::minus:
+            case _operator::plus:
+                return priority::first;
+            case _operator::multiply:
+            case _operator::divide:
+                return priority::second;
+#pragma clang diagnostic push
+#pragma ide diagnostic ignored "UnreachableCode"
+            default:
+                throw broken_parser_exception("Unknown operator");
+#pragma clang diagnostic pop
+        }
+    }
+
+    bool parse_operator(const token &token, _operator &result) {
+        switch (token.type()) {
+            case token_type::plus:
+                result = _operator::plus;
+                return true;
+            case token_type::minus:
+                result = _operator::minus;
+                return true;
+            case token_type::multiply:
+                result = _operator::multiply;
+                return true;
+            case token_type::divide:
+                result = _operator::divide;
+                return true;
+            default:
+                return fail(parse_error::operator_needed, token.start_position());
+        }
+    }
+
+    bool parse_number(std::size_t start, std::size_t end, double &value) {
+        std::from_chars_result result = std::from_chars(formula.data() + start, formula.data() + end, value);
+        if (result.ec == std::errc::invalid_argument || result.ptr != formula.data() + end) {
+            return fail(parse_error::invalid_number, start);
+        }
+        if (result.ec == std::errc::result_out_of_range || !std::isnormal(value)) {
+            return fail(parse_error::number_too_long, start);
+        }
+        // checked here rather than thrown from decimal_program, so that the error has a position
+        if (options.backend == evaluation_backend::decimal
+            && !decimal_program::representable(value, options.decimal_places)) {
+            return fail(parse_error::number_too_long, start);
+        }
+        return true;
+    }
+
+    // formulas use a handful of variables, so a linear scan beats hashing the name
+    int find_variable(std::size_t start, std::size_t length) {
+        for (int slot = 0; slot < variables.size(); slot++) {
+            if (formula.substr(start, length) == variables[slot]) {
+                return slot;
+            }
+        }
+        return -1;
+    }
+
+    const token &opening_parenthesis(int number) {
+        for (const token &token : tokens) {
+            if (token.type() == token_type::opening_parenthesis && number-- == 0) {
+                return token;
+            }
+        }
+        throw broken_parser_exception("Missed opening parenthesis");
+    }
+
+    static bool is_number_symbol(char symbol) {
+        return symbol >= '0' && symbol <= '9' || symbol == '.';
+    }
+
+    static bool is_identifier_start(char symbol) {
+        return symbol >= 'a' && symbol <= 'z' || symbol >= 'A' && symbol <= 'Z' || symbol == '_';
+    }
+
+    static bool is_identifier_symbol(char symbol) {
+        return is_identifier_start(symbol) || symbol >= '0' && symbol <= '9';
+    }
+
+    static bool is_space(char symbol) {
+        return symbol == ' ';
+    }
+
+    // symbols of numbers and names, which must not be cut apart
+    static bool is_word_symbol(char symbol) {
+        return is_number_symbol(symbol) || is_identifier_symbol(symbol);
+    }
+
+    static int depth_change(token_type type) {
+        switch (type) {
+            case token_type::opening_parenthesis:
+                return 1;
+            case token_type::closing_parenthesis:
+                return -1;
+            default:
+                return 0;
+        }
+    }
+
+    static bool ends_operand(token_type type) {
+        return type == token_type::number || type == token_type::variable || type == token_type::closing_parenthesis;
+    }
+
+    // Skips symbols of a class from `from` on. Most tokens are a character or two, which a register would only
+    // slow down, so the first symbol is classified alone.
+    template<unsigned (symbol_lanes::*symbol_class)() const, bool (*in_class)(char)>
+    std::size_t skip(std::size_t from, std::size_t to) const {
+        if (from == to || !in_class(formula[from])) {
+            return from;
+        }
+        return skip_symbols<symbol_class>(formula.data(), from + 1, to);
+    }
+
+    // Chunks of the formula are scanned at once, their boundaries moved so that no number or name straddles
+    // two of them. Each chunk starts without open parentheses; in order, the closing ones it leaves unmatched
+    // are matched with the openings left open by the chunks before it, which also finds the first error.
+    // The tables of the chunks are then copied into place in parallel.
+    bool tokenize_in_parallel(thread_pool &pool) {
+        const std::size_t chunk_count = std::min<std::size_t>(4 * pool.size(), formula.size() / min_chunk_length);
+        std::vector <std::size_t> bounds = {0};
+        for (std::size_t chunk = 1; chunk < chunk_count; chunk++) {
+            std::size_t bound = std::max(bounds.back(), formula.size() / chunk_count * chunk);
+            while (bound > 0 && bound < formula.size() && is_word_symbol(formula[bound - 1])
+                   && is_word_symbol(formula[bound])) {
+                bound++;
+            }
+            bounds.push_back(bound);
+        }
+        bounds.push_back(formula.size());
+
+        std::vector <parser> chunks;
+        chunks.reserve(chunk_count);
+        for (std::size_t chunk = 0; chunk < chunk_count; chunk++) {
+            chunks.emplace_back(formula, options, nodes);
+        }
+        pool.parallel_for(chunk_count, [&](std::size_t chunk) {
+            chunks[chunk].scan_tokens(bounds[chunk], bounds[chunk + 1], true);
+        });
+
+        // where the tables of each chunk start in the merged ones
+        std::vector <std::size_t> token_starts(chunk_count + 1, 0);
+        std::vector <std::size_t> literal_starts(chunk_count + 1, 0);
+        std::vector <std::size_t> slot_starts(chunk_count + 1, 0);
+        std::vector <std::size_t> parenthesis_starts(chunk_count + 1, 0);
+        // opening parentheses still open, innermost last, as chunk and number within the chunk
+        std::vector <std::pair<std::size_t, int>> open;
+        // opening parenthesis number and closing token index of the pairs split between chunks
+        std::vector <std::pair<std::size_t, std::size_t>> matches;
+        for (std::size_t chunk = 0; chunk < chunk_count; chunk++) {
+            const parser &part = chunks[chunk];
+            for (int closing : part.unmatched_closings) {
+                if (open.empty()) {
+                    return fail(parse_error::unmatched_closing_parenthesis, part.tokens[closing].start_position());
+                }
+                matches.push_back({parenthesis_starts[open.back().first] + open.back().second,
+                                   token_starts[chunk] + closing});
+                open.pop_back();
+            }
+            if (part.error != parse_error::none) {
+                return fail(part.error, part.error_position);
+            }
+            std::size_t outermost = open.size();
+            for (int opening = part.open_parenthesis; opening != -1; opening = part.closing_parentheses[opening]) {
+                open.push_back({chunk, opening});
+            }
+            std::reverse(open.begin() + outermost, open.end());
+
+            token_starts[chunk + 1] = token_starts[chunk] + part.tokens.size();
+            literal_starts[chunk + 1] = literal_starts[chunk] + part.literals.size();
+            slot_starts[chunk + 1] = slot_starts[chunk] + part.slots.size();
+            parenthesis_starts[chunk + 1] = parenthesis_starts[chunk] + part.closing_parentheses.size();
+        }
+        if (!open.empty()) {
+            return fail(parse_error::unclosed_parenthesis,
+                        chunks[open.front().first].opening_parenthesis(open.front().second).start_position());
+        }
+
+        tokens.resize(token_starts.back());
+        literals.resize(literal_starts.back());
+        slots.resize(slot_starts.back());
+        closing_parentheses.resize(parenthesis_starts.back());
+        pool.parallel_for(chunk_count, [&](std::size_t chunk) {
+            const parser &part = chunks[chunk];
+            std::copy(part.tokens.begin(), part.tokens.end(), tokens.begin() + token_starts[chunk]);
+            std::copy(part.literals.begin(), part.literals.end(), literals.begin() + literal_starts[chunk]);
+            std::copy(part.slots.begin(), part.slots.end(), slots.begin() + slot_starts[chunk]);
+            // the split pairs are set below
+            for (std::size_t i = 0; i < part.closing_parentheses.size(); i++) {
+                closing_parentheses[parenthesis_starts[chunk] + i] = part.closing_parentheses[i] + token_starts[chunk];
+            }
+        });
+        for (const std::pair<std::size_t, std::size_t> &match : matches) {
+            closing_parentheses[match.first] = match.second;
+        }
+        return true;
+    }
+
+    // Also matches parentheses on the fly, so unbalanced ones are reported before parsing starts.
+    // Numbers and names are scanned in place; the tables are reserved from the length,
+    // as every token takes at least one character and literals are separated by operators.
+    // Scans formula[from, to), which for a chunk leaves unmatched parentheses to the caller.
+    bool scan_tokens(std::size_t from, std::size_t to, bool chunk) {
+        tokens.reserve(to - from);
+        literals.reserve((to - from) / 2 + 1);
+        // The first invalid symbol is found ahead, a register at a time; it is the error unless one before it
+        // stops the scan. Numbers and names are skipped the same way.
+        const std::size_t valid_end = skip_symbols<&symbol_lanes::valid_symbols>(formula.data(), from, to);
+        const std::size_t max_tokens = token_limit();
+        for (std::size_t i = from; i < valid_end; i++) {
+            char symbol = formula[i];
+            // every symbol but a space starts a token
+            if (tokens.size() == max_tokens && symbol != ' ') {
+                return fail(parse_error::formula_too_long, i);
+            }
+
+            if (is_number_symbol(symbol)) {
+                std::size_t end = skip<&symbol_lanes::number_symbols, is_number_symbol>(i + 1, valid_end);
+                double value;
+                if (!parse_number(i, end, value)) {
+                    return false;
+                }
+                tokens.push_back(token(token_type::number, i));
+                literals.push_back(value);
+                i = end - 1;
+                continue;
+            }
+
+            if (is_identifier_start(symbol)) {
+                std::size_t end = skip<&symbol_lanes::identifier_symbols, is_identifier_symbol>(i + 1, valid_end);
+                int slot = find_variable(i, end - i);
+                if (slot == -1) {
+                    return fail(parse_error::unknown_variable, i);
+                }
+                tokens.push_back(token(token_type::variable, i));
+                slots.push_back(slot);
+                i = end - 1;
+                continue;
+            }
+
+            switch (symbol) {
+                case ' ':
+                    i = skip<&symbol_lanes::spaces, is_space>(i + 1, valid_end) - 1;
+                    break;
+
+                case '(':
+                    tokens.push_back(token(token_type::opening_parenthesis, i));
+                    closing_parentheses.push_back(open_parenthesis);
+                    open_parenthesis = closing_parentheses.size() - 1;
+                    break;
+
+                case ')': {
+                    if (open_parenthesis == -1) {
+                        if (!chunk) {
+                            return fail(parse_error::unmatched_closing_parenthesis, i);
+                        }
+                        unmatched_closings.push_back(tokens.size());
+                        tokens.push_back(token(token_type::closing_parenthesis, i));
+                        break;
+                    }
+                    int matched = open_parenthesis;
+                    open_parenthesis = closing_parentheses[matched];
+                    closing_parentheses[matched] = tokens.size();
+                    tokens.push_back(token(token_type::closing_parenthesis, i));
+                    break;
+                }
+
+                case '+':
+                    tokens.push_back(token(token_type::plus, i));
+                    break;
+
+                case '-':
+                    tokens.push_back(token(token_type::minus, i));
+                    break;
+
+                case '*':
+                    tokens.push_back(token(token_type::multiply, i));
+                    break;
+
+                case '/':
+                    tokens.push_back(token(token_type::divide, i));
+                    break;
+
+#pragma clang diagnostic push
+#pragma ide diagnostic ignored "UnreachableCode"
+                default:
+                    throw broken_parser_exception("Unclassified symbol");
+#pragma clang diagnostic pop
+            }
+        }
+
+        if (valid_end < to) {
+            return fail(parse_error::unexpected_symbol, valid_end);
+        }
+        if (open_parenthesis != -1 && !chunk) {
+            // report the outermost one
+            while (closing_parentheses[open_parenthesis] != -1) {
+                open_parenthesis = closing_parentheses[open_parenthesis];
+            }
+            return fail(parse_error::unclosed_parenthesis, opening_parenthesis(open_parenthesis).start_position());
+        }
+        return true;
+    }
+};
+
+// Hash-consing of simplified nodes: a node equal to one seen before, with the same operation, value or
+// slot and the very same operand nodes, is replaced by it. Interning bottom-up turns equal subtrees into
+// one shared node, within a formula and across all formulas simplified with the same table.
+class node_table {
+    struct node_key {
+        std::type_index type;
+        // bits of a number's value, slot of a variable
+        std::uint64_t payload;
+        const expression *operands[2];
+
+        bool operator==(const node_key &other) const {
+            return payload == other.payload && operands[0] == other.operands[0]
+                   && operands[1] == other.operands[1] && type == other.type;
+        }
+
+        // without the type, which is all but free to compare but not to hash
+        std::size_t hash() const {
+            std::uint64_t hash = payload;
+            for (const expression *operand : operands) {
+                hash = (hash ^ reinterpret_cast<std::uintptr_t>(operand)) * 0x9e3779b97f4a7c15;
+            }
+            // values and addresses differ mostly in their high bits, the table indexes by the low ones
+            hash ^= hash >> 32;
+            hash *= 0xd6e8feb86659fd93;
+            return hash ^ hash >> 32;
+        }
+    };
+
+    struct entry {
+        node_key key;
+        // null for an empty entry
+        const expression *node;
+    };
+
+    // open addressing with linear probing, at most half full
+    std::vector <entry> entries;
+    std::size_t used = 0;
+    bool found = false;
+
+public:
+    // `node`, or the equal node interned before it; its operands must be interned already
+    const expression *intern(const expression *node) {
+        node_key key = {typeid(*node), 0, {nullptr, nullptr}};
+        if (node->constant()) {
+            double value = node->calc(nullptr);
+            std::memcpy(&key.payload, &value, sizeof(value));
+        } else if (node->variable_slot() != -1) {
+            key.payload = node->variable_slot();
+        }
+        for (int i = 0; i < node->operand_count(); i++) {
+            key.operands[i] = node->operand(i);
+        }
+
+        if (2 * (used + 1) > entries.size()) {
+            rehash(std::max<std::size_t>(16, 2 * entries.size()));
+        }
+        entry &slot = find(key);
+        if (slot.node) {
+            // simplify() hands back operands, which are interned already
+            found = found || slot.node != node;
+            return slot.node;
+        }
+        slot = {key, node};
+        used++;
+        return node;
+    }
+
+    // whether some node was found in the table, so the interned nodes form a DAG rather than trees
+    bool shared() const {
+        return found;
+    }
+
+private:
+    // the entry holding `key`, or the empty one where it belongs
+    entry &find(const node_key &key) {
+        std::size_t mask = entries.size() - 1;
+        for (std::size_t index = key.hash() & mask;; index = (index + 1) & mask) {
+            if (!entries[index].node || entries[index].key == key) {
+                return entries[index];
+            }
+        }
+    }
+
+    void rehash(std::size_t capacity) {
+        std::vector <entry> old(capacity, {{typeid(void), 0, {nullptr, nullptr}}, nullptr});
+        old.swap(entries);
+        for (const entry &entry : old) {
+            if (entry.node) {
+                find(entry.key) = entry;
+            }
+        }
+    }
+};
+
+// Emits roots[0..count) one after the other, each leaving its value on the stack. With `shared` nodes, a node reached
+// more than once is computed the first time and saved to a temporary, which later uses push instead.
+static std::shared_ptr<const bytecode> lower(const expression *const *roots, std::size_t count, bool shared) {
+    std::shared_ptr<bytecode> program = std::make_shared<bytecode>();
+    if (!shared) {
+        for (std::size_t i = 0; i < count; i++) {
+            post_order(roots[i], [&program](const expression *node) {
+                node->emit(*program);
+            });
+        }
+        return program;
+    }
+
+    std::unordered_map<const expression *, int> uses;
+    for (std::size_t i = 0; i < count; i++) {
+        post_order(roots[i], [](const expression *node) {}, [&uses](const expression *node) {
+            return uses[node]++ == 0;
+        });
+    }
+    std::unordered_map<const expression *, std::uint32_t> temporaries;
+    for (std::size_t i = 0; i < count; i++) {
+        post_order(roots[i], [&program, &uses, &temporaries](const expression *node) {
+            node->emit(*program);
+            // numbers and variables are pushed as cheaply as temporaries
+            if (uses[node] > 1 && node->operand_count() != 0) {
+                temporaries.emplace(node, program->save());
+            }
+        }, [&program, &temporaries](const expression *node) {
+            auto saved = temporaries.find(node);
+            if (saved == temporaries.end()) {
+                return true;
+            }
+            program->recall(saved->second);
+            return false;
+        });
+    }
+    return program;
+}
+
+// Folds constant subtrees, drops parentheses and collapses double negations, bottom-up. Equal subtrees
+// are shared through `table` unless it is null.
+static const expression *simplify(const expression *root, arena &nodes, node_table *table) {
+    std::vector <const expression *> simplified;
+    post_order(root, [&simplified, &nodes, table](const expression *node) {
+        const expression *operands[2];
+        for (int i = node->operand_count() - 1; i >= 0; i--) {
+            operands[i] = simplified.back();
+            simplified.pop_back();
+        }
+        const expression *result = node->simplify(nodes, operands);
+        simplified.push_back(table ? table->intern(result) : result);
+    });
+    return simplified.back();
+}
+
+// Lets a formula run as machine code once it has proven hot. Exactly one evaluation sees the counter
+// reach the threshold and generates the code; the others keep interpreting until it is published.
+class jit_state {
+    const std::uint64_t threshold;
+    std::atomic<std::uint64_t> evaluations{0};
+    std::atomic<const native_code *> native{nullptr};
+    std::unique_ptr<native_code> owned;
+
+public:
+    explicit jit_state(std::uint64_t _threshold) : threshold(_threshold) {}
+
+    // null until the formula is promoted
+    const native_code *code() const {
+        return native.load(std::memory_order_acquire);
+    }
+
+    void count(const bytecode &program) {
+        // stops writing to the shared counter once it is past the threshold, even if generation failed
+        if (evaluations.load(std::memory_order_relaxed) < threshold
+            && evaluations.fetch_add(1, std::memory_order_relaxed) + 1 == threshold) {
+            owned = native_code::compile(program);
+            native.store(owned.get(), std::memory_order_release);
+        }
+    }
+};
+
+engine_stats &engine_stats::operator+=(const engine_stats &other) {
+    formulas += other.formulas;
+    failures += other.failures;
+    tokens += other.tokens;
+    parsed_nodes += other.parsed_nodes;
+    optimized_nodes += other.optimized_nodes;
+    instructions += other.instructions;
+    allocations += other.allocations;
+    allocated_bytes += other.allocated_bytes;
+    max_depth = std::max(max_depth, other.max_depth);
+    tokenize_ns += other.tokenize_ns;
+    parse_ns += other.parse_ns;
+    optimize_ns += other.optimize_ns;
+    lower_ns += other.lower_ns;
+    evaluations += other.evaluations;
+    evaluate_ns += other.evaluate_ns;
+    return *this;
+}
+
+#ifdef CALCULATOR_STATS
+
+// Totals over all threads. Compiling takes a lock once per call; evaluations are only counted by atomics.
+static std::mutex totals_mutex;
+static engine_stats totals;
+static std::atomic<std::uint64_t> total_evaluations{0};
+static std::atomic<std::uint64_t> total_evaluate_ns{0};
+
+static std::uint64_t nanoseconds_since(std::chrono::steady_clock::time_point start) {
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - start).count();
+}
+
+// shared nodes count once
+static std::uint64_t count_nodes(const expression *root) {
+    std::unordered_set<const expression *> seen;
+    post_order(root, [](const expression *node) {}, [&seen](const expression *node) {
+        return seen.insert(node).second;
+    });
+    return seen.size();
+}
+
+// Collects the stats of one compile() call, which counts as a failure unless it finishes.
+class compile_recorder {
+    engine_stats *const target;
+    std::chrono::steady_clock::time_point lap_start = std::chrono::steady_clock::now();
+
+public:
+    engine_stats stats;
+
+    explicit compile_recorder(engine_stats *_target) : target(_target) {
+        stats.failures = 1;
+    }
+
+    compile_recorder(const compile_recorder &) = delete;
+
+    compile_recorder &operator=(const compile_recorder &) = delete;
+
+    // adds the time since the previous lap to `phase_ns`
+    void lap(std::uint64_t &phase_ns) {
+        phase_ns += nanoseconds_since(lap_start);
+        lap_start = std::chrono::steady_clock::now();
+    }
+
+    // for the flat backend, which has no arena
+    void finish(const parser &parser, std::size_t parsed_nodes, const flat_tree &optimized) {
+        stats.formulas = 1;
+        stats.failures = 0;
+        stats.parsed_nodes = parsed_nodes;
+        stats.optimized_nodes = optimized.nodes.size();
+        stats.allocations = 1;
+        stats.allocated_bytes = optimized.nodes.capacity() * sizeof(flat_node);
+        stats.tokens = parser.token_count();
+        stats.max_depth = parser.max_depth();
+    }
+
+    void finish(const parser &parser, const arena &nodes, const expression *parsed, const expression *optimized,
+                const bytecode *code) {
+        stats.formulas = 1;
+        stats.failures = 0;
+        stats.parsed_nodes = count_nodes(parsed);
+        stats.optimized_nodes = count_nodes(optimized);
+        stats.instructions = code ? code->instructions.size() : 0;
+        stats.allocations = nodes.block_count();
+        stats.allocated_bytes = nodes.allocated_bytes();
+        stats.tokens = parser.token_count();
+        stats.max_depth = parser.max_depth();
+    }
+
+    ~compile_recorder() {
+        if (target) {
+            *target += stats;
+        }
+        std::lock_guard<std::mutex> lock(totals_mutex);
+        totals += stats;
+    }
+};
+
+// times evaluations of `count` formulas or rows
+class evaluation_recorder {
+    const std::uint64_t count;
+    const std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+
+public:
+    explicit evaluation_recorder(std::uint64_t _count) : count(_count) {}
+
+    ~evaluation_recorder() {
+        total_evaluate_ns.fetch_add(nanoseconds_since(start), std::memory_order_relaxed);
+        total_evaluations.fetch_add(count, std::memory_order_relaxed);
+    }
+};
+
+bool stats_enabled() {
+    return true;
+}
+
+engine_stats aggregated_stats() {
+    std::lock_guard<std::mutex> lock(totals_mutex);
+    engine_stats snapshot = totals;
+    snapshot.evaluations = total_evaluations.load();
+    snapshot.evaluate_ns = total_evaluate_ns.load();
+    return snapshot;
+}
+
+void reset_aggregated_stats() {
+    std::lock_guard<std::mutex> lock(totals_mutex);
+    totals = engine_stats();
+    total_evaluations = 0;
+    total_evaluate_ns = 0;
+}
+
+#else
+
+bool stats_enabled() {
+    return false;
+}
+
+engine_stats aggregated_stats() {
+    return engine_stats();
+}
+
+void reset_aggregated_stats() {}
+
+#endif
+
+double compiled_formula::evaluate(const double *values) const {
+    CALCULATOR_STATS_ONLY(evaluation_recorder recorder(1);)
+    if (jit) {
+        if (const native_code *native = jit->code()) {
+            return native->run(values);
+        }
+        jit->count(*code);
+    }
+    if (code) {
+        return code->run(values);
+    }
+    if (decimals) {
+        return decimals->run(values).to_double();
+    }
+    if (flat) {
+        return flat->run(values);
+    }
+    return deep ? calc_iteratively(root.get(), values) : root->calc(values);
+}
+
+static const interval whole_line = {-INFINITY, INFINITY};
+
+// Rounding to nearest never reverses an order, so the rounded results at the ends, or corners, of the operand
+// intervals bound every rounded result in between. One that is NaN (0 * inf, inf - inf) bounds nothing.
+static interval span(double lower, double upper) {
+    if (std::isnan(lower) || std::isnan(upper)) {
+        return whole_line;
+    }
+    return {lower, upper};
+}
+
+static interval corners(double first, double second, double third, double fourth) {
+    if (std::isnan(first) || std::isnan(second) || std::isnan(third) || std::isnan(fourth)) {
+        return whole_line;
+    }
+    return {std::min({first, second, third, fourth}), std::max({first, second, third, fourth})};
+}
+
+static interval bound_program(const bytecode &program, const interval *bounds) {
+    std::vector<interval> stack(program.max_stack + program.temporaries);
+    interval *const saved = stack.data() + program.max_stack;
+    interval *top = stack.data();
+    for (const instruction &instruction : program.instructions) {
+        switch (instruction.code) {
+            case opcode::push: {
+                double value = program.constants[instruction.operand];
+                *top++ = {value, value};
+                break;
+            }
+            case opcode::load:
+                *top++ = bounds[instruction.operand];
+                break;
+            case opcode::add:
+                top--;
+                top[-1] = span(top[-1].lower + top[0].lower, top[-1].upper + top[0].upper);
+                break;
+            case opcode::subtract:
+                top--;
+                top[-1] = span(top[-1].lower - top[0].upper, top[-1].upper - top[0].lower);
+                break;
+            case opcode::multiply:
+                top--;
+                top[-1] = corners(top[-1].lower * top[0].lower, top[-1].lower * top[0].upper,
+                                  top[-1].upper * top[0].lower, top[-1].upper * top[0].upper);
+                break;
+            case opcode::divide:
+                top--;
+                if (top[0].lower <= 0 && top[0].upper >= 0) {
+                    top[-1] = whole_line;
+                } else {
+                    top[-1] = corners(top[-1].lower / top[0].lower, top[-1].lower / top[0].upper,
+                                      top[-1].upper / top[0].lower, top[-1].upper / top[0].upper);
+                }
+                break;
+            case opcode::negate:
+                top[-1] = {-1 * top[-1].upper, -1 * top[-1].lower};
+                break;
+            case opcode::save:
+                saved[instruction.operand] = top[-1];
+                break;
+            case opcode::recall:
+                *top++ = saved[instruction.operand];
+                break;
+        }
+    }
+    return stack[0];
+}
+
+interval compiled_formula::evaluate_interval(const interval *bounds) const {
+    if (decimals) {
+        throw std::invalid_argument("Intervals are not computed on the decimal backend");
+    }
+    for (std::size_t slot = 0; slot < names->size(); slot++) {
+        if (!(bounds[slot].lower <= bounds[slot].upper)) {
+            throw std::invalid_argument("Interval of " + (*names)[slot] + " is empty or NaN");
+        }
+    }
+    if (code) {
+        return bound_program(*code, bounds);
+    }
+    if (flat) {
+        bytecode program;
+        flat->emit(program);
+        return bound_program(program, bounds);
+    }
+    const expression *tree = root.get();
+    return bound_program(*lower(&tree, 1, true), bounds);
+}
+
+decimal compiled_formula::evaluate_decimal(const double *values) const {
+    if (!decimals) {
+        throw std::invalid_argument("Formula was not compiled for the decimal backend");
+    }
+    CALCULATOR_STATS_ONLY(evaluation_recorder recorder(1);)
+    return decimals->run(values);
+}
+
+void compiled_formula::evaluate_rows(const double *const *columns, double *results,
+                                     std::size_t begin, std::size_t end) const {
+    CALCULATOR_STATS_ONLY(evaluation_recorder recorder(end - begin);)
+    if (code) {
+        code->run(columns, results, begin, end);
+        return;
+    }
+
+    std::vector <double> values(names->size());
+    // node values of the flat tree, for all rows
+    std::vector <double> flat_values(flat ? flat->nodes.size() : 0);
+    for (std::size_t row = begin; row < end; row++) {
+        for (std::size_t slot = 0; slot < values.size(); slot++) {
+            values[slot] = columns[slot][row];
+        }
+        if (decimals) {
+            results[row] = decimals->run(values.data()).to_double();
+        } else if (flat) {
+            results[row] = flat->run(values.data(), flat_values.data());
+        } else {
+            results[row] = deep ? calc_iteratively(root.get(), values.data()) : root->calc(values.data());
+        }
+    }
+}
+
+void compiled_formula::evaluate_batch(const double *const *columns, double *results, std::size_t rows) const {
+    evaluate_rows(columns, results, 0, rows);
+}
+
+// big enough to amortise scheduling, small enough for stealing to even out the workers
+static const std::size_t rows_per_chunk = 16 * 1024;
+static const std::size_t formulas_per_chunk = 64;
+
+void compiled_formula::evaluate_batch(const double *const *columns, double *results, std::size_t rows,
+                                      thread_pool &pool) const {
+    std::size_t chunks = (rows + rows_per_chunk - 1) / rows_per_chunk;
+    pool.parallel_for(chunks, [this, columns, results, rows](std::size_t chunk) {
+        std::size_t begin = chunk * rows_per_chunk;
+        evaluate_rows(columns, results, begin, std::min(begin + rows_per_chunk, rows));
+    });
+}
+
+void evaluate_all(const std::vector<compiled_formula> &formulas, const double *values, double *results,
+                  thread_pool &pool) {
+    std::size_t chunks = (formulas.size() + formulas_per_chunk - 1) / formulas_per_chunk;
+    pool.parallel_for(chunks, [&formulas, values, results](std::size_t chunk) {
+        std::size_t end = std::min((chunk + 1) * formulas_per_chunk, formulas.size());
+        for (std::size_t i = chunk * formulas_per_chunk; i < end; i++) {
+            results[i] = formulas[i].evaluate(values);
+        }
+    });
+}
+
+incremental_formula::incremental_formula(const compiled_formula &_formula, const double *values)
+        : formula(_formula), variables(values, values + _formula.names->size()), readers(_formula.names->size()) {
+    if (formula.decimals) {
+        throw std::invalid_argument("Decimal formulas cannot be updated incrementally");
+    }
+    if (formula.flat) {
+        throw std::invalid_argument("Flat formulas cannot be updated incrementally");
+    }
+    // subtrees shared between several parents get one entry
+    std::unordered_map<const expression *, int> indices;
+    post_order(formula.root.get(), [this, &indices](const expression *node) {
+        if (indices.count(node) != 0) {
+            return;
+        }
+        node_state state = {node, {-1, -1}, 0, 0};
+        for (int i = 0; i < node->operand_count(); i++) {
+            state.operands[i] = indices.at(node->operand(i));
+        }
+        indices.emplace(node, nodes.size());
+        if (node->variable_slot() != -1) {
+            readers[node->variable_slot()].push_back(nodes.size());
+        }
+        nodes.push_back(state);
+    });
+
+    // parents of every node as consecutive ranges of one array
+    for (const node_state &state : nodes) {
+        for (int operand : state.operands) {
+            if (operand != -1) {
+                nodes[operand].parent_count++;
+            }
+        }
+    }
+    int next_parent = 0;
+    for (node_state &state : nodes) {
+        state.first_parent = next_parent;
+        next_parent += state.parent_count;
+        state.parent_count = 0;
+    }
+    parents.resize(next_parent);
+    for (int index = 0; index < nodes.size(); index++) {
+        for (int operand : nodes[index].operands) {
+            if (operand != -1) {
+                node_state &child = nodes[operand];
+                parents[child.first_parent + child.parent_count++] = index;
+            }
+        }
+    }
+
+    node_values.resize(nodes.size());
+    dirty.resize(nodes.size(), 0);
+    for (int index = 0; index < nodes.size(); index++) {
+        compute(index);
+    }
+}
+
+void incremental_formula::compute(int index) {
+    const node_state &state = nodes[index];
+    double operands[2];
+    for (int i = 0; i < 2 && state.operands[i] != -1; i++) {
+        operands[i] = node_values[state.operands[i]];
+    }
+    node_values[index] = state.node->combine(operands, variables.data());
+}
+
+// marks every node on a path from the variable to the root, each once
+void incremental_formula::mark(int slot) {
+    stack.assign(readers[slot].begin(), readers[slot].end());
+    while (!stack.empty()) {
+        int index = stack.back();
+        stack.pop_back();
+        // straight up through the first parent, the others wait on the stack
+        while (!dirty[index]) {
+            dirty[index] = 1;
+            marked.push_back(index);
+            const node_state &state = nodes[index];
+            if (state.parent_count == 0) {
+                break;
+            }
+            stack.insert(stack.end(), parents.begin() + state.first_parent + 1,
+                         parents.begin() + state.first_parent + state.parent_count);
+            index = parents[state.first_parent];
+        }
+    }
+}
+
+double incremental_formula::recompute_marked() {
+    // post order puts operands first; a single path up is in order already
+    if (!std::is_sorted(marked.begin(), marked.end())) {
+        std::sort(marked.begin(), marked.end());
+    }
+    for (int index : marked) {
+        compute(index);
+        dirty[index] = 0;
+    }
+    marked.clear();
+    return value();
+}
+
+double incremental_formula::update(const int *changed_slots, std::size_t count, const double *values) {
+    for (std::size_t i = 0; i < count; i++) {
+        variables[changed_slots[i]] = values[changed_slots[i]];
+        mark(changed_slots[i]);
+    }
+    return recompute_marked();
+}
+
+double incremental_formula::update(int slot, double value) {
+    variables[slot] = value;
+    mark(slot);
+    return recompute_marked();
+}
+
+void formula_batch::evaluate(const double *values, double *results) const {
+    if (code) {
+        CALCULATOR_STATS_ONLY(evaluation_recorder recorder(members.size());)
+        code->run(values, results);
+        return;
+    }
+    for (std::size_t i = 0; i < members.size(); i++) {
+        results[i] = members[i].evaluate(values);
+    }
+}
+
+double compiled_formula::evaluate() const {
+    if (!names->empty()) {
+        throw std::invalid_argument("Formula has variables, their values are needed");
+    }
+    return evaluate(nullptr);
+}
+
+// Formulas compiled into the same arena and table share their equal subexpressions.
+static parse_result<compiled_formula> compile_shared(std::string_view formula, const compile_options &options,
+                                                     const std::shared_ptr<arena> &nodes, node_table &table) {
+    CALCULATOR_STATS_ONLY(compile_recorder recorder(options.stats);)
+    parser parser(formula, options, *nodes);
+    if (!parser.tokenize()) {
+        return parser.failed<compiled_formula>();
+    }
+    CALCULATOR_STATS_ONLY(recorder.lap(recorder.stats.tokenize_ns);)
+    std::shared_ptr<const std::vector<std::string>> names =
+            std::make_shared<const std::vector<std::string>>(options.variables);
+    if (options.backend == evaluation_backend::flat) {
+        std::shared_ptr<flat_tree> tree = std::make_shared<flat_tree>();
+        if (!parser.parse_flat(*tree)) {
+            return parser.failed<compiled_formula>();
+        }
+        CALCULATOR_STATS_ONLY(std::size_t parsed = tree->nodes.size(); recorder.lap(recorder.stats.parse_ns);)
+        if (options.optimize) {
+            *tree = tree->simplified();
+        }
+        CALCULATOR_STATS_ONLY(recorder.lap(recorder.stats.optimize_ns); recorder.finish(parser, parsed, *tree);)
+        return compiled_formula(nullptr, nullptr, names, false, nullptr, nullptr, tree);
+    }
+    const expression *root = parser.parse();
+    if (!root) {
+        return parser.failed<compiled_formula>();
+    }
+    CALCULATOR_STATS_ONLY(const expression *parsed = root; recorder.lap(recorder.stats.parse_ns);)
+    // folding constants would round them as doubles
+    if (options.optimize && options.backend != evaluation_backend::decimal) {
+        root = simplify(root, *nodes, options.share_subexpressions ? &table : nullptr);
+    }
+    CALCULATOR_STATS_ONLY(recorder.lap(recorder.stats.optimize_ns);)
+    std::shared_ptr<const bytecode> code;
+    bool deep = false;
+    std::shared_ptr<jit_state> jit;
+    std::shared_ptr<const decimal_program> decimals;
+    if (options.backend == evaluation_backend::bytecode) {
+        code = lower(&root, 1, table.shared());
+        if (options.jit_threshold != 0 && native_code::supported()) {
+            jit = std::make_shared<jit_state>(options.jit_threshold);
+        }
+    } else if (options.backend == evaluation_backend::decimal) {
+        code = lower(&root, 1, false);
+        decimals = std::make_shared<const decimal_program>(*code, options.decimal_places);
+    } else {
+        deep = tree_depth(root) > max_recursion_depth;
+    }
+    CALCULATOR_STATS_ONLY(recorder.lap(recorder.stats.lower_ns);
+                          recorder.finish(parser, *nodes, parsed, root, code.get());)
+    // the decimal program has its own copy of the instructions
+    if (decimals) {
+        code.reset();
+    }
+    // the root keeps the whole arena alive
+    return compiled_formula(std::shared_ptr<const expression>(nodes, root), code, names, deep, jit, decimals);
+}
+
+parse_result<compiled_formula> try_compile(std::string_view formula, const compile_options &options) {
+    // before the arena is allocated; tokenize() checks again for the other entry points
+    if (!valid_decimal_places(options)) {
+        return parse_result<compiled_formula>(parse_error::invalid_decimal_places, 0);
+    }
+    node_table table;
+    return compile_shared(formula, options, std::make_shared<arena>(), table);
+}
+
+compiled_formula compile(std::string_view formula, const compile_options &options) {
+    return try_compile(formula, options).value();
+}
+
+formula_batch compile_batch(const std::vector<std::string_view> &formulas, const compile_options &options) {
+    std::shared_ptr<arena> nodes = std::make_shared<arena>();
+    node_table table;
+    std::vector<compiled_formula> compiled;
+    std::vector<const expression *> roots;
+    for (std::string_view formula : formulas) {
+        compiled.push_back(compile_shared(formula, options, nodes, table).value());
+        roots.push_back(compiled.back().root.get());
+    }
+    std::shared_ptr<const bytecode> code;
+    if (options.backend == evaluation_backend::bytecode) {
+        code = lower(roots.data(), roots.size(), table.shared());
+    }
+    return formula_batch(std::move(compiled), code);
+}
+
+// Formula images hold, in the byte order of the machine:
+//   the magic bytes, the version and a byte order mark
+//   the number of variable lists, then for each list its number of names, then each name as length and characters
+//   the number of formulas, then for each formula the index of its variable list, the number of constants and
+//   the constants, the number of instructions and for each instruction its opcode byte and operand
+// Counts are 64 bit, indices and operands 32 bit.
+static const char image_magic[8] = "calcimg";
+static const std::uint32_t image_version = 1;
+static const std::uint32_t image_byte_order = 0x01020304;
+
+class image_writer {
+    std::string bytes;
+
+public:
+    template<typename value_type>
+    void put(value_type value) {
+        bytes.append(reinterpret_cast<const char *>(&value), sizeof(value));
+    }
+
+    void put(const char *data, std::size_t size) {
+        bytes.append(data, size);
+    }
+
+    std::string take() {
+        return std::move(bytes);
+    }
+};
+
+// Reads an image without trusting it: everything is checked before use, so a damaged image cannot make
+// loading, or evaluating what it loaded, read out of bounds.
+class image_reader {
+    const std::string_view image;
+    std::size_t offset = 0;
+
+public:
+    explicit image_reader(std::string_view _image) : image(_image) {}
+
+    const char *take(std::size_t size) {
+        if (size > image.size() - offset) {
+            damaged();
+        }
+        const char *data = image.data() + offset;
+        offset += size;
+        return data;
+    }
+
+    // unaligned, as images may be concatenated or embedded
+    template<typename value_type>
+    value_type get() {
+        value_type value;
+        std::memcpy(&value, take(sizeof(value)), sizeof(value));
+        return value;
+    }
+
+    // a count of items taking at least `item_size` bytes each, which must fit in what is left
+    std::size_t count(std::size_t item_size) {
+        std::uint64_t count = get<std::uint64_t>();
+        if (count > (image.size() - offset) / item_size) {
+            damaged();
+        }
+        return count;
+    }
+
+    bool finished() const {
+        return offset == image.size();
+    }
+
+    [[noreturn]] static void damaged() {
+        throw std::invalid_argument("Damaged formula image");
+    }
+};
+
+std::string save_formulas(const std::vector<compiled_formula> &formulas) {
+    std::map<std::vector<std::string>, std::uint32_t> list_indices;
+    std::vector<const std::vector<std::string> *> lists;
+    std::vector<std::uint32_t> formula_lists;
+    for (const compiled_formula &formula : formulas) {
+        auto inserted = list_indices.emplace(*formula.names, lists.size());
+        if (inserted.second) {
+            lists.push_back(&inserted.first->first);
+        }
+        formula_lists.push_back(inserted.first->second);
+    }
+
+    image_writer writer;
+    writer.put(image_magic, sizeof(image_magic));
+    writer.put(image_version);
+    writer.put(image_byte_order);
+    writer.put<std::uint64_t>(lists.size());
+    for (const std::vector<std::string> *list : lists) {
+        writer.put<std::uint64_t>(list->size());
+        for (const std::string &name : *list) {
+            writer.put<std::uint64_t>(name.size());
+            writer.put(name.data(), name.size());
+        }
+    }
+    writer.put<std::uint64_t>(formulas.size());
+    for (std::size_t i = 0; i < formulas.size(); i++) {
+        // formulas of the tree backend are lowered now; their trees may have shared nodes
+        std::shared_ptr<const bytecode> code = formulas[i].code;
+        if (formulas[i].flat) {
+            std::shared_ptr<bytecode> program = std::make_shared<bytecode>();
+            formulas[i].flat->emit(*program);
+            code = program;
+        } else if (!code) {
+            const expression *root = formulas[i].root.get();
+            code = lower(&root, 1, true);
+        }
+        writer.put(formula_lists[i]);
+        writer.put<std::uint64_t>(code->constants.size());
+        for (double constant : code->constants) {
+            writer.put(constant);
+        }
+        writer.put<std::uint64_t>(code->instructions.size());
+        for (const instruction &instruction : code->instructions) {
+            writer.put(static_cast<std::uint8_t>(instruction.code));
+            writer.put(instruction.operand);
+        }
+    }
+    return writer.take();
+}
+
+template<typename node>
+static void replay_binary(std::vector <const expression *> &stack, arena &nodes) {
+    const expression *right = stack.back();
+    stack.pop_back();
+    stack.back() = nodes.create<node>(stack.back(), right);
+}
+
+// Replays a stored program into `program` and, on a stack of nodes, into the tree it was lowered from, less
+// the parentheses. Null if the instructions do not leave exactly one value.
+static const expression *load_program(image_reader &reader, const std::vector<double> &constants,
+                                      std::size_t variable_count, bytecode &program, arena &nodes) {
+    const std::size_t count = reader.count(sizeof(std::uint8_t) + sizeof(std::uint32_t));
+    program.instructions.reserve(count);
+    nodes.reserve(count * sizeof(two_operand_expression));
+    std::vector <const expression *> stack;
+    std::vector <const expression *> saved;
+    for (std::size_t i = 0; i < count; i++) {
+        opcode code = static_cast<opcode>(reader.get<std::uint8_t>());
+        std::uint32_t operand = reader.get<std::uint32_t>();
+        std::size_t operands = code == opcode::push || code == opcode::load || code == opcode::recall ? 0
+                               : code == opcode::negate || code == opcode::save ? 1 : 2;
+        if (stack.size() < operands) {
+            return nullptr;
+        }
+        switch (code) {
+            case opcode::push:
+                if (operand >= constants.size()) {
+                    return nullptr;
+                }
+                program.push(constants[operand]);
+                stack.push_back(nodes.create<number>(constants[operand]));
+                break;
+            case opcode::load:
+                if (operand >= variable_count) {
+                    return nullptr;
+                }
+                program.load(operand);
+                stack.push_back(nodes.create<variable>(operand));
+                break;
+            case opcode::add:
+                replay_binary<add>(stack, nodes);
+                program.emit(code);
+                break;
+            case opcode::subtract:
+                replay_binary<subtract>(stack, nodes);
+                program.emit(code);
+                break;
+            case opcode::multiply:
+                replay_binary<multiply>(stack, nodes);
+                program.emit(code);
+                break;
+            case opcode::divide:
+                replay_binary<divide>(stack, nodes);
+                program.emit(code);
+                break;
+            case opcode::negate:
+                stack.back() = nodes.create<negative>(stack.back());
+                program.emit(code);
+                break;
+            case opcode::save:
+                // temporaries are numbered in order
+                if (operand != saved.size()) {
+                    return nullptr;
+                }
+                saved.push_back(stack.back());
+                program.save();
+                break;
+            case opcode::recall:
+                if (operand >= saved.size()) {
+                    return nullptr;
+                }
+                stack.push_back(saved[operand]);
+                program.recall(operand);
+                break;
+            default:
+                return nullptr;
+        }
+    }
+    return stack.size() == 1 ? stack.back() : nullptr;
+}
+
+// The tree of a program checked by load_program(), in which a temporary becomes a node with several users
+static std::shared_ptr<const flat_tree> flatten(const bytecode &program) {
+    std::shared_ptr<flat_tree> tree = std::make_shared<flat_tree>();
+    tree->nodes.reserve(program.instructions.size());
+    std::vector <std::uint32_t> stack;
+    std::vector <std::uint32_t> saved;
+    for (const instruction &instruction : program.instructions) {
+        switch (instruction.code) {
+            case opcode::push:
+                stack.push_back(tree->push(program.constants[instruction.operand]));
+                break;
+            case opcode::load:
+                stack.push_back(tree->load(instruction.operand));
+                break;
+            case opcode::negate:
+                stack.back() = tree->negate(stack.back());
+                break;
+            case opcode::save:
+                saved.push_back(stack.back());
+                break;
+            case opcode::recall:
+                stack.push_back(saved[instruction.operand]);
+                break;
+            default: {
+                std::uint32_t right = stack.back();
+                stack.pop_back();
+                stack.back() = tree->combine(instruction.code, stack.back(), right);
+                break;
+            }
+        }
+    }
+    return tree;
+}
+
+std::vector<compiled_formula> load_formulas(std::string_view image, const compile_options &options) {
+    if (!valid_decimal_places(options)) {
+        throw std::invalid_argument(parse_error_message(parse_error::invalid_decimal_places));
+    }
+    image_reader reader(image);
+    if (std::memcmp(reader.take(sizeof(image_magic)), image_magic, sizeof(image_magic)) != 0) {
+        throw std::invalid_argument("Not a formula image");
+    }
+    if (reader.get<std::uint32_t>() != image_version || reader.get<std::uint32_t>() != image_byte_order) {
+        throw std::invalid_argument("Unsupported formula image version");
+    }
+
+    std::vector<std::shared_ptr<const std::vector<std::string>>> lists(reader.count(sizeof(std::uint64_t)));
+    for (std::shared_ptr<const std::vector<std::string>> &list : lists) {
+        std::vector<std::string> names(reader.count(sizeof(std::uint64_t)));
+        for (std::string &name : names) {
+            std::size_t length = reader.count(1);
+            name.assign(reader.take(length), length);
+        }
+        list = std::make_shared<const std::vector<std::string>>(std::move(names));
+    }
+
+    // all trees share one arena, kept alive by any of the formulas
+    std::shared_ptr<arena> nodes = std::make_shared<arena>();
+    std::vector<compiled_formula> formulas(reader.count(sizeof(std::uint32_t) + 2 * sizeof(std::uint64_t)),
+                                           compiled_formula(nullptr, nullptr, nullptr, false));
+    std::vector<double> constants;
+    for (compiled_formula &formula : formulas) {
+        std::uint32_t list = reader.get<std::uint32_t>();
+        if (list >= lists.size()) {
+            image_reader::damaged();
+        }
+        constants.resize(reader.count(sizeof(double)));
+        for (double &constant : constants) {
+            constant = reader.get<double>();
+        }
+        std::shared_ptr<bytecode> program = std::make_shared<bytecode>();
+        const expression *root = load_program(reader, constants, lists[list]->size(), *program, *nodes);
+        if (!root) {
+            image_reader::damaged();
+        }
+
+        std::shared_ptr<jit_state> jit;
+        std::shared_ptr<const decimal_program> decimals;
+        bool deep = false;
+        if (options.backend == evaluation_backend::flat) {
+            formula = compiled_formula(nullptr, nullptr, lists[list], false, nullptr, nullptr, flatten(*program));
+            continue;
+        }
+        if (options.backend == evaluation_backend::bytecode) {
+            if (options.jit_threshold != 0 && native_code::supported()) {
+                jit = std::make_shared<jit_state>(options.jit_threshold);
+            }
+        } else if (options.backend == evaluation_backend::decimal) {
+            // the image is fine, it only holds a constant too large for these places
+            for (double constant : program->constants) {
+                if (!decimal_program::representable(constant, options.decimal_places)) {
+                    throw std::invalid_argument("Constant out of the decimal range");
+                }
+            }
+            decimals = std::make_shared<const decimal_program>(*program, options.decimal_places);
+            program.reset();
+        } else {
+            program.reset();
+            deep = tree_depth(root) > max_recursion_depth;
+        }
+        formula = compiled_formula(std::shared_ptr<const expression>(nodes, root), program, lists[list], deep, jit,
+                                   decimals);
+    }
+    if (!reader.finished()) {
+        image_reader::damaged();
+    }
+    return formulas;
+}
+
+std::size_t count_tokens(std::string_view formula, const compile_options &options) {
+    arena nodes;
+    parser parser(formula, options, nodes);
+    if (!parser.tokenize()) {
+        return parser.failed<std::size_t>().value();
+    }
+    return parser.token_count();
+}
+
+parse_result<double> try_calculate(std::string_view formula) {
+    parse_result<compiled_formula> compiled = try_compile(formula);
+    if (!compiled) {
+        return parse_result<double>(compiled.error, compiled.position);
+    }
+    return compiled.value().evaluate();
+}
+
+double calculate(std::string_view formula) {
+    return try_calculate(formula).value();
+}
+
+compiled_formula compile(const char *formula, std::size_t length, const compile_options &options) {
+    return compile(std::string_view(formula, length), options);
+}
 
-double calculate(std::string formula) {
-    parser parser(formula);
-    expression *expression = parser.parse();
-    double result = expression->calc();
-    delete expression;
-    return result;
+double calculate(const char *formula, std::size_t length) {
+    return calculate(std::string_view(formula, length));
 }
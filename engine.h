@@ -2,13 +2,21 @@
 #define CALCULATOR_ENGINE_H
 
 #include <string>
+#include <string_view>
+#include <vector>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <optional>
+#include <utility>
 
 class parse_exception : public std::exception {
 public:
-    const int start_position;
+    // offset in the formula; a size_t, so it stays exact in huge memory-mapped input
+    const std::size_t start_position;
     const std::string message;
 
-    parse_exception(int _start_position, const std::string &_message)
+    parse_exception(std::size_t _start_position, const std::string &_message)
             : start_position(_start_position), message(_message) {}
 
     const char *what() const noexcept override {
@@ -16,6 +24,329 @@ public:
     }
 };
 
-double calculate(std::string formula);
+// Why a formula is invalid, for the entry points that do not throw
+enum class parse_error {
+    none,
+    empty_input,
+    formula_too_long,
+    unexpected_end,
+    empty_parentheses,
+    orphan_minus,
+    unexpected_token,
+    too_deeply_nested,
+    operator_needed,
+    invalid_number,
+    number_too_long,
+    unknown_variable,
+    unmatched_closing_parenthesis,
+    unexpected_symbol,
+    unclosed_parenthesis,
+    invalid_decimal_places
+};
+
+// the message of the parse_exception thrown for `error`
+const char *parse_error_message(parse_error error);
+
+// A value, or the error and its offset in the formula. Failing throws nothing: invalid options are
+// reported before anything is allocated, invalid formulas once tokenizing or parsing reaches the error.
+// value() turns a failure into the parse_exception the throwing entry points report.
+template<typename value_type>
+class parse_result {
+    std::optional<value_type> content;
+
+public:
+    const parse_error error;
+    // 0 for a value
+    const std::size_t position;
+
+    parse_result(value_type value) : content(std::move(value)), error(parse_error::none), position(0) {}
+
+    parse_result(parse_error _error, std::size_t _position) : error(_error), position(_position) {}
+
+    explicit operator bool() const {
+        return error == parse_error::none;
+    }
+
+    const value_type &value() const & {
+        if (!content) {
+            throw parse_exception(position, parse_error_message(error));
+        }
+        return *content;
+    }
+
+    value_type value() && {
+        if (!content) {
+            throw parse_exception(position, parse_error_message(error));
+        }
+        return std::move(*content);
+    }
+};
+
+class expression;
+class bytecode;
+class thread_pool;
+class jit_state;
+class decimal_program;
+class flat_tree;
+class formula_batch;
+
+// What compiling and evaluating formulas costs. Only filled in when the engine is built with CALCULATOR_STATS
+// defined (make CXXFLAGS="-O2 -DCALCULATOR_STATS"); otherwise the hooks compile to nothing and all stays 0.
+struct engine_stats {
+    // compile() calls that succeeded and ones that threw
+    std::uint64_t formulas = 0;
+    std::uint64_t failures = 0;
+    std::uint64_t tokens = 0;
+    // nodes of the parsed trees, and what is left of them after optimizing
+    std::uint64_t parsed_nodes = 0;
+    std::uint64_t optimized_nodes = 0;
+    std::uint64_t instructions = 0;
+    // blocks allocated for nodes and their size
+    std::uint64_t allocations = 0;
+    std::uint64_t allocated_bytes = 0;
+    // deepest nesting of parentheses and unary minuses; the maximum when stats are added up
+    std::uint64_t max_depth = 0;
+    std::uint64_t tokenize_ns = 0;
+    std::uint64_t parse_ns = 0;
+    std::uint64_t optimize_ns = 0;
+    // lowering to bytecode for that backend
+    std::uint64_t lower_ns = 0;
+    // evaluate() calls and batch rows, only in aggregated_stats() as there is none per formula
+    std::uint64_t evaluations = 0;
+    std::uint64_t evaluate_ns = 0;
+
+    engine_stats &operator+=(const engine_stats &other);
+};
+
+enum class evaluation_backend {
+    tree, // walks the parsed tree
+    bytecode, // runs the tree lowered to postfix instructions
+    decimal, // runs the bytecode on fixed-point decimals, see evaluate_decimal()
+    flat // sweeps the tree as one post-order array of 16-byte nodes, built by the parser without an arena
+};
+
+// The values from lower to upper, both included; infinite bounds are allowed
+struct interval {
+    double lower;
+    double upper;
+};
+
+// A fixed-point number: units of 10^-places
+struct decimal {
+    std::int64_t units;
+    int places;
+
+    // the nearest double
+    double to_double() const;
+
+    // all places, as in "-12.50"
+    std::string to_string() const;
+};
+
+struct compile_options {
+    evaluation_backend backend = evaluation_backend::bytecode;
+    // fold constant subexpressions and drop redundant nodes before evaluation
+    bool optimize = true;
+    // With optimize, equal subexpressions also become one node, computed once per evaluation on the bytecode
+    // backend. Pays off for formulas evaluated many times; hashing every node makes compiling slower.
+    bool share_subexpressions = false;
+    // names the formula may refer to; the value of variables[i] is passed as values[i] to evaluate()
+    std::vector<std::string> variables;
+    // Limits for untrusted input, 0 for none. Formulas nested deeper than max_depth parentheses and
+    // unary minuses, longer than max_length characters or of more than max_tokens tokens fail with a
+    // parse_exception. Whatever the options, formulas of more than INT_MAX tokens fail.
+    int max_depth = 0;
+    std::size_t max_length = 0;
+    std::size_t max_tokens = 0;
+    // With the bytecode backend, evaluate() switches to machine code generated for the formula after
+    // this many calls, on platforms with a code generator (x86-64). 0 keeps the bytecode interpreted.
+    std::uint64_t jit_threshold = 0;
+    // With the decimal backend, results and every intermediate value are rounded to this many places, 0 to 18.
+    // Values then range up to about 9.2 * 10^(18 - decimal_places).
+    int decimal_places = 6;
+    // Formulas of a few hundred kilobytes and more are tokenized and parsed in chunks spread across this pool,
+    // into the same tree as on the calling thread. Null, or a pool of one thread, parses sequentially, as does
+    // the flat backend.
+    thread_pool *parse_pool = nullptr;
+    // compile() adds the stats of the call to it, failed calls included
+    engine_stats *stats = nullptr;
+};
+
+// A parsed formula that can be evaluated any number of times without reparsing.
+// The tree is immutable and shared between copies, so evaluate() is safe to call concurrently.
+class compiled_formula {
+    std::shared_ptr<const expression> root;
+    // null when the formula is evaluated by walking the tree
+    std::shared_ptr<const bytecode> code;
+    std::shared_ptr<const std::vector<std::string>> names;
+    // the tree is too deep to be walked recursively
+    bool deep;
+    // evaluation count and machine code, shared by the copies; null without a JIT threshold
+    std::shared_ptr<jit_state> jit;
+    // only on the decimal backend
+    std::shared_ptr<const decimal_program> decimals;
+    // only on the flat backend, which has no root
+    std::shared_ptr<const flat_tree> flat;
+
+public:
+    compiled_formula(std::shared_ptr<const expression> _root, std::shared_ptr<const bytecode> _code,
+                     std::shared_ptr<const std::vector<std::string>> _names, bool _deep,
+                     std::shared_ptr<jit_state> _jit = nullptr,
+                     std::shared_ptr<const decimal_program> _decimals = nullptr,
+                     std::shared_ptr<const flat_tree> _flat = nullptr)
+            : root(std::move(_root)), code(std::move(_code)), names(std::move(_names)), deep(_deep),
+              jit(std::move(_jit)), decimals(std::move(_decimals)), flat(std::move(_flat)) {}
+
+    // `values` holds one value per variable, in the order they were declared in compile_options
+    double evaluate(const double *values) const;
+
+    // only for formulas without variables
+    double evaluate() const;
+
+    // The exact result on the decimal backend, which evaluate() rounds to a double; std::invalid_argument on
+    // the others. Throws std::overflow_error when a value leaves the range, std::domain_error on a division by
+    // zero or a variable that is not finite.
+    decimal evaluate_decimal(const double *values) const;
+
+    // A range containing every result evaluate() can return for values within `bounds`, one interval per
+    // variable, apart from NaN, so whole blocks of rows can be skipped on their minimum and maximum. Each
+    // operation is bounded on its own, so a variable used twice may widen it: x * x in [-1, 1] gives [-1, 1].
+    // Dividing by an interval that holds 0 gives the whole line. Throws std::invalid_argument for a bound
+    // with lower > upper or a NaN, and on the decimal backend. Formulas without bytecode are lowered each call.
+    interval evaluate_interval(const interval *bounds) const;
+
+    // Evaluates `rows` rows at once: columns[i][row] is the value of variable i for that row,
+    // and the result goes to results[row]. Rows are processed in SIMD blocks on the bytecode backend.
+    void evaluate_batch(const double *const *columns, double *results, std::size_t rows) const;
+
+    // Same, with the rows split into chunks spread across the pool. No locks are taken on the formula.
+    void evaluate_batch(const double *const *columns, double *results, std::size_t rows, thread_pool &pool) const;
+
+    // variable names in slot order
+    const std::vector<std::string> &variables() const {
+        return *names;
+    }
+
+private:
+    friend class incremental_formula;
+    friend formula_batch compile_batch(const std::vector<std::string_view> &formulas, const compile_options &options);
+    friend std::string save_formulas(const std::vector<compiled_formula> &formulas);
+
+    void evaluate_rows(const double *const *columns, double *results, std::size_t begin, std::size_t end) const;
+};
+
+// A compiled formula that remembers the value of every subexpression for one set of variable values, so that
+// when some variables change only the nodes depending on them are computed again: the cost of an update is
+// the length of the paths from the changed variables to the root rather than the size of the formula.
+// Results are exactly those of evaluate(). Not safe to update from several threads at once.
+class incremental_formula {
+    struct node_state {
+        const expression *node;
+        // indices of the operands, -1 where there is none
+        int operands[2];
+        // range of the node's parents in `parents`
+        int first_parent;
+        int parent_count;
+    };
+
+    compiled_formula formula;
+    std::vector<double> variables;
+    // in post order, so the root comes last and operands always before their parents
+    std::vector<node_state> nodes;
+    std::vector<int> parents;
+    std::vector<double> node_values;
+    // variable nodes reading each slot
+    std::vector<std::vector<int>> readers;
+    std::vector<char> dirty;
+    std::vector<int> marked;
+    std::vector<int> stack;
+
+public:
+    // evaluates the whole formula once; `values` holds one value per variable, as for evaluate()
+    incremental_formula(const compiled_formula &_formula, const double *values);
+
+    double value() const {
+        return node_values.back();
+    }
+
+    // `values` holds all variables, of which only changed_slots[0..count) are read
+    double update(const int *changed_slots, std::size_t count, const double *values);
+
+    double update(int slot, double value);
+
+private:
+    void compute(int index);
+
+    void mark(int slot);
+
+    double recompute_marked();
+};
+
+// Formulas compiled together by compile_batch(). With share_subexpressions, equal subexpressions are one node
+// across the whole batch, and on the bytecode backend evaluate() runs all formulas as one program in which
+// each of those is computed once.
+class formula_batch {
+    std::vector<compiled_formula> members;
+    // leaves the result of every formula on its stack, in order; null on the tree backend
+    std::shared_ptr<const bytecode> code;
+
+public:
+    formula_batch(std::vector<compiled_formula> _members, std::shared_ptr<const bytecode> _code)
+            : members(std::move(_members)), code(std::move(_code)) {}
+
+    // results[i] = formulas()[i].evaluate(values), all formulas sharing the same variables
+    void evaluate(const double *values, double *results) const;
+
+    // each formula also works on its own, still sharing nodes with the others
+    const std::vector<compiled_formula> &formulas() const {
+        return members;
+    }
+};
+
+// results[i] = formulas[i].evaluate(values) for independent formulas sharing the same variables,
+// spread across the pool
+void evaluate_all(const std::vector<compiled_formula> &formulas, const double *values, double *results,
+                  thread_pool &pool);
+
+compiled_formula compile(std::string_view formula, const compile_options &options = compile_options());
+
+// Same, returning the error of an invalid formula instead of throwing it.
+parse_result<compiled_formula> try_compile(std::string_view formula, const compile_options &options = compile_options());
+
+// The buffer is only read while compiling, so it may be a read-only mapping of a file.
+compiled_formula compile(const char *formula, std::size_t length, const compile_options &options = compile_options());
+
+// Compiles every formula with the same options, in order; throws the parse_exception of the first invalid one.
+formula_batch compile_batch(const std::vector<std::string_view> &formulas,
+                            const compile_options &options = compile_options());
+
+// Compact binary image of compiled formulas: the bytecode and constant pool of each, and its variable names,
+// stored once per distinct list. Written once, it loads without parsing, so a service restarts warm. The
+// format is versioned and in the byte order of the machine that wrote it.
+std::string save_formulas(const std::vector<compiled_formula> &formulas);
+
+// The formulas of an image written by save_formulas(), in order, each with the variables it was compiled with;
+// of the options only the backend, the JIT threshold and the decimal places apply. The image may be a read-only
+// mapping of a file, as nothing refers to it once loaded. Throws std::invalid_argument for a damaged image or
+// another version, and with the decimal backend for invalid places or a constant out of the fixed-point range.
+std::vector<compiled_formula> load_formulas(std::string_view image, const compile_options &options = compile_options());
+
+// whether the engine was built with CALCULATOR_STATS
+bool stats_enabled();
+
+// the stats of all calls so far, from all threads
+engine_stats aggregated_stats();
+
+void reset_aggregated_stats();
+
+// Only tokenizes the formula, throwing the parse_exception compile() would throw while doing so.
+std::size_t count_tokens(std::string_view formula, const compile_options &options = compile_options());
+
+double calculate(std::string_view formula);
+
+// Same, returning the error of an invalid formula instead of throwing it.
+parse_result<double> try_calculate(std::string_view formula);
+
+double calculate(const char *formula, std::size_t length);
 
 #endif //CALCULATOR_ENGINE_H
@@ -0,0 +1,261 @@
+#ifndef CALCULATOR_FLAT_TREE_H
+#define CALCULATOR_FLAT_TREE_H
+
+#include <cmath>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <vector>
+
+#include "bytecode.h"
+
+// A node of a flat_tree, 16 bytes whatever its kind
+struct flat_node {
+    // push for a number, load for a variable, or an operator; never save or recall
+    opcode code;
+    union {
+        // for push
+        double value;
+        // for load, the variable slot in operands[0]; for operators, the indices of the operands
+        std::uint32_t operands[2];
+    };
+};
+
+static_assert(sizeof(flat_node) == 16, "Flat nodes are 16 bytes");
+
+// An expression tree as one array of nodes in post-order, the root last. Operands are referred to by index
+// and always come before the node, so passes and evaluation sweep the array front to back, and the tree
+// costs no vtables, pointers or allocations per node. Evaluation needs a scratch value per node, which
+// callers evaluating many rows allocate once. Parentheses leave no node. A node may be the operand of
+// several others, as in trees loaded from an image with shared subexpressions.
+class flat_tree {
+public:
+    std::vector <flat_node> nodes;
+
+    std::uint32_t push(double value) {
+        flat_node node = {opcode::push, {}};
+        node.value = value;
+        return append(node);
+    }
+
+    std::uint32_t load(int slot) {
+        return append(with_operands(opcode::load, static_cast<std::uint32_t>(slot), 0));
+    }
+
+    std::uint32_t negate(std::uint32_t operand) {
+        return append(with_operands(opcode::negate, operand, 0));
+    }
+
+    // add, subtract, multiply or divide
+    std::uint32_t combine(opcode code, std::uint32_t left, std::uint32_t right) {
+        return append(with_operands(code, left, right));
+    }
+
+    double run(const double *variables) const {
+        // the native stack is enough for small formulas
+        double local_values[64];
+        std::unique_ptr<double[]> heap_values;
+        double *values = local_values;
+        if (nodes.size() > 64) {
+            heap_values.reset(new double[nodes.size()]);
+            values = heap_values.get();
+        }
+        return run(variables, values);
+    }
+
+    // `values` has room for the value of every node
+    double run(const double *variables, double *values) const {
+        // the last value computed is the root's
+        double value = 0;
+        for (std::size_t i = 0; i < nodes.size(); i++) {
+            const flat_node &node = nodes[i];
+            switch (node.code) {
+                case opcode::push:
+                    value = node.value;
+                    break;
+                case opcode::load:
+                    value = variables[node.operands[0]];
+                    break;
+                case opcode::add:
+                    value = values[node.operands[0]] + values[node.operands[1]];
+                    break;
+                case opcode::subtract:
+                    value = values[node.operands[0]] - values[node.operands[1]];
+                    break;
+                case opcode::multiply:
+                    value = values[node.operands[0]] * values[node.operands[1]];
+                    break;
+                case opcode::divide:
+                    value = values[node.operands[0]] / values[node.operands[1]];
+                    break;
+                case opcode::negate:
+                    // same as negative::calc(), so all backends agree even on NaN signs
+                    value = -1 * values[node.operands[0]];
+                    break;
+                case opcode::save:
+                case opcode::recall:
+                    break;
+            }
+            values[i] = value;
+        }
+        return value;
+    }
+
+    // The rewrites of simplify() on pointer trees, which keep results bit-identical: constant operations
+    // folded, x - 0, x * 1, 1 * x, x / 1 and double negations dropped. Nodes left unused are removed after.
+    flat_tree simplified() const {
+        flat_tree result;
+        result.nodes.reserve(nodes.size());
+        // index of every node in `result`
+        std::vector <std::uint32_t> moved(nodes.size());
+        for (std::size_t i = 0; i < nodes.size(); i++) {
+            flat_node node = nodes[i];
+            if (node.code == opcode::push || node.code == opcode::load) {
+                moved[i] = result.append(node);
+                continue;
+            }
+            const std::uint32_t left = moved[node.operands[0]];
+            if (node.code == opcode::negate) {
+                const flat_node &operand = result.nodes[left];
+                if (operand.code == opcode::push) {
+                    moved[i] = result.push(-1 * operand.value);
+                } else if (operand.code == opcode::negate) {
+                    // multiplying by -1 twice only flips the sign back
+                    moved[i] = operand.operands[0];
+                } else {
+                    moved[i] = result.negate(left);
+                }
+                continue;
+            }
+            const std::uint32_t right = moved[node.operands[1]];
+            if ((node.code == opcode::subtract && result.is_positive_zero(right))
+                || ((node.code == opcode::multiply || node.code == opcode::divide) && result.is_literal(right, 1))) {
+                moved[i] = left;
+            } else if (node.code == opcode::multiply && result.is_literal(left, 1)) {
+                moved[i] = right;
+            } else if (result.nodes[left].code == opcode::push && result.nodes[right].code == opcode::push) {
+                moved[i] = result.push(apply(node.code, result.nodes[left].value, result.nodes[right].value));
+            } else {
+                moved[i] = result.combine(node.code, left, right);
+            }
+        }
+        return result.reachable(moved.back());
+    }
+
+    // Appends the instructions computing the root. Nodes with several users are computed once, into a temporary.
+    void emit(bytecode &program) const {
+        std::vector <int> users(nodes.size(), 0);
+        for (const flat_node &node : nodes) {
+            for (int i = 0; i < operand_count(node); i++) {
+                users[node.operands[i]]++;
+            }
+        }
+        // temporary of every shared node once computed, -1 before
+        std::vector <std::int64_t> temporaries(nodes.size(), -1);
+        std::vector <std::pair<std::uint32_t, bool>> pending = {{static_cast<std::uint32_t>(nodes.size() - 1), false}};
+        while (!pending.empty()) {
+            const std::uint32_t index = pending.back().first;
+            const bool expanded = pending.back().second;
+            pending.pop_back();
+            const flat_node &node = nodes[index];
+            if (temporaries[index] != -1) {
+                program.recall(temporaries[index]);
+                continue;
+            }
+            if (!expanded && operand_count(node) != 0) {
+                pending.push_back({index, true});
+                for (int i = operand_count(node) - 1; i >= 0; i--) {
+                    pending.push_back({node.operands[i], false});
+                }
+                continue;
+            }
+            switch (node.code) {
+                case opcode::push:
+                    program.push(node.value);
+                    break;
+                case opcode::load:
+                    program.load(node.operands[0]);
+                    break;
+                default:
+                    program.emit(node.code);
+                    break;
+            }
+            if (users[index] > 1) {
+                temporaries[index] = program.save();
+            }
+        }
+    }
+
+private:
+    static int operand_count(const flat_node &node) {
+        switch (node.code) {
+            case opcode::push:
+            case opcode::load:
+                return 0;
+            case opcode::negate:
+                return 1;
+            default:
+                return 2;
+        }
+    }
+
+    static flat_node with_operands(opcode code, std::uint32_t first, std::uint32_t second) {
+        flat_node node = {code, {}};
+        node.operands[0] = first;
+        node.operands[1] = second;
+        return node;
+    }
+
+    std::uint32_t append(const flat_node &node) {
+        nodes.push_back(node);
+        return static_cast<std::uint32_t>(nodes.size() - 1);
+    }
+
+    bool is_literal(std::uint32_t index, double value) const {
+        return nodes[index].code == opcode::push && nodes[index].value == value;
+    }
+
+    // +0 only: -0 compares equal to it, but x - -0 is +0 for x = -0
+    bool is_positive_zero(std::uint32_t index) const {
+        return is_literal(index, 0) && !std::signbit(nodes[index].value);
+    }
+
+    static double apply(opcode code, double left, double right) {
+        switch (code) {
+            case opcode::add:
+                return left + right;
+            case opcode::subtract:
+                return left - right;
+            case opcode::multiply:
+                return left * right;
+            default:
+                return left / right;
+        }
+    }
+
+    // the nodes `root` depends on, in the same order
+    flat_tree reachable(std::uint32_t root) const {
+        std::vector <bool> used(nodes.size(), false);
+        used[root] = true;
+        for (std::size_t i = root + 1; i-- > 0;) {
+            for (int operand = 0; used[i] && operand < operand_count(nodes[i]); operand++) {
+                used[nodes[i].operands[operand]] = true;
+            }
+        }
+        flat_tree result;
+        std::vector <std::uint32_t> moved(nodes.size());
+        for (std::size_t i = 0; i <= root; i++) {
+            if (!used[i]) {
+                continue;
+            }
+            flat_node node = nodes[i];
+            for (int operand = 0; operand < operand_count(node); operand++) {
+                node.operands[operand] = moved[node.operands[operand]];
+            }
+            moved[i] = result.append(node);
+        }
+        return result;
+    }
+};
+
+#endif //CALCULATOR_FLAT_TREE_H
@@ -0,0 +1,94 @@
+#include <algorithm>
+#include <functional>
+
+#include "formula_cache.h"
+
+static bool is_word_symbol(char symbol) {
+    return symbol >= '0' && symbol <= '9' || symbol == '.' || symbol == '_'
+           || symbol >= 'a' && symbol <= 'z' || symbol >= 'A' && symbol <= 'Z';
+}
+
+formula_cache::formula_cache(std::size_t capacity, const compile_options &_options, int _shards)
+        : options(_options), shard_count(std::max(_shards, 1)),
+          shard_capacity(std::max<std::size_t>(1, (capacity + shard_count - 1) / shard_count)),
+          shards(new shard[shard_count]) {}
+
+std::string formula_cache::normalize(std::string_view formula) {
+    std::string key;
+    key.reserve(formula.size());
+    bool space = false;
+    for (char symbol : formula) {
+        if (symbol == ' ') {
+            space = true;
+            continue;
+        }
+        if (space && !key.empty() && is_word_symbol(key.back()) && is_word_symbol(symbol)) {
+            key += ' ';
+        }
+        space = false;
+        key += symbol;
+    }
+    return key;
+}
+
+compiled_formula formula_cache::get(std::string_view formula) {
+    std::string key = normalize(formula);
+    shard &shard = shards[std::hash<std::string>()(key) % shard_count];
+    {
+        std::lock_guard<std::mutex> lock(shard.mutex);
+        auto found = shard.index.find(key);
+        if (found != shard.index.end()) {
+            shard.hits++;
+            shard.entries.splice(shard.entries.begin(), shard.entries, found->second);
+            return found->second->second;
+        }
+        shard.misses++;
+    }
+
+    // compiled without the lock, so a long formula does not hold up the other lookups of the shard
+    compiled_formula compiled = compile(formula, options);
+
+    std::lock_guard<std::mutex> lock(shard.mutex);
+    if (shard.index.find(key) != shard.index.end()) {
+        // another thread got there first, either result will do
+        return compiled;
+    }
+    shard.entries.emplace_front(std::move(key), compiled);
+    shard.index.emplace(shard.entries.front().first, shard.entries.begin());
+    if (shard.entries.size() > shard_capacity) {
+        shard.index.erase(shard.entries.back().first);
+        shard.entries.pop_back();
+    }
+    return compiled;
+}
+
+double formula_cache::calculate(std::string_view formula) {
+    return get(formula).evaluate();
+}
+
+std::uint64_t formula_cache::hits() const {
+    std::uint64_t total = 0;
+    for (int i = 0; i < shard_count; i++) {
+        std::lock_guard<std::mutex> lock(shards[i].mutex);
+        total += shards[i].hits;
+    }
+    return total;
+}
+
+std::uint64_t formula_cache::misses() const {
+    std::uint64_t total = 0;
+    for (int i = 0; i < shard_count; i++) {
+        std::lock_guard<std::mutex> lock(shards[i].mutex);
+        total += shards[i].misses;
+    }
+    return total;
+}
+
+std::size_t formula_cache::size() const {
+    std::size_t total = 0;
+    for (int i = 0; i < shard_count; i++) {
+        std::lock_guard<std::mutex> lock(shards[i].mutex);
+        total += shards[i].entries.size();
+    }
+    return total;
+}
@@ -0,0 +1,59 @@
+#ifndef CALCULATOR_FORMULA_CACHE_H
+#define CALCULATOR_FORMULA_CACHE_H
+
+#include <cstddef>
+#include <cstdint>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <utility>
+
+#include "engine.h"
+
+// Compiled formulas by their text, least recently used ones evicted first. Formulas differing only
+// in spaces share an entry. The entries are split into shards with a lock each, so threads looking
+// up different formulas rarely wait for each other. Safe to use from any number of threads.
+class formula_cache {
+    struct alignas(64) shard {
+        mutable std::mutex mutex;
+        // most recently used first
+        std::list<std::pair<std::string, compiled_formula>> entries;
+        std::unordered_map<std::string_view, std::list<std::pair<std::string, compiled_formula>>::iterator> index;
+        std::uint64_t hits = 0;
+        std::uint64_t misses = 0;
+    };
+
+    const compile_options options;
+    const int shard_count;
+    const std::size_t shard_capacity;
+    std::unique_ptr<shard[]> shards;
+
+public:
+    // Holds up to about `capacity` formulas, all compiled with `options`.
+    explicit formula_cache(std::size_t capacity, const compile_options &_options = compile_options(), int _shards = 16);
+
+    formula_cache(const formula_cache &) = delete;
+
+    formula_cache &operator=(const formula_cache &) = delete;
+
+    // The cached form of `formula`, compiled on a miss. Invalid formulas are not cached, so they throw
+    // the same parse_exception every time.
+    compiled_formula get(std::string_view formula);
+
+    double calculate(std::string_view formula);
+
+    std::uint64_t hits() const;
+
+    std::uint64_t misses() const;
+
+    std::size_t size() const;
+
+    // Key of a formula: spaces are dropped, except a single one between characters that would
+    // otherwise merge into one number or name, so "3 2" does not become the key of "32".
+    static std::string normalize(std::string_view formula);
+};
+
+#endif //CALCULATOR_FORMULA_CACHE_H
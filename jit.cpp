@@ -0,0 +1,211 @@
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <limits>
+
+#include "jit.h"
+
+#if defined(__x86_64__) && (defined(__unix__) || defined(__APPLE__))
+#define CALCULATOR_JIT_X86_64
+#include <sys/mman.h>
+#endif
+
+#ifdef CALCULATOR_JIT_X86_64
+
+// System V calling convention: constants in rdi, variables in rsi, spilled entries in rdx, result in xmm0.
+// Stack entry i lives in xmm<i> while i < 14, deeper ones in memory; xmm14 and xmm15 are scratch.
+// Temporaries follow the spilled entries.
+class x86_64_emitter {
+    static const int constants = 7; // rdi
+    static const int variables = 6; // rsi
+    static const int spilled = 2; // rdx
+    static const int scratch_left = 14;
+    static const int scratch_right = 15;
+
+    // scalar double instructions, all F2 0F <code>
+    enum sse : std::uint8_t {
+        load = 0x10,
+        store = 0x11,
+        add = 0x58,
+        multiply = 0x59,
+        subtract = 0x5c,
+        divide = 0x5e
+    };
+
+    int depth = 0;
+    // index of the first temporary in the spilled memory
+    std::size_t first_temporary = 0;
+
+public:
+    static const int register_entries = 14;
+
+    std::vector <std::uint8_t> code;
+
+    // false if an offset in the program does not fit into a 32-bit displacement
+    bool emit(const bytecode &program, std::size_t minus_one) {
+        const std::size_t max_displacement = std::numeric_limits<std::int32_t>::max() / sizeof(double);
+        first_temporary = std::max(program.max_stack - register_entries, 0);
+        if (minus_one >= max_displacement
+            || static_cast<std::size_t>(program.max_stack) + program.temporaries >= max_displacement) {
+            return false;
+        }
+
+        for (const instruction &instruction : program.instructions) {
+            switch (instruction.code) {
+                case opcode::push:
+                    push(constants, instruction.operand);
+                    break;
+                case opcode::load:
+                    if (instruction.operand >= max_displacement) {
+                        return false;
+                    }
+                    push(variables, instruction.operand);
+                    break;
+                case opcode::add:
+                    combine(add);
+                    break;
+                case opcode::subtract:
+                    combine(subtract);
+                    break;
+                case opcode::multiply:
+                    combine(multiply);
+                    break;
+                case opcode::divide:
+                    combine(divide);
+                    break;
+                case opcode::negate:
+                    // -1 * x, like negative::calc()
+                    if (depth - 1 < register_entries) {
+                        with_memory(multiply, depth - 1, constants, minus_one);
+                    } else {
+                        with_memory(load, scratch_left, spilled, depth - 1 - register_entries);
+                        with_memory(multiply, scratch_left, constants, minus_one);
+                        with_memory(store, scratch_left, spilled, depth - 1 - register_entries);
+                    }
+                    break;
+                case opcode::save:
+                    if (depth - 1 < register_entries) {
+                        with_memory(store, depth - 1, spilled, first_temporary + instruction.operand);
+                    } else {
+                        with_memory(load, scratch_left, spilled, depth - 1 - register_entries);
+                        with_memory(store, scratch_left, spilled, first_temporary + instruction.operand);
+                    }
+                    break;
+                case opcode::recall:
+                    push(spilled, first_temporary + instruction.operand);
+                    break;
+            }
+        }
+        code.push_back(0xc3); // ret
+        return true;
+    }
+
+private:
+    void push(int base, std::size_t index) {
+        if (depth < register_entries) {
+            with_memory(load, depth, base, index);
+        } else {
+            with_memory(load, scratch_left, base, index);
+            with_memory(store, scratch_left, spilled, depth - register_entries);
+        }
+        depth++;
+    }
+
+    void combine(sse operation) {
+        int right = depth - 1;
+        int left = depth - 2;
+        int right_register = right;
+        if (right >= register_entries) {
+            with_memory(load, scratch_right, spilled, right - register_entries);
+            right_register = scratch_right;
+        }
+        if (left < register_entries) {
+            with_register(operation, left, right_register);
+        } else {
+            with_memory(load, scratch_left, spilled, left - register_entries);
+            with_register(operation, scratch_left, right_register);
+            with_memory(store, scratch_left, spilled, left - register_entries);
+        }
+        depth--;
+    }
+
+    void prefix(int reg, int rm) {
+        code.push_back(0xf2);
+        if (reg >= 8 || rm >= 8) {
+            code.push_back(0x40 | (reg >= 8) << 2 | (rm >= 8));
+        }
+        code.push_back(0x0f);
+    }
+
+    // op xmm<target>, xmm<source>
+    void with_register(sse operation, int target, int source) {
+        prefix(target, source);
+        code.push_back(operation);
+        code.push_back(0xc0 | (target & 7) << 3 | (source & 7));
+    }
+
+    // op xmm<target>, [base + 8 * index], or the other way round for a store
+    void with_memory(sse operation, int target, int base, std::size_t index) {
+        prefix(target, base);
+        code.push_back(operation);
+        code.push_back(0x80 | (target & 7) << 3 | base);
+        std::uint32_t displacement = index * sizeof(double);
+        for (int byte = 0; byte < 4; byte++) {
+            code.push_back(displacement >> 8 * byte);
+        }
+    }
+};
+
+bool native_code::supported() {
+    return true;
+}
+
+std::unique_ptr<native_code> native_code::compile(const bytecode &program) {
+    std::vector<double> constants = program.constants;
+    constants.push_back(-1);
+    x86_64_emitter emitter;
+    if (!emitter.emit(program, constants.size() - 1)) {
+        return nullptr;
+    }
+
+    std::size_t size = emitter.code.size();
+    void *memory = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (memory == MAP_FAILED) {
+        return nullptr;
+    }
+    std::memcpy(memory, emitter.code.data(), size);
+    // never writable and executable at the same time
+    if (mprotect(memory, size, PROT_READ | PROT_EXEC) != 0) {
+        munmap(memory, size);
+        return nullptr;
+    }
+
+    int spilled_values = std::max(program.max_stack - x86_64_emitter::register_entries, 0) + program.temporaries;
+    return std::unique_ptr<native_code>(new native_code(memory, size, std::move(constants), spilled_values));
+}
+
+native_code::native_code(void *_memory, std::size_t _size, std::vector<double> _constants, int _spilled_values)
+        : memory(_memory), size(_size), entry(reinterpret_cast<entry_point>(_memory)),
+          constants(std::move(_constants)), spilled_values(_spilled_values) {}
+
+native_code::~native_code() {
+    munmap(memory, size);
+}
+
+#else
+
+bool native_code::supported() {
+    return false;
+}
+
+std::unique_ptr<native_code> native_code::compile(const bytecode &program) {
+    return nullptr;
+}
+
+native_code::native_code(void *_memory, std::size_t _size, std::vector<double> _constants, int _spilled_values)
+        : memory(_memory), size(_size), entry(nullptr), constants(std::move(_constants)),
+          spilled_values(_spilled_values) {}
+
+native_code::~native_code() = default;
+
+#endif
@@ -0,0 +1,50 @@
+#ifndef CALCULATOR_JIT_H
+#define CALCULATOR_JIT_H
+
+#include <cstddef>
+#include <memory>
+#include <vector>
+
+#include "bytecode.h"
+
+// Machine code for a bytecode program: one arithmetic instruction per opcode, with the top of the
+// value stack kept in registers. Only generated for x86-64; elsewhere compile() returns null and the
+// bytecode stays interpreted.
+class native_code {
+    using entry_point = double (*)(const double *constants, const double *variables, double *spilled);
+
+    void *memory;
+    std::size_t size;
+    entry_point entry;
+    // the program's constants followed by the -1 that negations multiply with
+    std::vector<double> constants;
+    // stack entries that do not fit into registers, and the temporaries
+    int spilled_values;
+
+    native_code(void *_memory, std::size_t _size, std::vector<double> _constants, int _spilled_values);
+
+public:
+    // null if there is no code generator for this platform or executable memory is not available
+    static std::unique_ptr<native_code> compile(const bytecode &program);
+
+    static bool supported();
+
+    ~native_code();
+
+    native_code(const native_code &) = delete;
+
+    native_code &operator=(const native_code &) = delete;
+
+    double run(const double *variables) const {
+        double local_spilled[64];
+        std::unique_ptr<double[]> heap_spilled;
+        double *spilled = local_spilled;
+        if (spilled_values > 64) {
+            heap_spilled.reset(new double[spilled_values]);
+            spilled = heap_spilled.get();
+        }
+        return entry(constants.data(), variables, spilled);
+    }
+};
+
+#endif //CALCULATOR_JIT_H
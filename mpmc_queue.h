@@ -0,0 +1,92 @@
+#ifndef CALCULATOR_MPMC_QUEUE_H
+#define CALCULATOR_MPMC_QUEUE_H
+
+#include <atomic>
+#include <cstddef>
+#include <memory>
+#include <utility>
+
+// Bounded queue for any number of producers and consumers without locks. Every cell carries a sequence
+// number telling whose turn it is: a producer claims the cell at the tail once it is free for the current
+// lap, a consumer the one at the head once it has been filled, each with one compare-and-swap on a counter.
+// Nothing blocks: try_push() fails on a full queue and try_pop() on an empty one.
+template<typename value_type>
+class mpmc_queue {
+    struct alignas(64) cell {
+        std::atomic<std::size_t> sequence;
+        value_type value;
+    };
+
+    const std::size_t mask;
+    std::unique_ptr<cell[]> cells;
+    alignas(64) std::atomic<std::size_t> tail{0};
+    alignas(64) std::atomic<std::size_t> head{0};
+
+    static std::size_t round_up(std::size_t capacity) {
+        std::size_t rounded = 1;
+        while (rounded < capacity) {
+            rounded *= 2;
+        }
+        return rounded;
+    }
+
+public:
+    // holds `capacity` values, rounded up to a power of two
+    explicit mpmc_queue(std::size_t capacity) : mask(round_up(capacity) - 1), cells(new cell[mask + 1]) {
+        for (std::size_t i = 0; i <= mask; i++) {
+            cells[i].sequence.store(i, std::memory_order_relaxed);
+        }
+    }
+
+    mpmc_queue(const mpmc_queue &) = delete;
+
+    mpmc_queue &operator=(const mpmc_queue &) = delete;
+
+    std::size_t capacity() const {
+        return mask + 1;
+    }
+
+    // moves `value` in, unless the queue is full; then it is left untouched
+    bool try_push(value_type &value) {
+        std::size_t position = tail.load(std::memory_order_relaxed);
+        for (;;) {
+            cell &target = cells[position & mask];
+            std::size_t sequence = target.sequence.load(std::memory_order_acquire);
+            std::ptrdiff_t lag = static_cast<std::ptrdiff_t>(sequence - position);
+            if (lag == 0) {
+                if (tail.compare_exchange_weak(position, position + 1, std::memory_order_relaxed)) {
+                    target.value = std::move(value);
+                    target.sequence.store(position + 1, std::memory_order_release);
+                    return true;
+                }
+            } else if (lag < 0) {
+                // the consumer of the previous lap has not taken this cell yet
+                return false;
+            } else {
+                position = tail.load(std::memory_order_relaxed);
+            }
+        }
+    }
+
+    bool try_pop(value_type &value) {
+        std::size_t position = head.load(std::memory_order_relaxed);
+        for (;;) {
+            cell &source = cells[position & mask];
+            std::size_t sequence = source.sequence.load(std::memory_order_acquire);
+            std::ptrdiff_t lag = static_cast<std::ptrdiff_t>(sequence - (position + 1));
+            if (lag == 0) {
+                if (head.compare_exchange_weak(position, position + 1, std::memory_order_relaxed)) {
+                    value = std::move(source.value);
+                    source.sequence.store(position + mask + 1, std::memory_order_release);
+                    return true;
+                }
+            } else if (lag < 0) {
+                return false;
+            } else {
+                position = head.load(std::memory_order_relaxed);
+            }
+        }
+    }
+};
+
+#endif //CALCULATOR_MPMC_QUEUE_H
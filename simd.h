@@ -0,0 +1,378 @@
+#ifndef CALCULATOR_SIMD_H
+#define CALCULATOR_SIMD_H
+
+#include <cstddef>
+#include <cstring>
+
+// A vector register of doubles for the widest instruction set the engine is compiled for,
+// with a plain double as the fallback. Arithmetic is IEEE in every lane, so results match
+// scalar evaluation bit for bit.
+
+#if defined(__AVX__)
+
+#include <immintrin.h>
+
+class double_lanes {
+    __m256d value;
+
+    double_lanes(__m256d _value) : value(_value) {}
+
+public:
+    static const int width = 4;
+
+    static double_lanes load(const double *source) {
+        return _mm256_loadu_pd(source);
+    }
+
+    static double_lanes broadcast(double source) {
+        return _mm256_set1_pd(source);
+    }
+
+    void store(double *destination) const {
+        _mm256_storeu_pd(destination, value);
+    }
+
+    friend double_lanes operator+(double_lanes left, double_lanes right) {
+        return _mm256_add_pd(left.value, right.value);
+    }
+
+    friend double_lanes operator-(double_lanes left, double_lanes right) {
+        return _mm256_sub_pd(left.value, right.value);
+    }
+
+    friend double_lanes operator*(double_lanes left, double_lanes right) {
+        return _mm256_mul_pd(left.value, right.value);
+    }
+
+    friend double_lanes operator/(double_lanes left, double_lanes right) {
+        return _mm256_div_pd(left.value, right.value);
+    }
+};
+
+#elif defined(__SSE2__)
+
+#include <emmintrin.h>
+
+class double_lanes {
+    __m128d value;
+
+    double_lanes(__m128d _value) : value(_value) {}
+
+public:
+    static const int width = 2;
+
+    static double_lanes load(const double *source) {
+        return _mm_loadu_pd(source);
+    }
+
+    static double_lanes broadcast(double source) {
+        return _mm_set1_pd(source);
+    }
+
+    void store(double *destination) const {
+        _mm_storeu_pd(destination, value);
+    }
+
+    friend double_lanes operator+(double_lanes left, double_lanes right) {
+        return _mm_add_pd(left.value, right.value);
+    }
+
+    friend double_lanes operator-(double_lanes left, double_lanes right) {
+        return _mm_sub_pd(left.value, right.value);
+    }
+
+    friend double_lanes operator*(double_lanes left, double_lanes right) {
+        return _mm_mul_pd(left.value, right.value);
+    }
+
+    friend double_lanes operator/(double_lanes left, double_lanes right) {
+        return _mm_div_pd(left.value, right.value);
+    }
+};
+
+#elif defined(__ARM_NEON) && defined(__aarch64__)
+
+#include <arm_neon.h>
+
+class double_lanes {
+    float64x2_t value;
+
+    double_lanes(float64x2_t _value) : value(_value) {}
+
+public:
+    static const int width = 2;
+
+    static double_lanes load(const double *source) {
+        return vld1q_f64(source);
+    }
+
+    static double_lanes broadcast(double source) {
+        return vdupq_n_f64(source);
+    }
+
+    void store(double *destination) const {
+        vst1q_f64(destination, value);
+    }
+
+    friend double_lanes operator+(double_lanes left, double_lanes right) {
+        return vaddq_f64(left.value, right.value);
+    }
+
+    friend double_lanes operator-(double_lanes left, double_lanes right) {
+        return vsubq_f64(left.value, right.value);
+    }
+
+    friend double_lanes operator*(double_lanes left, double_lanes right) {
+        return vmulq_f64(left.value, right.value);
+    }
+
+    friend double_lanes operator/(double_lanes left, double_lanes right) {
+        return vdivq_f64(left.value, right.value);
+    }
+};
+
+#else
+
+class double_lanes {
+    double value;
+
+    double_lanes(double _value) : value(_value) {}
+
+public:
+    static const int width = 1;
+
+    static double_lanes load(const double *source) {
+        return *source;
+    }
+
+    static double_lanes broadcast(double source) {
+        return source;
+    }
+
+    void store(double *destination) const {
+        *destination = value;
+    }
+
+    friend double_lanes operator+(double_lanes left, double_lanes right) {
+        return left.value + right.value;
+    }
+
+    friend double_lanes operator-(double_lanes left, double_lanes right) {
+        return left.value - right.value;
+    }
+
+    friend double_lanes operator*(double_lanes left, double_lanes right) {
+        return left.value * right.value;
+    }
+
+    friend double_lanes operator/(double_lanes left, double_lanes right) {
+        return left.value / right.value;
+    }
+};
+
+#endif
+
+// left[i] = operation(left[i], right[i]) for i < count, a whole register at a time
+template<typename operation>
+void combine_lanes(double *left, const double *right, std::size_t count, operation apply) {
+    std::size_t i = 0;
+    for (; i + double_lanes::width <= count; i += double_lanes::width) {
+        apply(double_lanes::load(left + i), double_lanes::load(right + i)).store(left + i);
+    }
+    for (; i < count; i++) {
+        left[i] = apply(left[i], right[i]);
+    }
+}
+
+// values[i] = operation(values[i], factor) for i < count
+template<typename operation>
+void combine_lanes(double *values, double factor, std::size_t count, operation apply) {
+    double_lanes factors = double_lanes::broadcast(factor);
+    std::size_t i = 0;
+    for (; i + double_lanes::width <= count; i += double_lanes::width) {
+        apply(double_lanes::load(values + i), factors).store(values + i);
+    }
+    for (; i < count; i++) {
+        values[i] = apply(values[i], factor);
+    }
+}
+
+// Classes of formula symbols, a register of bytes at a time: bit i of a mask is set when symbol i belongs to
+// the class. The fallback classifies one symbol.
+
+#if defined(__AVX2__)
+
+#include <immintrin.h>
+
+class symbol_lanes {
+    __m256i value;
+
+    symbol_lanes(__m256i _value) : value(_value) {}
+
+    // bytes in [low, high], compared unsigned
+    __m256i in_range(char low, char high) const {
+        __m256i offset = _mm256_sub_epi8(value, _mm256_set1_epi8(low));
+        return _mm256_cmpeq_epi8(_mm256_min_epu8(offset, _mm256_set1_epi8(high - low)), offset);
+    }
+
+    __m256i equal(char symbol) const {
+        return _mm256_cmpeq_epi8(value, _mm256_set1_epi8(symbol));
+    }
+
+    __m256i identifier_lanes() const {
+        __m256i lower = _mm256_or_si256(value, _mm256_set1_epi8(0x20));
+        return _mm256_or_si256(_mm256_or_si256(in_range('0', '9'), symbol_lanes(lower).in_range('a', 'z')),
+                               equal('_'));
+    }
+
+    static unsigned mask(__m256i lanes) {
+        return static_cast<unsigned>(_mm256_movemask_epi8(lanes));
+    }
+
+public:
+    static const int width = 32;
+    static const unsigned full_mask = 0xffffffff;
+
+    static symbol_lanes load(const char *source) {
+        return _mm256_loadu_si256(reinterpret_cast<const __m256i *>(source));
+    }
+
+    // digits and '.'
+    unsigned number_symbols() const {
+        return mask(_mm256_or_si256(in_range('0', '9'), equal('.')));
+    }
+
+    // letters, digits and '_'
+    unsigned identifier_symbols() const {
+        return mask(identifier_lanes());
+    }
+
+    unsigned spaces() const {
+        return mask(equal(' '));
+    }
+
+    // symbols of tokens and spaces; '(' to '/' are the operators, the parentheses, '.' and ','
+    unsigned valid_symbols() const {
+        __m256i punctuation = _mm256_andnot_si256(equal(','), in_range('(', '/'));
+        return mask(_mm256_or_si256(_mm256_or_si256(identifier_lanes(), punctuation), equal(' ')));
+    }
+};
+
+#elif defined(__SSE2__)
+
+#include <emmintrin.h>
+
+class symbol_lanes {
+    __m128i value;
+
+    symbol_lanes(__m128i _value) : value(_value) {}
+
+    // bytes in [low, high], compared unsigned
+    __m128i in_range(char low, char high) const {
+        __m128i offset = _mm_sub_epi8(value, _mm_set1_epi8(low));
+        return _mm_cmpeq_epi8(_mm_min_epu8(offset, _mm_set1_epi8(high - low)), offset);
+    }
+
+    __m128i equal(char symbol) const {
+        return _mm_cmpeq_epi8(value, _mm_set1_epi8(symbol));
+    }
+
+    __m128i identifier_lanes() const {
+        __m128i lower = _mm_or_si128(value, _mm_set1_epi8(0x20));
+        return _mm_or_si128(_mm_or_si128(in_range('0', '9'), symbol_lanes(lower).in_range('a', 'z')), equal('_'));
+    }
+
+    static unsigned mask(__m128i lanes) {
+        return static_cast<unsigned>(_mm_movemask_epi8(lanes));
+    }
+
+public:
+    static const int width = 16;
+    static const unsigned full_mask = 0xffff;
+
+    static symbol_lanes load(const char *source) {
+        return _mm_loadu_si128(reinterpret_cast<const __m128i *>(source));
+    }
+
+    // digits and '.'
+    unsigned number_symbols() const {
+        return mask(_mm_or_si128(in_range('0', '9'), equal('.')));
+    }
+
+    // letters, digits and '_'
+    unsigned identifier_symbols() const {
+        return mask(identifier_lanes());
+    }
+
+    unsigned spaces() const {
+        return mask(equal(' '));
+    }
+
+    // symbols of tokens and spaces; '(' to '/' are the operators, the parentheses, '.' and ','
+    unsigned valid_symbols() const {
+        __m128i punctuation = _mm_andnot_si128(equal(','), in_range('(', '/'));
+        return mask(_mm_or_si128(_mm_or_si128(identifier_lanes(), punctuation), equal(' ')));
+    }
+};
+
+#else
+
+class symbol_lanes {
+    char value;
+
+    symbol_lanes(char _value) : value(_value) {}
+
+    bool digit() const {
+        return value >= '0' && value <= '9';
+    }
+
+    bool identifier() const {
+        return digit() || value >= 'a' && value <= 'z' || value >= 'A' && value <= 'Z' || value == '_';
+    }
+
+public:
+    static const int width = 1;
+    static const unsigned full_mask = 1;
+
+    static symbol_lanes load(const char *source) {
+        return *source;
+    }
+
+    unsigned number_symbols() const {
+        return digit() || value == '.';
+    }
+
+    unsigned identifier_symbols() const {
+        return identifier();
+    }
+
+    unsigned spaces() const {
+        return value == ' ';
+    }
+
+    unsigned valid_symbols() const {
+        return identifier() || value >= '(' && value <= '/' && value != ',' || value == ' ';
+    }
+};
+
+#endif
+
+// the first of symbols[from, to) outside the class, or `to`
+template<unsigned (symbol_lanes::*symbol_class)() const>
+std::size_t skip_symbols(const char *symbols, std::size_t from, std::size_t to) {
+    for (; from + symbol_lanes::width <= to; from += symbol_lanes::width) {
+        unsigned outside = ~(symbol_lanes::load(symbols + from).*symbol_class)() & symbol_lanes::full_mask;
+        if (outside != 0) {
+            return from + __builtin_ctz(outside);
+        }
+    }
+    if (from == to) {
+        return to;
+    }
+    // the rest, padded with zero bytes, which are in no class
+    char rest[symbol_lanes::width] = {};
+    std::memcpy(rest, symbols + from, to - from);
+    return from + __builtin_ctz(~(symbol_lanes::load(rest).*symbol_class)());
+}
+
+#endif //CALCULATOR_SIMD_H
@@ -0,0 +1,268 @@
+#ifndef CALCULATOR_STATIC_FORMULA_H
+#define CALCULATOR_STATIC_FORMULA_H
+
+#include <cstddef>
+#include <string_view>
+#include <type_traits>
+
+#include "constexpr_calc.h"
+
+// Formulas with variables that are known while compiling, turned into nested types whose calc() the
+// compiler inlines into straight-line arithmetic. Text and variable names come from a type:
+//
+//     struct pricing {
+//         static constexpr std::string_view formula = "price * qty - discount";
+//         static constexpr std::string_view variables[] = {"price", "qty", "discount"};
+//     };
+//     double total = static_formula<pricing>::evaluate(values);
+//
+// where static_formula<pricing>::type is
+// static_subtract<static_multiply<static_variable<0>, static_variable<1>>, static_variable<2>>.
+// The grammar and the arithmetic are those of compile(), so the results are the same to the bit,
+// and a formula compile() would reject is a compile error.
+
+template<std::size_t slot>
+class static_variable {
+public:
+    static double calc(const double *values) {
+        return values[slot];
+    }
+};
+
+// formula[begin, end) of `text`, rounded like the parser rounds literals
+template<typename text, std::size_t begin, std::size_t end>
+class static_number {
+public:
+    static constexpr double value = constexpr_formula::parse_number(text::formula, begin, end);
+
+    static double calc(const double *values) {
+        return value;
+    }
+};
+
+template<typename left, typename right>
+class static_add {
+public:
+    static double calc(const double *values) {
+        return left::calc(values) + right::calc(values);
+    }
+};
+
+template<typename left, typename right>
+class static_subtract {
+public:
+    static double calc(const double *values) {
+        return left::calc(values) - right::calc(values);
+    }
+};
+
+template<typename left, typename right>
+class static_multiply {
+public:
+    static double calc(const double *values) {
+        return left::calc(values) * right::calc(values);
+    }
+};
+
+template<typename left, typename right>
+class static_divide {
+public:
+    static double calc(const double *values) {
+        return left::calc(values) / right::calc(values);
+    }
+};
+
+template<typename operand>
+class static_negative {
+public:
+    static double calc(const double *values) {
+        return -1 * operand::calc(values);
+    }
+};
+
+// variable names of `text`, which may have none
+template<typename text, typename = void>
+struct static_variables {
+    static constexpr const std::string_view *names = nullptr;
+    static constexpr std::size_t count = 0;
+};
+
+template<typename text>
+struct static_variables<text, std::void_t<decltype(text::variables)>> {
+    static constexpr const std::string_view *names = text::variables;
+    static constexpr std::size_t count = std::extent<decltype(text::variables)>::value;
+};
+
+// How the tokens of a valid range combine at its top level
+struct static_split {
+    enum kind_type {
+        binary,
+        negation,
+        group,
+        number,
+        variable
+    } kind;
+    constexpr_formula::token_type binary_operator;
+    // the binary operator, the minus or the opening parenthesis; the first token for the others
+    std::size_t position;
+    // end of the token at `position` for numbers, the matching closing parenthesis for groups
+    std::size_t end;
+    std::size_t slot;
+
+    // The last binary operator of the lowest priority outside parentheses is applied last, as the parser
+    // builds operators of the same priority left to right. Unary minuses bind to the next operand only.
+    static constexpr static_split of(std::string_view formula, std::size_t begin, std::size_t end,
+                                     const std::string_view *variables, std::size_t variable_count) {
+        using token_type = constexpr_formula::token_type;
+        const std::size_t none = formula.size();
+        std::size_t last_first = none;
+        std::size_t last_second = none;
+        token_type first_operator = token_type::end;
+        token_type second_operator = token_type::end;
+        std::size_t closing = none;
+        int depth = 0;
+        bool after_operand = false;
+        for (constexpr_formula::token next = constexpr_formula::scan(formula, begin); next.start < end;
+             next = constexpr_formula::scan(formula, next.end)) {
+            switch (next.type) {
+                case token_type::opening_parenthesis:
+                    depth++;
+                    after_operand = false;
+                    break;
+                case token_type::closing_parenthesis:
+                    depth--;
+                    closing = next.start;
+                    after_operand = true;
+                    break;
+                case token_type::number:
+                case token_type::variable:
+                    after_operand = true;
+                    break;
+                case token_type::plus:
+                case token_type::minus:
+                    if (depth == 0 && after_operand) {
+                        last_first = next.start;
+                        first_operator = next.type;
+                    }
+                    after_operand = false;
+                    break;
+                default:
+                    if (depth == 0) {
+                        last_second = next.start;
+                        second_operator = next.type;
+                    }
+                    after_operand = false;
+                    break;
+            }
+        }
+
+        if (last_first != none) {
+            return {binary, first_operator, last_first, 0, 0};
+        }
+        if (last_second != none) {
+            return {binary, second_operator, last_second, 0, 0};
+        }
+        constexpr_formula::token first = constexpr_formula::scan(formula, begin);
+        switch (first.type) {
+            case token_type::minus:
+                return {negation, token_type::end, first.start, 0, 0};
+            case token_type::opening_parenthesis:
+                return {group, token_type::end, first.start, closing, 0};
+            case token_type::number:
+                return {number, token_type::end, first.start, first.end, 0};
+            default:
+                return {variable, token_type::end, first.start, 0,
+                        constexpr_formula::find_variable(formula.substr(first.start, first.end - first.start),
+                                                         variables, variable_count)};
+        }
+    }
+};
+
+template<typename text, std::size_t begin, std::size_t end>
+class static_parse;
+
+template<typename text, static_split::kind_type kind, constexpr_formula::token_type binary_operator,
+         std::size_t begin, std::size_t position, std::size_t split_end, std::size_t slot, std::size_t end>
+struct static_node;
+
+template<typename text, std::size_t begin, std::size_t position, std::size_t split_end, std::size_t slot,
+         std::size_t end>
+struct static_node<text, static_split::binary, constexpr_formula::token_type::plus, begin, position, split_end, slot, end> {
+    using type = static_add<typename static_parse<text, begin, position>::type,
+                            typename static_parse<text, position + 1, end>::type>;
+};
+
+template<typename text, std::size_t begin, std::size_t position, std::size_t split_end, std::size_t slot,
+         std::size_t end>
+struct static_node<text, static_split::binary, constexpr_formula::token_type::minus, begin, position, split_end, slot, end> {
+    using type = static_subtract<typename static_parse<text, begin, position>::type,
+                                 typename static_parse<text, position + 1, end>::type>;
+};
+
+template<typename text, std::size_t begin, std::size_t position, std::size_t split_end, std::size_t slot,
+         std::size_t end>
+struct static_node<text, static_split::binary, constexpr_formula::token_type::multiply, begin, position, split_end, slot, end> {
+    using type = static_multiply<typename static_parse<text, begin, position>::type,
+                                 typename static_parse<text, position + 1, end>::type>;
+};
+
+template<typename text, std::size_t begin, std::size_t position, std::size_t split_end, std::size_t slot,
+         std::size_t end>
+struct static_node<text, static_split::binary, constexpr_formula::token_type::divide, begin, position, split_end, slot, end> {
+    using type = static_divide<typename static_parse<text, begin, position>::type,
+                               typename static_parse<text, position + 1, end>::type>;
+};
+
+template<typename text, constexpr_formula::token_type binary_operator, std::size_t begin, std::size_t position,
+         std::size_t split_end, std::size_t slot, std::size_t end>
+struct static_node<text, static_split::negation, binary_operator, begin, position, split_end, slot, end> {
+    using type = static_negative<typename static_parse<text, position + 1, end>::type>;
+};
+
+// parentheses only group, they leave no node behind
+template<typename text, constexpr_formula::token_type binary_operator, std::size_t begin, std::size_t position,
+         std::size_t split_end, std::size_t slot, std::size_t end>
+struct static_node<text, static_split::group, binary_operator, begin, position, split_end, slot, end> {
+    using type = typename static_parse<text, position + 1, split_end>::type;
+};
+
+template<typename text, constexpr_formula::token_type binary_operator, std::size_t begin, std::size_t position,
+         std::size_t split_end, std::size_t slot, std::size_t end>
+struct static_node<text, static_split::number, binary_operator, begin, position, split_end, slot, end> {
+    using type = static_number<text, position, split_end>;
+};
+
+template<typename text, constexpr_formula::token_type binary_operator, std::size_t begin, std::size_t position,
+         std::size_t split_end, std::size_t slot, std::size_t end>
+struct static_node<text, static_split::variable, binary_operator, begin, position, split_end, slot, end> {
+    using type = static_variable<slot>;
+};
+
+// the expression type of formula[begin, end)
+template<typename text, std::size_t begin, std::size_t end>
+class static_parse {
+    static constexpr static_split split = static_split::of(text::formula, begin, end,
+                                                           static_variables<text>::names,
+                                                           static_variables<text>::count);
+
+public:
+    using type = typename static_node<text, split.kind, split.binary_operator, begin, split.position, split.end,
+                                      split.slot, end>::type;
+};
+
+template<typename text>
+class static_formula {
+    // checked before any type is built, so an invalid formula fails to compile with its parse_exception
+    static constexpr bool valid = (constexpr_formula::check(text::formula, static_variables<text>::names,
+                                                            static_variables<text>::count), true);
+
+public:
+    using type = typename static_parse<text, 0, valid ? text::formula.size() : 0>::type;
+
+    // `values` holds one value per variable, in the order of text::variables
+    static double evaluate(const double *values) {
+        return type::calc(values);
+    }
+};
+
+#endif //CALCULATOR_STATIC_FORMULA_H
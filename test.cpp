@@ -1,8 +1,53 @@
 #include <string>
 #include <iostream>
 #include <cstdlib>
+#include <stdexcept>
+#include <thread>
+#include <vector>
+#include <random>
+#include <algorithm>
+#include <cstring>
+#include <cmath>
+#include <atomic>
+#include <fstream>
+#include <sstream>
+#include <stdlib.h>
+#include <sys/wait.h>
 
 #include "engine.h"
+#include "constexpr_calc.h"
+#include "static_formula.h"
+#include "formula_cache.h"
+#include "thread_pool.h"
+#include "mpmc_queue.h"
+#include "calculation_service.h"
+
+static_assert("2 * (3 + 4)"_calc == 14, "Constant formula evaluated at compile time");
+static_assert("-(2 - -3) * -2"_calc == 10, "Constant formula evaluated at compile time");
+static_assert("0.1 + 0.2"_calc == 0.1 + 0.2, "Literals rounded like the compiler does");
+
+struct pricing_text {
+    static constexpr std::string_view formula = "price * qty - discount * (price / 100 + 1) - -qty";
+    static constexpr std::string_view variables[] = {"price", "qty", "discount"};
+};
+
+struct chain_text {
+    static constexpr std::string_view formula = "a - b - c / a / b * -c + --a * (b - (c - 1.1)) / 3";
+    static constexpr std::string_view variables[] = {"a", "b", "c"};
+};
+
+struct constant_text {
+    static constexpr std::string_view formula = "0.1 * 3 - -(2 / 7)";
+};
+
+struct product_text {
+    static constexpr std::string_view formula = "x * y + 2";
+    static constexpr std::string_view variables[] = {"x", "y"};
+};
+
+static_assert(std::is_same<static_formula<product_text>::type,
+                           static_add<static_multiply<static_variable<0>, static_variable<1>>,
+                                      static_number<product_text, 8, 9>>>::value, "Formula as a nested type");
 
 static int overall_tests = 0;
 static int passed_tests = 0;
@@ -32,24 +77,1295 @@ static void success_test(std::string formula, double expected_result) {
     }
 }
 
-static void parse_error_test(std::string formula, int expected_error_position) {
+// the formula is the first `length` characters of a buffer that goes on
+static void buffer_test(const char *buffer, std::size_t length, double expected_result) {
+    overall_tests++;
+    double result = calculate(buffer, length);
+    if (result == expected_result) {
+        mark_passed();
+    } else {
+        mark_failed("Wrong result: got " + std::to_string(result), std::string(buffer, length));
+    }
+}
+
+// every backend with and without optimization, plus bytecode promoted to machine code on the second call
+static std::vector<compile_options> all_backends(const std::vector<std::string> &variables = {}) {
+    std::vector<compile_options> backends;
+    for (evaluation_backend backend : {evaluation_backend::tree, evaluation_backend::bytecode,
+                                       evaluation_backend::flat}) {
+        for (bool optimize : {false, true}) {
+            compile_options options;
+            options.backend = backend;
+            options.optimize = optimize;
+            options.variables = variables;
+            backends.push_back(options);
+        }
+    }
+    for (bool optimize : {false, true}) {
+        compile_options options;
+        options.optimize = optimize;
+        options.variables = variables;
+        options.jit_threshold = 2;
+        backends.push_back(options);
+    }
+    for (std::size_t i = 0, count = backends.size(); i < count; i++) {
+        if (backends[i].optimize) {
+            backends.push_back(backends[i]);
+            backends.back().share_subexpressions = true;
+        }
+    }
+    return backends;
+}
+
+static void compiled_test(std::string formula, double expected_result) {
+    overall_tests++;
+    for (const compile_options &options : all_backends()) {
+        const compiled_formula compiled = compile(formula, options);
+        const compiled_formula copy = compiled;
+        for (int i = 0; i < 3; i++) {
+            if (compiled.evaluate() != expected_result || copy.evaluate() != expected_result) {
+                mark_failed("Wrong result on repeated evaluation", formula);
+                return;
+            }
+        }
+    }
+    mark_passed();
+}
+
+static void variable_test(std::string formula, const std::vector<std::string> &variables,
+                          const std::vector<double> &values, double expected_result) {
+    overall_tests++;
+    for (const compile_options &options : all_backends(variables)) {
+        const compiled_formula compiled = compile(formula, options);
+        for (int i = 0; i < 3; i++) {
+            double result = compiled.evaluate(values.data());
+            if (result != expected_result) {
+                std::string error = "Wrong result: expected " + std::to_string(expected_result)
+                        + ", got " + std::to_string(result);
+                mark_failed(error, formula);
+                return;
+            }
+        }
+    }
+    mark_passed();
+}
+
+// x = -0 keeps the sign of the unsimplified result on every backend
+static void signed_zero_test(std::string formula) {
+    overall_tests++;
+    compile_options unsimplified;
+    unsimplified.backend = evaluation_backend::tree;
+    unsimplified.optimize = false;
+    unsimplified.variables = {"x"};
+    const double x = -0.0;
+    bool expected = std::signbit(compile(formula, unsimplified).evaluate(&x));
+    for (const compile_options &options : all_backends({"x"})) {
+        if (std::signbit(compile(formula, options).evaluate(&x)) != expected) {
+            mark_failed("Simplifying flipped the sign of zero", formula);
+            return;
+        }
+    }
+    mark_passed();
+}
+
+// batch results must be exactly the ones of evaluating row by row
+static void batch_test(std::string formula, const std::vector<std::string> &variables, int rows) {
+    overall_tests++;
+    std::vector<std::vector<double>> columns(variables.size(), std::vector<double>(rows));
+    std::vector<const double *> column_pointers;
+    for (int slot = 0; slot < variables.size(); slot++) {
+        for (int row = 0; row < rows; row++) {
+            columns[slot][row] = 1 + (row * 7 + slot * 13) % 97 / 4.0;
+        }
+        column_pointers.push_back(columns[slot].data());
+    }
+
+    for (evaluation_backend backend : {evaluation_backend::tree, evaluation_backend::bytecode}) {
+        compile_options options;
+        options.backend = backend;
+        options.variables = variables;
+        const compiled_formula compiled = compile(formula, options);
+        std::vector<double> results(rows);
+        compiled.evaluate_batch(column_pointers.data(), results.data(), rows);
+        std::vector<double> parallel_results(rows);
+        thread_pool pool(3);
+        compiled.evaluate_batch(column_pointers.data(), parallel_results.data(), rows, pool);
+
+        std::vector<double> values(variables.size());
+        for (int row = 0; row < rows; row++) {
+            for (int slot = 0; slot < variables.size(); slot++) {
+                values[slot] = columns[slot][row];
+            }
+            double expected = compiled.evaluate(values.data());
+            if (results[row] != expected || parallel_results[row] != expected) {
+                mark_failed("Wrong batch result in row " + std::to_string(row), formula);
+                return;
+            }
+        }
+    }
+    mark_passed();
+}
+
+static void parallel_for_test(int threads, std::size_t chunks) {
+    overall_tests++;
+    thread_pool pool(threads);
+    std::vector<int> calls(chunks, 0);
+    for (int round = 0; round < 3; round++) {
+        pool.parallel_for(chunks, [&calls](std::size_t chunk) {
+            calls[chunk]++;
+        });
+    }
+    for (std::size_t chunk = 0; chunk < chunks; chunk++) {
+        if (calls[chunk] != 3) {
+            mark_failed("Chunk " + std::to_string(chunk) + " ran " + std::to_string(calls[chunk]) + " times",
+                        std::to_string(threads) + " threads");
+            return;
+        }
+    }
+    mark_passed();
+}
+
+// callers on other threads share the pool, and each of their loops still runs every chunk once
+static void concurrent_parallel_for_test(int callers, std::size_t chunks) {
+    overall_tests++;
+    thread_pool pool(4);
+    std::vector<std::vector<int>> calls(callers, std::vector<int>(chunks, 0));
+    std::vector<std::thread> threads;
+    for (int caller = 0; caller < callers; caller++) {
+        threads.emplace_back([&pool, &calls, caller, chunks] {
+            for (int round = 0; round < 50; round++) {
+                pool.parallel_for(chunks, [&calls, caller](std::size_t chunk) {
+                    calls[caller][chunk]++;
+                });
+            }
+        });
+    }
+    for (std::thread &thread : threads) {
+        thread.join();
+    }
+    for (int caller = 0; caller < callers; caller++) {
+        for (std::size_t chunk = 0; chunk < chunks; chunk++) {
+            if (calls[caller][chunk] != 50) {
+                mark_failed("Chunk " + std::to_string(chunk) + " of caller " + std::to_string(caller) + " ran "
+                            + std::to_string(calls[caller][chunk]) + " times", std::to_string(callers) + " callers");
+                return;
+            }
+        }
+    }
+    mark_passed();
+}
+
+// A body throws while the other workers steal: the exception reaches the caller, the workers stop taking
+// chunks well before the end, none is still running once parallel_for() returns, and the next loop runs
+// every chunk once.
+static void throwing_parallel_for_test(std::size_t chunks) {
+    overall_tests++;
+    thread_pool pool(4);
+    for (int round = 0; round < 100; round++) {
+        // among the first chunks of one of the first two shares
+        const std::size_t failing = round % 4 + (round / 4 % 2) * chunks / 4;
+        std::atomic<int> running{0};
+        std::atomic<std::size_t> started{0};
+        std::string error;
+        try {
+            pool.parallel_for(chunks, [&](std::size_t chunk) {
+                running++;
+                started++;
+                // worker 0's share is slower, so that the others steal from it
+                volatile int spin = 0;
+                for (int i = 0; i < (chunk < chunks / 4 ? 4000 : 2000); i++) {
+                    spin = spin + i;
+                }
+                running--;
+                if (chunk == failing) {
+                    throw std::runtime_error("Chunk failed");
+                }
+            });
+        } catch (const std::runtime_error &e) {
+            error = e.what();
+        }
+        if (error != "Chunk failed" || running.load() != 0 || started.load() == chunks) {
+            mark_failed("Round " + std::to_string(round) + ": error '" + error + "', " + std::to_string(running.load())
+                        + " running, " + std::to_string(started.load()) + " started", "");
+            return;
+        }
+        std::vector<int> calls(chunks, 0);
+        pool.parallel_for(chunks, [&calls](std::size_t chunk) {
+            calls[chunk]++;
+        });
+        if (std::count(calls.begin(), calls.end(), 1) != static_cast<std::ptrdiff_t>(chunks)) {
+            mark_failed("Round " + std::to_string(round) + ": chunks lost or repeated after a failure", "");
+            return;
+        }
+    }
+    mark_passed();
+}
+
+static void evaluate_all_test(int count) {
+    overall_tests++;
+    compile_options options;
+    options.variables = {"x"};
+    std::vector<compiled_formula> formulas;
+    for (int i = 0; i < count; i++) {
+        formulas.push_back(compile("x * " + std::to_string(i + 1), options));
+    }
+    double x = 2;
+    std::vector<double> results(count);
+    thread_pool pool(4);
+    evaluate_all(formulas, &x, results.data(), pool);
+    for (int i = 0; i < count; i++) {
+        if (results[i] != 2 * (i + 1)) {
+            mark_failed("Wrong result for formula " + std::to_string(i), "x * " + std::to_string(i + 1));
+            return;
+        }
+    }
+    mark_passed();
+}
+
+// each result of the batch must be exactly the one of the formula compiled on its own
+static void compile_batch_test(const std::vector<std::string> &formulas, const std::vector<std::string> &variables,
+                               const std::vector<double> &values) {
+    overall_tests++;
+    std::vector<std::string_view> views(formulas.begin(), formulas.end());
+    for (const compile_options &options : all_backends(variables)) {
+        const formula_batch batch = compile_batch(views, options);
+        std::vector<double> results(formulas.size());
+        batch.evaluate(values.data(), results.data());
+        for (std::size_t i = 0; i < formulas.size(); i++) {
+            double expected = compile(formulas[i], options).evaluate(values.data());
+            double alone = batch.formulas()[i].evaluate(values.data());
+            if (std::memcmp(&results[i], &expected, sizeof(double)) != 0
+                || std::memcmp(&alone, &expected, sizeof(double)) != 0) {
+                mark_failed("Wrong batch result", formulas[i]);
+                return;
+            }
+        }
+    }
+    mark_passed();
+}
+
+// Formulas compiled with every backend, saved and loaded again with every backend, keep their variables and
+// evaluate to the same bits, alone, in batches and incrementally.
+static void image_test(const std::vector<std::string> &formulas, const std::vector<std::string> &variables) {
+    overall_tests++;
+    std::vector<double> values;
+    std::vector<const double *> columns;
+    for (std::size_t slot = 0; slot < variables.size(); slot++) {
+        values.push_back(0.75 - 1.5 * slot);
+    }
+    for (const double &value : values) {
+        columns.push_back(&value);
+    }
+    for (const compile_options &compiled_with : all_backends(variables)) {
+        std::vector<compiled_formula> compiled;
+        for (const std::string &formula : formulas) {
+            compiled.push_back(compile(formula, compiled_with));
+        }
+        std::string image = save_formulas(compiled);
+        for (const compile_options &loaded_with : all_backends()) {
+            std::vector<compiled_formula> loaded = load_formulas(image, loaded_with);
+            if (loaded.size() != formulas.size()) {
+                mark_failed("Loaded " + std::to_string(loaded.size()) + " formulas", image);
+                return;
+            }
+            for (std::size_t i = 0; i < formulas.size(); i++) {
+                double expected = compiled[i].evaluate(values.data());
+                // incremental formulas need a tree of nodes
+                bool incremental = loaded_with.backend != evaluation_backend::flat;
+                double results[3];
+                results[0] = loaded[i].evaluate(values.data());
+                loaded[i].evaluate_batch(columns.data(), results + 1, 1);
+                results[2] = incremental ? incremental_formula(loaded[i], values.data()).value() : results[0];
+                for (double result : results) {
+                    if (loaded[i].variables() != variables || std::memcmp(&result, &expected, sizeof(result)) != 0) {
+                        mark_failed("Loaded formula differs", formulas[i]);
+                        return;
+                    }
+                }
+            }
+        }
+    }
+    mark_passed();
+}
+
+// formulas with different variables in one image
+static void image_variables_test() {
+    overall_tests++;
+    std::vector<std::vector<std::string>> variables = {{"x", "y"}, {}, {"y", "x"}, {"x", "y"}};
+    std::vector<compiled_formula> compiled;
+    for (const std::vector<std::string> &names : variables) {
+        compile_options options;
+        options.variables = names;
+        compiled.push_back(compile(names.empty() ? "2 * 3" : "x - y", options));
+    }
+    std::vector<compiled_formula> loaded = load_formulas(save_formulas(compiled));
+    const double values[] = {5, 2};
+    for (std::size_t i = 0; i < variables.size(); i++) {
+        if (loaded[i].variables() != variables[i] || loaded[i].evaluate(values) != compiled[i].evaluate(values)) {
+            mark_failed("Wrong variables after loading", std::to_string(i));
+            return;
+        }
+    }
+    mark_passed();
+}
+
+// Every truncation and every damaged byte of an image is rejected or loads formulas that can be evaluated.
+static void damaged_image_test() {
+    overall_tests++;
+    compile_options options;
+    options.variables = {"a", "b"};
+    options.share_subexpressions = true;
+    std::string image = save_formulas({compile("(a + b) * (a + b) - -a / 2.5", options), compile("b", options)});
+    std::vector<std::string> damaged;
+    for (std::size_t length = 0; length < image.size(); length++) {
+        damaged.push_back(image.substr(0, length));
+    }
+    damaged.push_back(image + '\0');
+    for (std::size_t i = 0; i < image.size(); i++) {
+        for (char flip : {'\x01', '\x80', '\xff'}) {
+            damaged.push_back(image);
+            damaged.back()[i] ^= flip;
+        }
+    }
+
+    int rejected = 0;
+    for (const std::string &bytes : damaged) {
+        try {
+            for (const compiled_formula &formula : load_formulas(bytes)) {
+                std::vector<double> values(formula.variables().size(), 1.5);
+                formula.evaluate(values.data());
+            }
+        } catch (const std::invalid_argument &) {
+            rejected++;
+        }
+    }
+    // truncated, longer and the header touched: rejected for sure
+    if (rejected < image.size() + 1 + 3 * 16) {
+        mark_failed("Accepted " + std::to_string(damaged.size() - rejected) + " damaged images", "");
+        return;
+    }
+    try {
+        std::string other_version = image;
+        other_version[sizeof(std::uint64_t)]++;
+        load_formulas(other_version);
+        mark_failed("Loaded another version", "");
+    } catch (const std::invalid_argument &e) {
+        if (std::string(e.what()) == "Unsupported formula image version") {
+            mark_passed();
+        } else {
+            mark_failed(std::string("Wrong error ") + e.what(), "");
+        }
+    }
+}
+
+static compile_options decimal_options(int places, const std::vector<std::string> &variables = {}) {
+    compile_options options;
+    options.backend = evaluation_backend::decimal;
+    options.decimal_places = places;
+    options.variables = variables;
+    return options;
+}
+
+// `expected` with all places; evaluate(), batches and formulas loaded from an image agree with it
+static void decimal_test(std::string formula, const std::vector<std::string> &variables,
+                         const std::vector<double> &values, int places, std::string expected) {
+    overall_tests++;
+    compiled_formula compiled = compile(formula, decimal_options(places, variables));
+    decimal result = compiled.evaluate_decimal(values.data());
+    if (result.to_string() != expected || result.places != places) {
+        mark_failed("Expected " + expected + ", got " + result.to_string(), formula);
+        return;
+    }
+    std::vector<const double *> columns;
+    for (const double &value : values) {
+        columns.push_back(&value);
+    }
+    double expected_double = std::stod(expected);
+    double results[3];
+    results[0] = compiled.evaluate(values.data());
+    compiled.evaluate_batch(columns.data(), results + 1, 1);
+    compiled_formula loaded = load_formulas(save_formulas({compiled}), decimal_options(places)).at(0);
+    results[2] = loaded.evaluate(values.data());
+    for (double value : results) {
+        if (value != expected_double) {
+            mark_failed("Decimal result rounded to " + std::to_string(value), formula);
+            return;
+        }
+    }
+    mark_passed();
+}
+
+template<typename exception_type>
+static void decimal_error_test(std::string formula, const std::vector<std::string> &variables,
+                               const std::vector<double> &values, int places, std::string expected_message) {
     overall_tests++;
     try {
-        calculate(formula);
-        mark_failed("Missed parsing error", formula);
+        compile(formula, decimal_options(places, variables)).evaluate_decimal(values.data());
+        mark_failed("No error", formula);
+    } catch (const exception_type &e) {
+        if (std::string(e.what()) == expected_message) {
+            mark_passed();
+        } else {
+            mark_failed("Wrong error " + std::string(e.what()), formula);
+        }
+    }
+}
+
+// an intact image whose constants the decimal backend cannot hold at `places`
+static void decimal_image_error_test(std::string formula, int places, std::string expected_message) {
+    overall_tests++;
+    compile_options options;
+    options.variables = {"x"};
+    std::string image = save_formulas({compile(formula, options)});
+    try {
+        load_formulas(image, decimal_options(places));
+        mark_failed("No error", formula);
+    } catch (const std::invalid_argument &e) {
+        if (std::string(e.what()) == expected_message) {
+            mark_passed();
+        } else {
+            mark_failed("Wrong error " + std::string(e.what()), formula);
+        }
+    }
+}
+
+// options and constants the decimal backend cannot take, reported without throwing
+static void decimal_parse_error_test(std::string formula, int places, parse_error expected_error,
+                                     std::size_t expected_position) {
+    overall_tests++;
+    parse_result<compiled_formula> result = try_compile(formula, decimal_options(places, {}));
+    if (!result && result.error == expected_error && result.position == expected_position) {
+        mark_passed();
+    } else {
+        mark_failed("Wrong error " + std::string(parse_error_message(result.error)) + " at "
+                    + std::to_string(result.position), formula);
+    }
+}
+
+// what the other entry points do with decimal formulas, and decimal evaluation of the others
+static void decimal_backend_test() {
+    overall_tests++;
+    try {
+        compile("1 / 3").evaluate_decimal(nullptr);
+        mark_failed("Decimal result of a bytecode formula", "1 / 3");
+        return;
+    } catch (const std::invalid_argument &) {
+    }
+    compiled_formula compiled = compile("x / 3", decimal_options(2, {"x"}));
+    double x = 1;
+    try {
+        incremental_formula incremental(compiled, &x);
+        mark_failed("Updated a decimal formula incrementally", "x / 3");
+        return;
+    } catch (const std::invalid_argument &) {
+    }
+    formula_batch batch = compile_batch({"x / 3", "x * 0.125"}, decimal_options(2, {"x"}));
+    double results[2];
+    batch.evaluate(&x, results);
+    if (results[0] != 0.33 || results[1] != 0.13) {
+        mark_failed("Wrong batch of decimal formulas", "x / 3, x * 0.125");
+        return;
+    }
+    mark_passed();
+}
+
+// the same interval on every backend, holding the results at random points within the bounds and at their ends
+static void interval_test(std::string formula, const std::vector<std::string> &variables,
+                          const std::vector<interval> &bounds, interval expected) {
+    overall_tests++;
+    std::mt19937 random(5);
+    for (const compile_options &options : all_backends(variables)) {
+        compiled_formula compiled = compile(formula, options);
+        interval result = compiled.evaluate_interval(bounds.data());
+        if (result.lower != expected.lower || result.upper != expected.upper) {
+            mark_failed("Interval [" + std::to_string(result.lower) + ", " + std::to_string(result.upper) + "]",
+                        formula);
+            return;
+        }
+        std::vector<double> values(bounds.size());
+        for (int sample = 0; sample < 1000; sample++) {
+            for (std::size_t slot = 0; slot < bounds.size(); slot++) {
+                if (sample < 2) {
+                    values[slot] = sample == 0 ? bounds[slot].lower : bounds[slot].upper;
+                } else {
+                    double lower = std::max(bounds[slot].lower, -1e6);
+                    double upper = std::min(bounds[slot].upper, 1e6);
+                    values[slot] = std::uniform_real_distribution<double>(lower, upper)(random);
+                }
+            }
+            double value = compiled.evaluate(values.data());
+            if (!std::isnan(value) && (value < result.lower || value > result.upper)) {
+                mark_failed("Result " + std::to_string(value) + " outside the interval", formula);
+                return;
+            }
+        }
+    }
+    mark_passed();
+}
+
+static void interval_error_test() {
+    overall_tests++;
+    compile_options options;
+    options.variables = {"x"};
+    compiled_formula compiled = compile("x + 1", options);
+    for (interval bounds : {interval{2, 1}, interval{NAN, 1}}) {
+        try {
+            compiled.evaluate_interval(&bounds);
+            mark_failed("Accepted an empty interval", "x + 1");
+            return;
+        } catch (const std::invalid_argument &) {
+        }
+    }
+    try {
+        interval bounds = {1, 2};
+        compile("x + 1", decimal_options(2, {"x"})).evaluate_interval(&bounds);
+        mark_failed("Interval of a decimal formula", "x + 1");
+        return;
+    } catch (const std::invalid_argument &) {
+    }
+    mark_passed();
+}
+
+static void cache_key_test(std::string first, std::string second, bool same) {
+    overall_tests++;
+    if ((formula_cache::normalize(first) == formula_cache::normalize(second)) == same) {
+        mark_passed();
+    } else {
+        mark_failed(same ? "Different cache keys" : "Same cache key", first + "' and '" + second);
+    }
+}
+
+// spacing variants share an entry, the least recently used formula is evicted first
+static void cache_test() {
+    overall_tests++;
+    formula_cache cache(2, compile_options(), 1);
+    bool correct = cache.calculate("2 * (3 + 4)") == 14 && cache.calculate("2*(3+4)") == 14
+                   && cache.calculate(" 2 *(3+ 4) ") == 14 && cache.calculate("32") == 32
+                   && cache.calculate("2*(3+4)") == 14 && cache.calculate("1 + 1") == 2;
+    if (!correct || cache.hits() != 3 || cache.misses() != 3 || cache.size() != 2) {
+        mark_failed("Wrong cache bookkeeping", "2 * (3 + 4)");
+        return;
+    }
+    cache.calculate("2 * (3 + 4)");
+    cache.calculate("32");
+    if (cache.misses() != 4 || cache.hits() != 4) {
+        mark_failed("Wrong eviction order", "32");
+        return;
+    }
+    try {
+        cache.calculate("3 2");
+        mark_failed("Missed parsing error behind the cache", "3 2");
     } catch (const parse_exception &e) {
-        if (expected_error_position == e.start_position) {
+        if (e.start_position == 2) {
             mark_passed();
         } else {
+            mark_failed("Bad parsing error position behind the cache", "3 2");
+        }
+    }
+}
+
+static void concurrent_cache_test() {
+    overall_tests++;
+    formula_cache cache(16);
+    std::vector<std::thread> threads;
+    std::vector<int> failures(4, 0);
+    for (int t = 0; t < 4; t++) {
+        threads.emplace_back([&cache, &failures, t] {
+            for (int i = 0; i < 10000; i++) {
+                int operand = (i + t) % 32 + 1;
+                if (cache.calculate(std::to_string(operand) + " + 1") != operand + 1) {
+                    failures[t]++;
+                }
+            }
+        });
+    }
+    for (std::thread &thread : threads) {
+        thread.join();
+    }
+    for (int count : failures) {
+        if (count != 0 || cache.hits() + cache.misses() != 40000) {
+            mark_failed("Wrong result on concurrent cache lookups", "n + 1");
+            return;
+        }
+    }
+    mark_passed();
+}
+
+static void mpmc_queue_test() {
+    overall_tests++;
+    mpmc_queue<int> queue(5);
+    int value = 0;
+    bool correct = queue.capacity() == 8 && !queue.try_pop(value);
+    for (int round = 0; round < 3; round++) {
+        for (int i = 0; i < 8; i++) {
+            value = round * 8 + i;
+            correct = correct && queue.try_push(value);
+        }
+        value = -1;
+        correct = correct && !queue.try_push(value) && value == -1;
+        for (int i = 0; i < 8; i++) {
+            correct = correct && queue.try_pop(value) && value == round * 8 + i;
+        }
+        correct = correct && !queue.try_pop(value);
+    }
+    if (correct) {
+        mark_passed();
+    } else {
+        mark_failed("Wrong queue order or capacity", "mpmc_queue(5)");
+    }
+}
+
+// every value pushed by some producer is popped by exactly one consumer
+static void concurrent_queue_test(int producers, int consumers, int values) {
+    overall_tests++;
+    mpmc_queue<int> queue(16);
+    std::vector<std::atomic<int>> seen(producers * values);
+    std::atomic<int> popped{0};
+    std::vector<std::thread> threads;
+    for (int p = 0; p < producers; p++) {
+        threads.emplace_back([&queue, p, values] {
+            for (int i = 0; i < values; i++) {
+                int value = p * values + i;
+                while (!queue.try_push(value)) {
+                    std::this_thread::yield();
+                }
+            }
+        });
+    }
+    for (int c = 0; c < consumers; c++) {
+        threads.emplace_back([&queue, &seen, &popped, producers, values] {
+            int value;
+            while (popped.load() < producers * values) {
+                if (queue.try_pop(value)) {
+                    seen[value]++;
+                    popped++;
+                } else {
+                    std::this_thread::yield();
+                }
+            }
+        });
+    }
+    for (std::thread &thread : threads) {
+        thread.join();
+    }
+    for (const std::atomic<int> &count : seen) {
+        if (count != 1) {
+            mark_failed("Value popped " + std::to_string(count.load()) + " times", "mpmc_queue(16)");
+            return;
+        }
+    }
+    mark_passed();
+}
+
+// A small queue makes producers wait; results must be the ones of compile() and evaluate().
+static void service_test(int producers, std::size_t queue_capacity) {
+    overall_tests++;
+    compile_options options;
+    options.variables = {"x", "y"};
+    const std::vector<std::string> formulas = {"x * y - 1", "x / (y + 0.5)", "-(x - y) * 3", "2 * 3 + x"};
+    std::vector<std::vector<std::future<double>>> futures(producers);
+    std::vector<std::vector<double>> expected(producers);
+    {
+        calculation_service service(options, 3, queue_capacity, 8, 16);
+        std::vector<std::thread> threads;
+        for (int p = 0; p < producers; p++) {
+            threads.emplace_back([&service, &options, &formulas, &futures, &expected, p] {
+                for (int i = 0; i < 500; i++) {
+                    const std::string &formula = formulas[(i + p) % formulas.size()];
+                    std::vector<double> values = {i * 0.25, p + 1.0};
+                    expected[p].push_back(compile(formula, options).evaluate(values.data()));
+                    futures[p].push_back(service.submit(formula, values));
+                }
+            });
+        }
+        for (std::thread &thread : threads) {
+            thread.join();
+        }
+        // the rest is answered before the service is gone
+    }
+    for (int p = 0; p < producers; p++) {
+        for (std::size_t i = 0; i < futures[p].size(); i++) {
+            double result = futures[p][i].get();
+            if (std::memcmp(&result, &expected[p][i], sizeof(double)) != 0) {
+                mark_failed("Wrong service result for request " + std::to_string(i), formulas[(i + p) % 4]);
+                return;
+            }
+        }
+    }
+    mark_passed();
+}
+
+static void service_error_test() {
+    overall_tests++;
+    compile_options options;
+    options.variables = {"x"};
+    calculation_service service(options, 1, 4);
+    std::future<double> invalid = service.submit("x +", {1});
+    std::optional<std::future<double>> valid = service.try_submit("x + 1", {1});
+    if (valid) {
+        // not to race for the queue below
+        valid->wait();
+    }
+    bool correct = valid.has_value() && valid->get() == 2;
+    try {
+        invalid.get();
+        correct = false;
+    } catch (const parse_exception &exception) {
+        correct = correct && exception.start_position == 3;
+    }
+    try {
+        service.submit("x", {});
+        correct = false;
+    } catch (const std::invalid_argument &) {
+    }
+    if (correct) {
+        mark_passed();
+    } else {
+        mark_failed("Wrong service error", "x +");
+    }
+}
+
+// the constexpr evaluator must give the very same bits as calculate(), or the same error position
+static bool matches_calculate(const std::string &formula) {
+    double result = 0;
+    double expected = 0;
+    long error_position = -1;
+    long expected_error_position = -1;
+    try {
+        result = constexpr_formula::calculate(formula);
+    } catch (const parse_exception &e) {
+        error_position = e.start_position;
+    }
+    try {
+        expected = calculate(formula);
+    } catch (const parse_exception &e) {
+        expected_error_position = e.start_position;
+    }
+    return error_position == expected_error_position
+           && (error_position != -1 || std::memcmp(&result, &expected, sizeof(double)) == 0);
+}
+
+static void constexpr_test(std::string formula) {
+    overall_tests++;
+    if (matches_calculate(formula)) {
+        mark_passed();
+    } else {
+        mark_failed("Constexpr evaluation differs from calculate()", formula);
+    }
+}
+
+// random decimal literals, some long enough to need all their digits for rounding
+static void constexpr_literal_test(int count) {
+    overall_tests++;
+    std::mt19937 random(7);
+    for (int i = 0; i < count; i++) {
+        std::string literal;
+        int length = 1 + random() % (i % 10 == 0 ? 400 : 25);
+        for (int digit = 0; digit < length; digit++) {
+            literal += static_cast<char>('0' + random() % 10);
+        }
+        if (i % 3 == 1) {
+            literal.insert(random() % (length + 1), ".");
+        } else if (i % 3 == 2) {
+            literal = "0." + std::string(random() % 320, '0') + literal;
+        }
+        if (!matches_calculate(literal)) {
+            mark_failed("Constexpr literal differs from calculate()", literal);
+            return;
+        }
+    }
+    mark_passed();
+}
+
+// the inlined formula must give the very same bits as the compiled one
+template<typename text>
+static void static_formula_test(int rows) {
+    overall_tests++;
+    compile_options options;
+    options.variables.assign(std::begin(text::variables), std::end(text::variables));
+    const compiled_formula compiled = compile(text::formula, options);
+    std::vector<double> values(options.variables.size());
+    for (int row = 0; row < rows; row++) {
+        for (std::size_t slot = 0; slot < values.size(); slot++) {
+            values[slot] = (row * 7 + slot * 13) % 97 / 4.0 - 10;
+        }
+        double result = static_formula<text>::evaluate(values.data());
+        double expected = compiled.evaluate(values.data());
+        if (std::memcmp(&result, &expected, sizeof(double)) != 0) {
+            mark_failed("Static formula differs from compile() in row " + std::to_string(row), std::string(text::formula));
+            return;
+        }
+    }
+    mark_passed();
+}
+
+static void constant_static_formula_test() {
+    overall_tests++;
+    if (static_formula<constant_text>::evaluate(nullptr) == calculate(constant_text::formula)) {
+        mark_passed();
+    } else {
+        mark_failed("Static formula differs from calculate()", std::string(constant_text::formula));
+    }
+}
+
+static void token_count_test(std::string formula, std::size_t expected_count) {
+    overall_tests++;
+    std::size_t count = count_tokens(formula);
+    if (count == expected_count) {
+        mark_passed();
+    } else {
+        mark_failed("Wrong token count: got " + std::to_string(count), formula);
+    }
+}
+
+// after every tick of random changes the kept value must be what a full evaluation gives
+static void incremental_test(std::string formula, const std::vector<std::string> &variables, int ticks) {
+    overall_tests++;
+    std::mt19937 random(3);
+    std::uniform_int_distribution<int> slots(0, variables.size() - 1);
+    std::uniform_real_distribution<double> numbers(-10, 10);
+    for (const compile_options &options : all_backends(variables)) {
+        if (options.backend == evaluation_backend::flat) {
+            continue;
+        }
+        const compiled_formula compiled = compile(formula, options);
+        std::vector<double> values(variables.size());
+        for (double &value : values) {
+            value = numbers(random);
+        }
+        incremental_formula incremental(compiled, values.data());
+        for (int tick = 0; tick < ticks; tick++) {
+            double result;
+            if (tick % 2 == 0) {
+                int slot = slots(random);
+                values[slot] = numbers(random);
+                result = incremental.update(slot, values[slot]);
+            } else {
+                int changed[] = {slots(random), slots(random)};
+                values[changed[0]] = numbers(random);
+                values[changed[1]] = numbers(random);
+                result = incremental.update(changed, 2, values.data());
+            }
+            double expected = compiled.evaluate(values.data());
+            if (std::memcmp(&result, &expected, sizeof(double)) != 0 || incremental.value() != result) {
+                mark_failed("Incremental result differs in tick " + std::to_string(tick), formula);
+                return;
+            }
+        }
+    }
+    mark_passed();
+}
+
+// without CALCULATOR_STATS nothing may be recorded
+static void stats_test() {
+    overall_tests++;
+    reset_aggregated_stats();
+    engine_stats stats;
+    compile_options options;
+    options.stats = &stats;
+    compile("-(1 + 2) * (3)", options).evaluate();
+    try {
+        compile("1 +", options);
+    } catch (const parse_exception &) {
+    }
+    engine_stats totals = aggregated_stats();
+
+    bool correct;
+    if (stats_enabled()) {
+        correct = stats.formulas == 1 && stats.failures == 1 && stats.tokens == 10 && stats.parsed_nodes == 8
+                  && stats.optimized_nodes == 1 && stats.instructions == 1 && stats.max_depth == 2
+                  && stats.allocations == 1 && stats.evaluations == 0
+                  && totals.formulas == 1 && totals.failures == 1 && totals.evaluations == 1;
+    } else {
+        correct = stats.formulas == 0 && stats.failures == 0 && totals.formulas == 0 && totals.evaluations == 0;
+    }
+    if (correct) {
+        mark_passed();
+    } else {
+        mark_failed("Wrong stats", "-(1 + 2) * (3)");
+    }
+}
+
+static void unbound_variables_test(std::string formula) {
+    overall_tests++;
+    compile_options options;
+    options.variables = {"x"};
+    try {
+        compile(formula, options).evaluate();
+        mark_failed("Missed unbound variables error", formula);
+    } catch (const std::invalid_argument &) {
+        mark_passed();
+    }
+}
+
+// right-leaning sum of `operands` ones, needs a deep value stack
+static std::string right_chain(int operands) {
+    std::string formula;
+    for (int i = 1; i < operands; i++) {
+        formula += "1+(";
+    }
+    return formula + "1" + std::string(operands - 1, ')');
+}
+
+// "x + (x + (... a * b ...)) - a * b", first computing a * b deep down the stack
+static std::string shared_chain(int depth) {
+    std::string formula;
+    for (int i = 0; i < depth; i++) {
+        formula += "x + (";
+    }
+    return formula + "a * b" + std::string(depth, ')') + " - a * b";
+}
+
+static void concurrent_test(std::string formula, double expected_result) {
+    overall_tests++;
+    const compiled_formula compiled = compile(formula);
+    std::vector<std::thread> threads;
+    std::vector<int> failures(4, 0);
+    for (int t = 0; t < 4; t++) {
+        threads.emplace_back([&compiled, &failures, expected_result, t] {
+            for (int i = 0; i < 10000; i++) {
+                if (compiled.evaluate() != expected_result) {
+                    failures[t]++;
+                }
+            }
+        });
+    }
+    for (std::thread &thread : threads) {
+        thread.join();
+    }
+    for (int count : failures) {
+        if (count != 0) {
+            mark_failed("Wrong result on concurrent evaluation", formula);
+            return;
+        }
+    }
+    mark_passed();
+}
+
+// compiles a long left-leaning chain and drops it without evaluating
+static void release_test(int operands) {
+    overall_tests++;
+    std::string formula = "1";
+    for (int i = 1; i < operands; i++) {
+        formula += "+1";
+    }
+    {
+        compiled_formula compiled = compile(formula);
+    }
+    mark_passed();
+}
+
+static void parse_error_test(std::string formula, int expected_error_position,
+                             const std::vector<std::string> &variables = {}) {
+    overall_tests++;
+    try {
+        compile_options options;
+        options.variables = variables;
+        compile(formula, options);
+        mark_failed("Missed parsing error", formula);
+    } catch (const parse_exception &e) {
+        compile_options options;
+        options.variables = variables;
+        parse_result<compiled_formula> result = try_compile(formula, options);
+        if (expected_error_position != e.start_position) {
             std::string error = "Bad parsing error position: expected " + std::to_string(expected_error_position)
                     + ", got " + std::to_string(e.start_position);
             mark_failed(error, formula);
+        } else if (result || result.position != e.start_position || e.message != parse_error_message(result.error)) {
+            mark_failed("Non-throwing compile reports another error", formula);
+        } else {
+            mark_passed();
         }
     }
 }
 
+// `symbol` in place of each space of a formula long enough for every lane of the symbol registers, alone and
+// after an unknown name at the start, which is reported first
+static void invalid_symbol_test(char symbol) {
+    overall_tests++;
+    compile_options options;
+    options.variables = {"x_1"};
+    std::string formula = "  ";
+    for (int i = 0; i < 8; i++) {
+        formula += "x_1 + 12.5 *   (x_1) /  ";
+    }
+    formula += "x_1";
+    for (std::size_t position = 0; position < formula.size(); position++) {
+        if (formula[position] != ' ') {
+            continue;
+        }
+        std::string broken = formula;
+        broken[position] = symbol;
+        parse_result<compiled_formula> result = try_compile(broken, options);
+        if (result.error != parse_error::unexpected_symbol || result.position != position) {
+            mark_failed("Wrong error " + std::string(parse_error_message(result.error)) + " at "
+                        + std::to_string(result.position) + " instead of " + std::to_string(position), broken);
+            return;
+        }
+        if (position > 0) {
+            broken[0] = 'y';
+            parse_result<compiled_formula> earlier = try_compile(broken, options);
+            if (earlier.error != parse_error::unknown_variable || earlier.position != 0) {
+                mark_failed("Invalid symbol reported before the unknown name", broken);
+                return;
+            }
+        }
+    }
+    mark_passed();
+}
+
+static void error_code_test(std::string formula, parse_error expected_error, std::size_t expected_position) {
+    overall_tests++;
+    parse_result<double> result = try_calculate(formula);
+    if (result.error == expected_error && result.position == expected_position && !result) {
+        mark_passed();
+    } else {
+        mark_failed("Wrong error " + std::string(parse_error_message(result.error)) + " at "
+                    + std::to_string(result.position), formula);
+    }
+}
+
+static void try_calculate_test(std::string formula, double expected_result) {
+    overall_tests++;
+    parse_result<double> result = try_calculate(formula);
+    if (result && result.error == parse_error::none && result.value() == expected_result) {
+        mark_passed();
+    } else {
+        mark_failed("Wrong non-throwing result", formula);
+    }
+}
+
+// Random operators, negations, parentheses, names and literals, some of hundreds of digits. Parentheses
+// open for a while, so that many pairs span megabytes.
+static std::string random_formula(std::mt19937 &random, std::size_t length) {
+    static const char *const names[] = {"alpha", "beta_2", "x"};
+    std::string formula;
+    int open = 0;
+    while (formula.size() < length) {
+        switch (random() % 8) {
+            case 0:
+                formula += "(";
+                open++;
+                continue;
+            case 1:
+                formula += "-";
+                continue;
+            case 2:
+            case 3:
+                formula += names[random() % 3];
+                break;
+            default: {
+                int digits = 1 + random() % (random() % 10 == 0 ? 400 : 6);
+                std::string literal(1, static_cast<char>('1' + random() % 9));
+                for (int i = 1; i < digits; i++) {
+                    literal += static_cast<char>('0' + random() % 10);
+                }
+                // in the range of a double
+                if (digits > 300 || random() % 2 == 0) {
+                    literal.insert(random() % std::min(digits, 300), ".");
+                }
+                formula += literal;
+                break;
+            }
+        }
+        while (open > 0 && random() % 3 == 0) {
+            formula += ")";
+            open--;
+        }
+        formula += " +-*/+-"[1 + random() % 6];
+    }
+    return formula + "1" + std::string(open, ')');
+}
+
+// The formula is long enough to be parsed in parallel. Its results, or its error, must be those of the
+// sequential parser: the trees are the same.
+static void parallel_parse_test(const std::string &formula, thread_pool &pool) {
+    overall_tests++;
+    const double values[] = {1.5, -0.75, 3};
+    for (bool optimize : {false, true}) {
+        compile_options options;
+        options.variables = {"alpha", "beta_2", "x"};
+        options.optimize = optimize;
+        parse_result<compiled_formula> expected = try_compile(formula, options);
+        options.parse_pool = &pool;
+        parse_result<compiled_formula> result = try_compile(formula, options);
+        if (result.error != expected.error || result.position != expected.position) {
+            mark_failed("Parallel parsing reported " + std::string(parse_error_message(result.error)) + " at "
+                        + std::to_string(result.position) + " instead of "
+                        + parse_error_message(expected.error) + " at " + std::to_string(expected.position),
+                        formula.substr(0, 60) + "...");
+            return;
+        }
+        if (expected) {
+            double expected_value = expected.value().evaluate(values);
+            double value = result.value().evaluate(values);
+            if (std::memcmp(&value, &expected_value, sizeof(value)) != 0) {
+                mark_failed("Parallel parsing built another tree", formula.substr(0, 60) + "...");
+                return;
+            }
+        }
+    }
+    mark_passed();
+}
+
+// the same with `text` inserted after the first operator from `position` on
+static void parallel_error_test(std::string formula, std::size_t position, const std::string &text,
+                                thread_pool &pool) {
+    formula.insert(formula.find_first_of("+-*/", position) + 1, text);
+    parallel_parse_test(formula, pool);
+}
+
+// The flat backend reports the errors of the tree backend, at the same positions, and computes the same bits
+static void flat_test(const std::string &formula) {
+    overall_tests++;
+    const double values[] = {1.5, -0.75, 3};
+    for (bool optimize : {false, true}) {
+        compile_options options;
+        options.variables = {"alpha", "beta_2", "x"};
+        options.optimize = optimize;
+        options.backend = evaluation_backend::tree;
+        parse_result<compiled_formula> expected = try_compile(formula, options);
+        options.backend = evaluation_backend::flat;
+        parse_result<compiled_formula> result = try_compile(formula, options);
+        if (result.error != expected.error || result.position != expected.position) {
+            mark_failed("Flat parsing reported " + std::string(parse_error_message(result.error)) + " at "
+                        + std::to_string(result.position) + " instead of "
+                        + parse_error_message(expected.error) + " at " + std::to_string(expected.position),
+                        formula.substr(0, 60));
+            return;
+        }
+        if (expected) {
+            double expected_value = expected.value().evaluate(values);
+            double value = result.value().evaluate(values);
+            if (std::memcmp(&value, &expected_value, sizeof(value)) != 0) {
+                mark_failed("Flat tree computed another result", formula.substr(0, 60));
+                return;
+            }
+        }
+    }
+    mark_passed();
+}
+
+// a flat tree has no parentheses and no arena, and cannot be updated incrementally
+static void flat_backend_test() {
+    overall_tests++;
+    engine_stats stats;
+    compile_options options;
+    options.backend = evaluation_backend::flat;
+    options.stats = &stats;
+    compile("-(1 + 2) * (3)", options);
+    if (stats_enabled() && (stats.parsed_nodes != 6 || stats.optimized_nodes != 1 || stats.tokens != 10
+                            || stats.max_depth != 2 || stats.allocated_bytes > 16 * 10)) {
+        mark_failed("Wrong flat stats", "-(1 + 2) * (3)");
+        return;
+    }
+    options.stats = nullptr;
+    options.variables = {"x"};
+    double x = 2;
+    try {
+        incremental_formula incremental(compile("x * 3", options), &x);
+        mark_failed("Updated a flat formula incrementally", "x * 3");
+        return;
+    } catch (const std::invalid_argument &) {
+    }
+    mark_passed();
+}
+
+// the formula breaks max_depth or max_length, which are 0 when not tested
+static void limit_test(std::string formula, int max_depth, std::size_t max_length, int expected_error_position) {
+    overall_tests++;
+    try {
+        compile_options options;
+        options.max_depth = max_depth;
+        options.max_length = max_length;
+        compile(formula, options);
+        mark_failed("Missed limit error", formula);
+    } catch (const parse_exception &e) {
+        compile_options options;
+        options.max_depth = max_depth;
+        options.max_length = max_length;
+        parse_result<compiled_formula> result = try_compile(formula, options);
+        parse_error expected_error = max_length != 0 && formula.size() > max_length
+                                     ? parse_error::formula_too_long : parse_error::too_deeply_nested;
+        if (expected_error_position != e.start_position) {
+            mark_failed("Bad limit error position: got " + std::to_string(e.start_position), formula);
+        } else if (result.error != expected_error || result.position != e.start_position) {
+            mark_failed("Non-throwing compile reports another limit error", formula);
+        } else {
+            mark_passed();
+        }
+    }
+}
+
+// Formulas of more than max_tokens tokens fail at the first token too many, with or without a parse pool,
+// and what comes before it is within the limit.
+static void token_limit_test(const std::string &formula, std::size_t max_tokens, std::size_t expected_position) {
+    overall_tests++;
+    thread_pool pool(4);
+    for (thread_pool *parse_pool : {static_cast<thread_pool *>(nullptr), &pool}) {
+        compile_options options;
+        options.max_tokens = max_tokens;
+        options.parse_pool = parse_pool;
+        parse_result<compiled_formula> result = try_compile(formula, options);
+        if (result.error != parse_error::formula_too_long || result.position != expected_position) {
+            mark_failed("Wrong error " + std::string(parse_error_message(result.error)) + " at "
+                        + std::to_string(result.position), formula.substr(0, 100));
+            return;
+        }
+    }
+    compile_options options;
+    options.max_tokens = max_tokens;
+    if (try_compile(formula.substr(0, expected_position), options).error == parse_error::formula_too_long) {
+        mark_failed("Limit error within the limit", formula.substr(0, 100));
+        return;
+    }
+    mark_passed();
+}
+
+// Runs `command` in a shell, with $input naming a file that holds `input`, and compares what ./calc
+// prints on stdout and stderr together, and its exit status.
+static void calc_test(const std::string &command, const std::string &input, const std::string &expected_output,
+                      int expected_status) {
+    overall_tests++;
+    char pattern[] = "/tmp/calc-test-XXXXXX";
+    if (mkdtemp(pattern) == nullptr) {
+        mark_failed("No temporary directory", command);
+        return;
+    }
+    const std::string directory = pattern;
+    std::ofstream(directory + "/input", std::ios::binary) << input;
+    int status = std::system(("input=" + directory + "/input; " + command + " > " + directory + "/output 2>&1")
+                                     .c_str());
+    std::stringstream output;
+    output << std::ifstream(directory + "/output", std::ios::binary).rdbuf();
+    std::system(("rm -rf " + directory).c_str());
+    if (status == -1 || !WIFEXITED(status) || WEXITSTATUS(status) != expected_status) {
+        mark_failed("Wrong exit status " + std::to_string(status), command);
+    } else if (output.str() != expected_output) {
+        mark_failed("Wrong output " + output.str(), command);
+    } else {
+        mark_passed();
+    }
+}
+
 static void run_tests() {
     success_test("5", 5);
+    success_test("1." + std::string(70, '0') + "25 * " + std::string(66, '0') + "2", 2);
+    try_calculate_test("2 * (3 + 4)", 14);
+    try_calculate_test("-(0.5)", -0.5);
+    error_code_test("", parse_error::empty_input, 0);
+    error_code_test("2 +", parse_error::unexpected_end, 3);
+    error_code_test("2 * ()", parse_error::empty_parentheses, 4);
+    error_code_test("(-)", parse_error::orphan_minus, 1);
+    error_code_test("2 * * 3", parse_error::unexpected_token, 4);
+    error_code_test("(2)(3)", parse_error::operator_needed, 3);
+    error_code_test("1.2.3", parse_error::invalid_number, 0);
+    error_code_test("1e400", parse_error::unknown_variable, 1);
+    error_code_test("2 % 3", parse_error::unexpected_symbol, 2);
+    error_code_test("2 * 1" + std::string(400, '0'), parse_error::number_too_long, 4);
+    error_code_test("x + 1", parse_error::unknown_variable, 0);
+    error_code_test("1 + 2)", parse_error::unmatched_closing_parenthesis, 5);
+    error_code_test("1 + (2 * (3)", parse_error::unclosed_parenthesis, 4);
     success_test("-5", -5);
 
     success_test("2 + 3", 5);
@@ -71,8 +1387,156 @@ static void run_tests() {
     success_test("2 * (3 * ((3 + 1) + 1) + 2)", 34);
     success_test("2 * (3 + ((3 + 1) + 1) * 2)", 26);
 
+    success_test(std::string(1000, '(') + "4" + std::string(1000, ')'), 4);
+
     success_test("7 + (((5 * 2) + 5) / (2 + 3) + 1) / 2 - 1", 8);
 
+    success_test("1.5 * .5", 0.75);
+    success_test("12345678901234567890", 12345678901234567890.0);
+    token_count_test("-(1.5 + 2) * 3", 8);
+    token_count_test("  ", 0);
+    buffer_test("2 + 3 * 4", 5, 5);
+    buffer_test("(7)(", 3, 7);
+
+    compiled_test("2 * 3 + 4", 10);
+    compiled_test("7 + (((5 * 2) + 5) / (2 + 3) + 1) / 2 - 1", 8);
+    compiled_test("-(2 - -3) * -2", 10);
+    compiled_test(right_chain(1000), 1000);
+    compiled_test("--5", 5);
+    compiled_test("-(-(2 * 3))", 6);
+    compiled_test("5 - (2 - 2) * 1 / 1", 5);
+    compiled_test("0.1 + 0.2 - 0.3", 0.1 + 0.2 - 0.3);
+    release_test(1000000);
+    compiled_test(std::string(1000000, '(') + "4" + std::string(1000000, ')'), 4);
+    compiled_test(std::string(1000001, '-') + "4", -4);
+    compiled_test("2 * " + std::string(100000, '-') + "(" + right_chain(100000) + ")", 200000);
+    concurrent_test("2 * (3 + ((3 + 1) + 1) * 2)", 26);
+
+    variable_test("x", {"x"}, {3}, 3);
+    variable_test("price * qty - discount", {"price", "qty", "discount"}, {2.5, 4, 1}, 9);
+    variable_test("price * qty - discount", {"discount", "qty", "price"}, {1, 4, 2.5}, 9);
+    variable_test("2 * 3 * x + (4 - 1) * y", {"x", "y"}, {0.5, 2}, 9);
+    variable_test("--x * 1 / 1", {"x"}, {7}, 7);
+    variable_test("-(a_1 + B2) / (a_1 - B2)", {"a_1", "B2", "unused"}, {3, 1, 100}, -2);
+    variable_test("x + (" + right_chain(40) + ") * y", {"x", "y"}, {2, -1}, -38);
+    variable_test("a / b - b / a * -(a - b * (a + b * (a - b)))", {"a", "b"}, {3, 2}, 3.0 / 2 - 2.0 / 3 * -(3 - 2 * (3 + 2 * (3 - 2))));
+    variable_test("(a + b) * (a + b) / (a + b)", {"a", "b"}, {3, 1}, 4);
+    variable_test("-(x * 2) - -(x * 2) + x * 2 / (x * 2)", {"x"}, {5}, 1);
+    signed_zero_test("x - -(1 - 1)");
+    signed_zero_test("x - (1 - 1) * -1");
+    signed_zero_test("x - (1 - 1)");
+    signed_zero_test("-x - (2 - 2)");
+    variable_test(shared_chain(20), {"x", "a", "b"}, {1, 2, 3}, 20);
+    compile_batch_test({"(a + b) * c", "c * (a + b) - (a + b)", "a", "2 * 3", "-(a + b) * (a + b)"},
+                       {"a", "b", "c"}, {1.5, -4, 0.25});
+    compile_batch_test({shared_chain(30), "x + a * b", "a * b / (x - 1)"}, {"x", "a", "b"}, {1, -0.5, 3});
+    compile_batch_test({}, {}, {});
+    image_test({"(a + b) * c", "c * (a + b) - (a + b)", "a", "2 * 3", "-(-c) / -(a + b) * (a + b)"}, {"a", "b", "c"});
+    image_test({shared_chain(30), right_chain(2000), "x / 3.3 - 0.000001 * a"}, {"x", "a", "b"});
+    image_test({}, {});
+    image_variables_test();
+    damaged_image_test();
+    decimal_test("0.1 + 0.2", {}, {}, 2, "0.30");
+    decimal_test("0.1 + 0.2 - 0.3", {}, {}, 18, "0.000000000000000000");
+    decimal_test("1 / 3", {}, {}, 6, "0.333333");
+    decimal_test("2 / 3", {}, {}, 6, "0.666667");
+    decimal_test("1 / 3 * 3", {}, {}, 6, "0.999999");
+    decimal_test("2.675 * 1", {}, {}, 2, "2.68");
+    decimal_test("1 / 8", {}, {}, 2, "0.13");
+    decimal_test("-1 / 8", {}, {}, 2, "-0.13");
+    decimal_test("7 / 2", {}, {}, 0, "4");
+    decimal_test("-7 / 2", {}, {}, 0, "-4");
+    decimal_test("price * qty - discount", {"price", "qty", "discount"}, {19.99, 3, 0.07}, 2, "59.90");
+    decimal_test("x * 0.001", {"x"}, {1.005}, 3, "0.001");
+    decimal_test("x / 7 * 7", {"x"}, {1000000000000}, 4, "1000000000000.0003");
+    decimal_test("1 / 3", {}, {}, 18, "0.333333333333333333");
+    decimal_test("x - 0.000000000000000001", {"x"}, {9}, 18, "8.999999999999999999");
+    decimal_test("x", {"x"}, {0.0000001}, 6, "0.000000");
+    decimal_test("-(x * 2) - -(x * 2) + x * 2 / (x * 2)", {"x"}, {5}, 6, "1.000000");
+    decimal_test(right_chain(2000), {}, {}, 2, "2000.00");
+    decimal_error_test<std::domain_error>("x / (x - 1)", {"x"}, {1}, 6, "Division by zero");
+    decimal_error_test<std::domain_error>("x + 1", {"x"}, {NAN}, 6, "Not a finite number");
+    decimal_error_test<std::overflow_error>("x * x", {"x"}, {10000000}, 6, "Decimal overflow");
+    decimal_error_test<std::overflow_error>("x + x", {"x"}, {5}, 18, "Decimal overflow");
+    decimal_error_test<std::overflow_error>("1 / x", {"x"}, {0.000000000000000001}, 18, "Decimal overflow");
+    decimal_error_test<std::overflow_error>("x", {"x"}, {1e300}, 0, "Decimal overflow");
+    decimal_error_test<parse_exception>("1", {}, {}, 19, "Decimal places must be from 0 to 18");
+    decimal_parse_error_test("1", 19, parse_error::invalid_decimal_places, 0);
+    decimal_parse_error_test("1", -1, parse_error::invalid_decimal_places, 0);
+    decimal_parse_error_test("1 + 10000000000000", 6, parse_error::number_too_long, 4);
+    decimal_parse_error_test("1 + 0.5 * 10000000000000000000", 0, parse_error::number_too_long, 10);
+    decimal_image_error_test("x + 10000000000000", 6, "Constant out of the decimal range");
+    decimal_image_error_test("x * (1" + std::string(308, '0') + " * 10)", 0, "Constant out of the decimal range");
+    decimal_image_error_test("x", 19, "Decimal places must be from 0 to 18");
+    decimal_backend_test();
+    interval_test("price * qty - discount", {"price", "qty", "discount"}, {{10, 20}, {1, 5}, {0, 3}}, {7, 100});
+    interval_test("-x / 2 + 1", {"x"}, {{-4, 6}}, {-2, 3});
+    interval_test("a * b", {"a", "b"}, {{-2, 3}, {-5, 4}}, {-15, 12});
+    interval_test("x * x", {"x"}, {{-1, 1}}, {-1, 1});
+    interval_test("1 / x", {"x"}, {{0.5, 4}}, {0.25, 2});
+    interval_test("1 / x", {"x"}, {{-1, 4}}, {-INFINITY, INFINITY});
+    interval_test("1 / (x - 2)", {"x"}, {{1, 2}}, {-INFINITY, INFINITY});
+    interval_test("x - x", {"x"}, {{0, 1}}, {-1, 1});
+    interval_test("x * 0.1 + y * 0.2", {"x", "y"}, {{1, 1}, {1, 1}}, {0.1 + 0.2, 0.1 + 0.2});
+    interval_test("x * 2", {"x"}, {{-INFINITY, 1}}, {-INFINITY, 2});
+    interval_test("x * y", {"x", "y"}, {{0, 1}, {1, INFINITY}}, {-INFINITY, INFINITY});
+    interval_test("(a + b) * (a + b) - -(a + b)", {"a", "b"}, {{1, 2}, {0, 1}}, {2, 12});
+    interval_test("2 * (3 + 4)", {}, {}, {14, 14});
+    interval_test(shared_chain(20), {"x", "a", "b"}, {{0, 1}, {1, 2}, {-1, 1}}, {-4, 24});
+    interval_error_test();
+    unbound_variables_test("x + 1");
+    stats_test();
+    incremental_test("a * b + c / (a - d) - -(b * e) * (c + (d - 1) * e)", {"a", "b", "c", "d", "e"}, 200);
+    incremental_test("x * x - x / 2", {"x"}, 50);
+    incremental_test("(a + b) * (a + b) / (a + b) - (b - c)", {"a", "b", "c", "unused"}, 100);
+
+    batch_test("price * qty - discount", {"price", "qty", "discount"}, 1000);
+    batch_test("x * x - 1", {"x"}, 100000);
+    batch_test("-(a + b) / (a - b * 0.1) + -a", {"a", "b"}, 257);
+    batch_test("x / 3 - 2", {"x"}, 3);
+    batch_test("(a + b) * (a + b) / (a + b) - (a + b)", {"a", "b"}, 1000);
+    batch_test(shared_chain(40), {"x", "a", "b"}, 600);
+    batch_test("x", {"x"}, 0);
+    batch_test("2 * (3 + 4)", {}, 5);
+    batch_test("x + (" + right_chain(100000) + ")", {"x"}, 300);
+    parallel_for_test(1, 10);
+    parallel_for_test(4, 1);
+    parallel_for_test(4, 1000);
+    parallel_for_test(7, 0);
+    concurrent_parallel_for_test(4, 100);
+    throwing_parallel_for_test(20000);
+    evaluate_all_test(1000);
+    constexpr_test("7 + (((5 * 2) + 5) / (2 + 3) + 1) / 2 - 1");
+    constexpr_test("2 - 3 * 4 - 5 / 8 / 2");
+    constexpr_test("--5 * -(-(2 * 3))");
+    constexpr_test("1 / (1 - 1)");
+    constexpr_test("12345678901234567890 * 0.000000001");
+    constexpr_test(std::string(200, '(') + "4" + std::string(200, ')'));
+    constexpr_test("(-5)(4)");
+    constexpr_test("1 + ((2) * (3)");
+    constexpr_test("(2 *)");
+    constexpr_test("2 +");
+    constexpr_test("(-)");
+    constexpr_test("3 + x");
+    constexpr_test("3.3.3 + 0");
+    constexpr_test(std::string(500, '3'));
+    constexpr_literal_test(20000);
+    static_formula_test<pricing_text>(1000);
+    static_formula_test<chain_text>(1000);
+    static_formula_test<product_text>(100);
+    constant_static_formula_test();
+    cache_key_test("1 + 2", "1+2", true);
+    cache_key_test(" (1) * x ", "(1)*x", true);
+    cache_key_test("3 2", "32", false);
+    cache_key_test("x y", "x  y", true);
+    cache_test();
+    concurrent_cache_test();
+    mpmc_queue_test();
+    concurrent_queue_test(3, 2, 20000);
+    service_test(1, 1024);
+    service_test(4, 2);
+    service_error_test();
+
     parse_error_test("", 0);
     parse_error_test("-", 0);
     parse_error_test("*", 0);
@@ -88,9 +1552,91 @@ static void run_tests() {
     parse_error_test("((5) - 1", 0);
     parse_error_test("(-)", 1);
     parse_error_test("(*)", 1);
+    parse_error_test("2 +", 3);
+    parse_error_test("(2 *)", 4);
     parse_error_test("()", 0);
+    parse_error_test(")(", 0);
+    parse_error_test("(1))(", 3);
+    parse_error_test("1 + ((2) * (3)", 4);
     parse_error_test(std::string(500, '3'), 0);
     parse_error_test("3.3.3", 0);
+    parse_error_test("1 + .", 4);
+    parse_error_test("(((", 0);
+    parse_error_test("(()(", 0);
+    parse_error_test("(1) + (", 6);
+    parse_error_test("x + y", 4, {"x"});
+    parse_error_test("x + xy", 4, {"x", "y"});
+    parse_error_test("2x", 1, {"x"});
+    parse_error_test("x y", 2, {"x", "y"});
+    parse_error_test(std::string(100, 'v') + " + " + std::string(99, 'v'), 103, {std::string(100, 'v')});
+    parse_error_test(std::string(100, 'v') + "w", 0, {std::string(100, 'v')});
+    parse_error_test("1 +" + std::string(70, ' ') + "2.5.", 73);
+    parse_error_test("1 +" + std::string(70, ' ') + "2 ,", 75);
+    invalid_symbol_test('?');
+    invalid_symbol_test(',');
+    invalid_symbol_test('\t');
+    invalid_symbol_test('\0');
+    invalid_symbol_test('\x80');
+    invalid_symbol_test('\xdf');
+    limit_test("((1))", 1, 0, 1);
+    limit_test("-(-1)", 2, 0, 2);
+    limit_test("(1) + (--1)", 2, 0, 8);
+    limit_test("1 + 2", 0, 4, 4);
+    limit_test(std::string(1000000, '('), 1000, 1000, 1000);
+    // long enough to be parsed in parallel when within the limit
+    std::string sum = "1";
+    for (int i = 0; i < 150000; i++) {
+        sum += "  +  1";
+    }
+    token_limit_test(sum, 3, 9);
+    token_limit_test(sum, 120000, 360000);
+    token_limit_test("(1) * 2", 4, 6);
+
+    calc_test("echo '2 * (3 + 4)' | ./calc", "", "14\n", 0);
+    calc_test("./calc --stream < $input", "1 + 2\n3 * 4\n", "3\n12\n", 0);
+    calc_test("cat $input | ./calc --stream", "1 + 2\n2 +\n\n(1)(2)\r\n4 / 2",
+              "3\nerror at 3: Unexpected end of input\nerror at 0: Empty input\n"
+              "error at 3: Unexpected token: operator needed\n2\n", 1);
+    calc_test("cat $input | ./calc --stream", "", "", 0);
+    calc_test("./calc --stream $input", "0.5 * 4\r\n1 ? 2\n", "2\nerror at 2: Unexpected symbol\n", 1);
+    calc_test("./calc --file $input", "1 + 2", "3\n", 0);
+    calc_test("./calc --file $input", "(1 + 2) * 3\r\n\n", "9\n", 0);
+    calc_test("./calc --file $input", "", "Invalid input at offset 0:\nEmpty input\n", 1);
+    calc_test("./calc --file $input", "2 *\n", "Invalid input at offset 3:\nUnexpected end of input\n", 1);
+    calc_test("./calc --file /nonexistent/formula", "", "Cannot open /nonexistent/formula\n", 1);
+    // a pipe cannot be mapped, so it is read through the stream fallback
+    calc_test("mkfifo $input.fifo && (cat $input > $input.fifo &) && ./calc --file $input.fifo", "4 / 8", "0.5\n", 0);
+    calc_test("mkfifo $input.fifo && (cat $input > $input.fifo &) && ./calc --stream $input.fifo", "1 - 3\n-\n",
+              "-2\nerror at 0: Orphan minus\n", 1);
+
+    thread_pool parse_pool(4);
+    std::mt19937 random(25);
+    for (int i = 0; i < 20; i++) {
+        std::string formula = random_formula(random, 2000);
+        flat_test(formula);
+        flat_test(formula.substr(0, formula.size() / 2));
+        flat_test(formula.insert(random() % formula.size(), i % 2 == 0 ? "(" : "* *"));
+    }
+    flat_test("x * 1 - 0 + - -alpha / 1 * (1 * beta_2)");
+    flat_test("-(-(-(x)))");
+    flat_test("2 * (3 - 0.5) / -4");
+    flat_backend_test();
+    std::string large = random_formula(random, 3 << 20);
+    parallel_parse_test(large, parse_pool);
+    parallel_parse_test("-(" + large + ")", parse_pool);
+    parallel_parse_test("x * (" + large + ") / (" + large + ") - alpha", parse_pool);
+    parallel_parse_test("1." + std::string(400000, '0') + "1 * x + " + large, parse_pool);
+    parallel_parse_test("2 + 0." + std::string(400000, '0') + "1 * x + " + large, parse_pool);
+    parallel_parse_test(large + " +", parse_pool);
+    parallel_parse_test(large + ")", parse_pool);
+    parallel_parse_test("(" + large, parse_pool);
+    parallel_parse_test(large + "()", parse_pool);
+    parallel_error_test(large, large.size() / 3, ")", parse_pool);
+    parallel_error_test(large, large.size() / 2, "(", parse_pool);
+    parallel_error_test(large, large.size() / 16 * 5, "?", parse_pool);
+    parallel_error_test(large, large.size() / 16 * 9 - 1, "q", parse_pool);
+    parallel_error_test(large, large.size() / 16 * 11, "1.2.3", parse_pool);
+    parallel_error_test(large, large.size() - 100, "* 2", parse_pool);
 }
 
 int main() {
@@ -0,0 +1,132 @@
+#include <algorithm>
+#include <stdexcept>
+
+#include "thread_pool.h"
+
+static std::uint64_t pack(std::uint64_t begin, std::uint64_t end) {
+    return begin << 32 | end;
+}
+
+static std::uint64_t range_begin(std::uint64_t range) {
+    return range >> 32;
+}
+
+static std::uint64_t range_end(std::uint64_t range) {
+    return range & 0xffffffff;
+}
+
+thread_pool::thread_pool(int threads)
+        : worker_count(std::max(threads, 1)), ranges(new chunk_range[std::max(threads, 1)]) {
+    for (int worker = 1; worker < worker_count; worker++) {
+        this->threads.emplace_back(&thread_pool::thread_loop, this, worker);
+    }
+}
+
+thread_pool::~thread_pool() {
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        stopping = true;
+    }
+    wake.notify_all();
+    for (std::thread &thread : threads) {
+        thread.join();
+    }
+}
+
+void thread_pool::parallel_for(std::size_t chunks, const std::function<void(std::size_t)> &body) {
+    if (chunks == 0) {
+        return;
+    }
+    if (chunks > 0xffffffff) {
+        throw std::length_error("Too many chunks");
+    }
+    std::lock_guard<std::mutex> caller_lock(caller_mutex);
+
+    for (int worker = 0; worker < worker_count; worker++) {
+        ranges[worker].range.store(pack(chunks * worker / worker_count, chunks * (worker + 1) / worker_count));
+    }
+
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        job = &body;
+        generation++;
+        busy_threads = worker_count - 1;
+        failure = nullptr;
+        cancelled.store(false);
+    }
+    wake.notify_all();
+
+    work(0, body);
+
+    std::unique_lock<std::mutex> lock(mutex);
+    finished.wait(lock, [this] { return busy_threads == 0; });
+    job = nullptr;
+    if (failure) {
+        std::rethrow_exception(failure);
+    }
+}
+
+void thread_pool::thread_loop(int worker) {
+    std::uint64_t seen_generation = 0;
+    std::unique_lock<std::mutex> lock(mutex);
+    for (;;) {
+        wake.wait(lock, [this, seen_generation] { return stopping || generation != seen_generation; });
+        if (stopping) {
+            return;
+        }
+        seen_generation = generation;
+        const std::function<void(std::size_t)> &body = *job;
+
+        lock.unlock();
+        work(worker, body);
+        lock.lock();
+
+        if (--busy_threads == 0) {
+            finished.notify_one();
+        }
+    }
+}
+
+void thread_pool::work(int worker, const std::function<void(std::size_t)> &body) {
+    try {
+        std::size_t chunk;
+        while (!cancelled.load() && (take_own(worker, chunk) || (steal(worker) && take_own(worker, chunk)))) {
+            body(chunk);
+        }
+    } catch (...) {
+        // Clearing the ranges instead would race with a thief publishing the half it just took.
+        cancelled.store(true);
+        std::lock_guard<std::mutex> lock(mutex);
+        if (!failure) {
+            failure = std::current_exception();
+        }
+    }
+}
+
+bool thread_pool::take_own(int worker, std::size_t &chunk) {
+    std::atomic<std::uint64_t> &own = ranges[worker].range;
+    std::uint64_t range = own.load();
+    while (range_begin(range) < range_end(range)) {
+        if (own.compare_exchange_weak(range, pack(range_begin(range) + 1, range_end(range)))) {
+            chunk = range_begin(range);
+            return true;
+        }
+    }
+    return false;
+}
+
+bool thread_pool::steal(int worker) {
+    for (int offset = 1; offset < worker_count && !cancelled.load(); offset++) {
+        std::atomic<std::uint64_t> &victim = ranges[(worker + offset) % worker_count].range;
+        std::uint64_t range = victim.load();
+        while (range_begin(range) < range_end(range)) {
+            std::uint64_t middle = range_begin(range) + (range_end(range) - range_begin(range)) / 2;
+            if (victim.compare_exchange_weak(range, pack(range_begin(range), middle))) {
+                // our own range is empty, so nobody can steal from it in between
+                ranges[worker].range.store(pack(middle, range_end(range)));
+                return true;
+            }
+        }
+    }
+    return false;
+}
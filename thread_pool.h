@@ -0,0 +1,70 @@
+#ifndef CALCULATOR_THREAD_POOL_H
+#define CALCULATOR_THREAD_POOL_H
+
+#include <atomic>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <exception>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+// Fixed set of workers for data-parallel loops. The calling thread takes part as worker 0,
+// so a pool of one thread runs everything inline.
+class thread_pool {
+    // Chunks not taken yet by a worker, packed as begin << 32 | end so that the owner (taking from
+    // the front) and thieves (taking the back half) agree through a single compare-and-swap.
+    struct alignas(64) chunk_range {
+        std::atomic<std::uint64_t> range{0};
+    };
+
+    const int worker_count;
+    std::vector <std::thread> threads;
+    std::unique_ptr<chunk_range[]> ranges;
+
+    // held for a whole parallel_for(), so that callers on other threads take turns
+    std::mutex caller_mutex;
+    std::mutex mutex;
+    std::condition_variable wake;
+    std::condition_variable finished;
+    const std::function<void(std::size_t)> *job = nullptr;
+    std::uint64_t generation = 0;
+    int busy_threads = 0;
+    bool stopping = false;
+    std::exception_ptr failure;
+    // set once a body threw, so that no worker takes or steals another chunk
+    std::atomic<bool> cancelled{false};
+
+public:
+    explicit thread_pool(int threads = std::thread::hardware_concurrency());
+
+    ~thread_pool();
+
+    thread_pool(const thread_pool &) = delete;
+
+    thread_pool &operator=(const thread_pool &) = delete;
+
+    int size() const {
+        return worker_count;
+    }
+
+    // Calls body(chunk) for every chunk in [0, chunks) and returns once all of them are done.
+    // Each worker starts with an even share of the chunks and steals from the others when it runs out.
+    // Safe to call from several threads at once, which then run one after the other.
+    // Not reentrant: body must not call parallel_for() on the same pool.
+    void parallel_for(std::size_t chunks, const std::function<void(std::size_t)> &body);
+
+private:
+    void thread_loop(int worker);
+
+    void work(int worker, const std::function<void(std::size_t)> &body);
+
+    bool take_own(int worker, std::size_t &chunk);
+
+    bool steal(int worker);
+};
+
+#endif //CALCULATOR_THREAD_POOL_H